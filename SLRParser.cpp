@@ -1,662 +1,9947 @@
+#include <cerrno>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
 #include <iomanip>
 #include <iostream>
-#include <map>
-#include <set>
-#include <stack>
 #include <vector>
 #include <algorithm>
+#include <atomic>
+#include <bitset>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
-// Structure to represent an LR(0) item
-struct LR0Item {
-  char lhs;   // Left-hand side of the production
-  string rhs; // Right-hand side of the production
+// An LR(0) item packed into one integer: the index of its production in the
+// upper 16 bits and the position of the dot in the lower 16 bits
+typedef uint32_t LR0Item;
+
+inline LR0Item makeItem(int production, int dot) {
+  return ((LR0Item)production << 16) | dot;
+}
+inline int itemProduction(LR0Item item) { return item >> 16; }
+inline int itemDot(LR0Item item) { return item & 0xFFFF; }
+
+// A set of LR(0) items, kept as a sorted vector
+typedef vector<LR0Item> ItemSet;
+
+// Symbols are interned to compact 16-bit ids
+typedef uint16_t SymbolId;
+const size_t MAX_SYMBOLS = 65535;
+
+// Table that interns symbol names to dense ids in the order they are first
+// seen. Names are found by pointer and length, so a name can be looked up
+// straight from an input buffer without building a string.
+class SymbolTable {
+public:
+  SymbolId intern(const string &name) {
+    int id = find(name.data(), name.size());
+    if (id >= 0) {
+      return id;
+    }
+    if (names.size() == MAX_SYMBOLS) {
+      throw string("Too many grammar symbols");
+    }
+    if ((names.size() + 1) * 2 > slots.size()) {
+      grow();
+    }
+    names.push_back(name);
+    insertSlot(names.size() - 1);
+    return names.size() - 1;
+  }
+
+  // Function to find the id of a name, -1 if it was never interned
+  int find(const char *name, size_t length) const {
+    if (slots.empty()) {
+      return -1;
+    }
+    size_t mask = slots.size() - 1;
+    for (size_t slot = hashName(name, length) & mask;; slot = (slot + 1) & mask) {
+      int id = slots[slot];
+      if (id < 0) {
+        return -1;
+      }
+      if (names[id].size() == length &&
+          memcmp(names[id].data(), name, length) == 0) {
+        return id;
+      }
+    }
+  }
+
+  int find(const string &name) const { return find(name.data(), name.size()); }
+
+  const string &name(int id) const { return names[id]; }
+  int size() const { return names.size(); }
+  void clear() {
+    names.clear();
+    slots.clear();
+  }
+
+private:
+  vector<string> names;
+  vector<int> slots; // Open addressing, -1 when empty
+
+  static size_t hashName(const char *name, size_t length) {
+    uint64_t hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < length; i++) {
+      hash = (hash ^ (unsigned char)name[i]) * 1099511628211ULL;
+    }
+    return hash ^ (hash >> 29);
+  }
 
-  // Overloading the equality operator for set operations
-  bool operator==(const LR0Item &other) const {
-    return lhs == other.lhs && rhs == other.rhs;
+  void insertSlot(int id) {
+    size_t mask = slots.size() - 1;
+    size_t slot = hashName(names[id].data(), names[id].size()) & mask;
+    while (slots[slot] >= 0) {
+      slot = (slot + 1) & mask;
+    }
+    slots[slot] = id;
   }
 
-  // Overloading the less-than operator for set ordering
-  bool operator<(const LR0Item &other) const {
-    if (lhs != other.lhs) {
-      return lhs < other.lhs;
+  void grow() {
+    slots.assign(max<size_t>(16, slots.size() * 2), -1);
+    for (size_t id = 0; id < names.size(); id++) {
+      insertSlot(id);
     }
-    return rhs < other.rhs;
   }
 };
 
-// Function to compute the closure of an LR(0) item
-set<LR0Item> computeClosure(const LR0Item &item, vector<char> &nonTerminals,
-                            vector<vector<string> > &productions) {
-  set<LR0Item> closure;
-  closure.insert(item);
+// Token rule of a lexer: a terminal and the regular expression its lexemes
+// match. Skip rules (terminal -1) match text that produces no token, such
+// as whitespace or comments.
+struct LexerRule {
+  int terminal;
+  string pattern;
+};
 
-  vector<LR0Item> stack;
-  stack.push_back(item);
+// Value of LexerDfa::accept for states that accept a skip rule
+const int LEX_SKIP = -2;
 
-  while (!stack.empty()) {
+// Byte range [first, second) of a token, relative to the start of its record
+typedef pair<uint32_t, uint32_t> TokenSpan;
 
-    LR0Item currentItem = stack.back();
-    stack.pop_back();
+// A run of bytes a DFA state loops on, as up to four byte ranges, so the
+// scanner can consume it 16 bytes at a time instead of one transition per
+// byte. Identifier bodies, digit strings and whitespace all fit.
+struct LexerRun {
+  int numRanges = 0; // 0 when the state has no run to skip
+  uint8_t low[4];
+  uint8_t high[4];
 
-    size_t dotPosition = currentItem.rhs.find('.');
-    if (dotPosition != string::npos &&
-        dotPosition < currentItem.rhs.length() - 1) {
-
-      char nextSymbol = currentItem.rhs[dotPosition + 1];
-      if (find(nonTerminals.begin(), nonTerminals.end(), nextSymbol) !=
-          nonTerminals.end()) {
-        
-        // Next symbol is a non-terminal, expand it
-        for (const vector<string> &production : productions) {
-          if (production[0][0] == nextSymbol) {
-            LR0Item newItem;
-            newItem.lhs = nextSymbol;
-            newItem.rhs = "." + production[1];
-            if (closure.find(newItem) == closure.end()) {
-              closure.insert(newItem);
-              stack.push_back(newItem);
-            }
-          }
+  bool contains(unsigned char c) const {
+    for (int r = 0; r < numRanges; r++) {
+      if (c >= low[r] && c <= high[r]) {
+        return true;
+      }
+    }
+    return false;
+  }
+};
+
+// Minimized lexer DFA. Bytes are mapped to equivalence classes first, so a
+// state's row in the dense transition table has one entry per class.
+struct LexerDfa {
+  int numStates = 0;
+  int numClasses = 0;
+  uint8_t byteClass[256];
+  vector<int32_t> next;   // numStates x numClasses, -1 when there is no move
+  vector<int32_t> accept; // Terminal, LEX_SKIP or -1 per state
+  vector<LexerRun> runs;  // Self-loop run of every state
+
+  // Sizes of the intermediate automata, for --lexer-stats
+  int nfaStates = 0;
+  int subsetStates = 0;
+
+  // Function to skip the bytes of run starting at p
+  static const char *skipRun(const char *p, const char *end,
+                             const LexerRun &run) {
+#ifdef __SSE2__
+    while (end - p >= 16) {
+      __m128i bytes = _mm_loadu_si128((const __m128i *)p);
+      __m128i inRun = _mm_setzero_si128();
+      for (int r = 0; r < run.numRanges; r++) {
+        // c is in [low, high] iff c - low <= high - low as unsigned bytes
+        __m128i offset = _mm_sub_epi8(bytes, _mm_set1_epi8(run.low[r]));
+        __m128i width = _mm_set1_epi8(run.high[r] - run.low[r]);
+        inRun = _mm_or_si128(
+            inRun, _mm_cmpeq_epi8(_mm_min_epu8(offset, width), offset));
+      }
+      unsigned mask = _mm_movemask_epi8(inRun);
+      if (mask != 0xFFFF) {
+        return p + __builtin_ctz(~mask);
+      }
+      p += 16;
+    }
+#endif
+    while (p < end && run.contains(*p)) {
+      p++;
+    }
+    return p;
+  }
+
+  // Function to split [begin, end) into terminal ids with the longest match
+  // rule, ties going to the earlier rule. Skipped text produces no token.
+  // Returns false, with a -1 token appended, at text no rule matches. The
+  // span of every token is stored as well when spans is given.
+  bool tokenize(const char *begin, const char *end, vector<int> &tokens,
+                vector<TokenSpan> *spans = NULL) const {
+    tokens.clear();
+    if (spans != NULL) {
+      spans->clear();
+    }
+    const int32_t *table = next.data();
+    const int32_t *accepts = accept.data();
+    const LexerRun *stateRuns = runs.data();
+    const char *position = begin;
+    while (position < end) {
+      int state = 0;
+      int token = -1;
+      const char *tokenEnd = position;
+      const char *p = position;
+      while (p < end) {
+        state = table[state * numClasses + byteClass[(unsigned char)*p]];
+        if (state < 0) {
+          break;
+        }
+        p++;
+        if (stateRuns[state].numRanges > 0) {
+          p = skipRun(p, end, stateRuns[state]);
+        }
+        if (accepts[state] != -1) {
+          token = accepts[state];
+          tokenEnd = p;
+        }
+      }
+      if (tokenEnd == position) {
+        tokenEnd = position + 1;
+        token = -1;
+      }
+      if (token != LEX_SKIP) {
+        tokens.push_back(token);
+        if (spans != NULL) {
+          spans->push_back(TokenSpan(position - begin, tokenEnd - begin));
         }
       }
+      if (token == -1) {
+        return false;
+      }
+      position = tokenEnd;
     }
+    return true;
   }
+};
 
-  return closure;
-}
+// Resumable form of LexerDfa::tokenize for input that arrives in chunks.
+// A lexeme may span any number of chunks: the DFA state is kept between
+// calls, and the only bytes copied are those read past the last accepting
+// state, which the longest match rule may have to read again.
+class LexerStream {
+public:
+  LexerStream(const LexerDfa &dfa) : dfa(dfa) {}
+
+  void reset() {
+    state = 0;
+    token = -1;
+    inLexeme = false;
+    overshoot.clear();
+  }
+
+  // Function to scan a chunk, passing every finished token to emit, which
+  // returns false to stop. Returns false at text no rule matches.
+  template <typename Emit>
+  bool scan(const char *begin, const char *end, Emit &emit) {
+    const char *p = begin;
+    const char *mark = begin; // Just past the last accept in this chunk
+    while (p < end) {
+      int target = dfa.next[state * dfa.numClasses +
+                            dfa.byteClass[(unsigned char)*p]];
+      if (target >= 0) {
+        state = target;
+        inLexeme = true;
+        p++;
+        if (dfa.runs[state].numRanges > 0) {
+          p = LexerDfa::skipRun(p, end, dfa.runs[state]);
+        }
+        if (dfa.accept[state] != -1) {
+          token = dfa.accept[state];
+          mark = p;
+          overshoot.clear();
+        }
+        continue;
+      }
 
-// Function to compute the goto set for a given set of LR(0) items and a symbol
-set<LR0Item> computeGoto(const set<LR0Item> &items, char symbol,
-                         vector<char> &nonTerminals,
-                         vector<vector<string> > &productions) {
-  set<LR0Item> goToSet;
+      // The lexeme ends at the last accept; what was read after it is
+      // scanned again as the start of the next lexeme
+      if (!finishLexeme(emit)) {
+        return false;
+      }
+      p = mark;
+    }
 
-  for (const LR0Item &item : items) {
-    size_t dotPosition = item.rhs.find('.');
-    if (dotPosition != string::npos && dotPosition < item.rhs.length() - 1 &&
-        item.rhs[dotPosition + 1] == symbol) {
-      LR0Item newItem = item;
-      newItem.rhs[dotPosition] = symbol;
-      newItem.rhs[dotPosition + 1] = '.';
-      goToSet.insert(newItem);
+    // Keep what may have to be read again, but nothing before the last
+    // accept and nothing at all while no rule has accepted yet
+    if (inLexeme && token != -1) {
+      overshoot.append(mark, end);
     }
+    return true;
   }
 
-  for (const LR0Item &item :
-       computeClosure(*(goToSet.begin()), nonTerminals, productions)) {
-    goToSet.insert(item);
+  // Function to end the input, emitting the lexemes still pending
+  template <typename Emit>
+  bool finish(Emit &emit) {
+    while (inLexeme) {
+      if (!finishLexeme(emit)) {
+        return false;
+      }
+    }
+    return true;
   }
 
-  return goToSet;
-}
+private:
+  const LexerDfa &dfa;
+  int state = 0;
+  int token = -1;
+  bool inLexeme = false;
+  string overshoot; // Bytes of earlier chunks read past the last accept
 
-// A function to compute the first set for a non-terminal symbol
-set<char> computeFirstSet(char nonTerminal, vector<vector<string> > &productions,
-                          map<char, set<char> > &firstSets) {
-  
-  // Check if we've already computed the first set for this non-terminal
-  if (firstSets.find(nonTerminal) != firstSets.end()) {
-    return firstSets[nonTerminal];
-  }
-
-  // Create an empty set to hold the first symbols
-  set<char> first;
-  // Iterate through each production rule
-  for (auto &rule : productions) {
-    if (rule[0][0] == nonTerminal) {
-
-      // If the production rule starts with the non-terminal, add the first
-      // symbol of its RHS to the first set
-      for (auto &rhs : rule) {
-        int count = 0;
-        char firstSymbol = rhs[count];
-
-        if (isupper(firstSymbol)) {
-          if (firstSymbol != rule[0][0]) {
-            bool flag = true;
-            while (flag) {
-              set<char> firstSymbolFirstSet =
-                  computeFirstSet(firstSymbol, productions, firstSets);
-              if (firstSymbolFirstSet.find('~') != firstSymbolFirstSet.end()) {
-                firstSymbolFirstSet.erase('~');
-                count++;
-                firstSymbol = rhs[count];
-              } else {
-                flag = false;
-              }
-              first.insert(firstSymbolFirstSet.begin(),
-                           firstSymbolFirstSet.end());
-            }
+  template <typename Emit>
+  bool finishLexeme(Emit &emit) {
+    if (token == -1) {
+      return false;
+    }
+    if (token != LEX_SKIP && !emit(token)) {
+      return false;
+    }
+    state = 0;
+    token = -1;
+    inLexeme = false;
+    if (!overshoot.empty()) {
+      string rescan;
+      rescan.swap(overshoot);
+      return scan(rescan.data(), rescan.data() + rescan.size(), emit);
+    }
+    return true;
+  }
+};
+
+// Thompson NFA state: epsilon moves and at most one move on a set of bytes
+struct NfaState {
+  vector<int> epsilon;
+  bitset<256> bytes;
+  int next = -1;
+  int rule = -1; // Index of the rule accepted here, -1 if none
+};
+
+// Compiler from the regular expressions of lexer rules to one NFA. The
+// syntax is the usual one: | * + ? ( ) . [a-z] [^...] and the escapes \n \t
+// \r \0 \xHH \d \w \s \D \W \S, any other escaped byte standing for itself.
+class RegexCompiler {
+public:
+  RegexCompiler(vector<NfaState> &nfa) : nfa(nfa) {}
+
+  // Function to compile a pattern, returning its start and accepting state
+  pair<int, int> compile(const string &text) {
+    pattern = text;
+    position = 0;
+    pair<int, int> fragment = parseAlternation();
+    if (position < pattern.size()) {
+      fail("unexpected ')'");
+    }
+    return fragment;
+  }
+
+  // Function to compile a string matched literally
+  pair<int, int> compileLiteral(const string &text) {
+    int start = addState();
+    int end = start;
+    for (unsigned char c : text) {
+      bitset<256> bytes;
+      bytes.set(c);
+      int state = addState();
+      nfa[end].bytes = bytes;
+      nfa[end].next = state;
+      end = state;
+    }
+    return make_pair(start, end);
+  }
+
+private:
+  vector<NfaState> &nfa;
+  string pattern;
+  size_t position = 0;
+
+  [[noreturn]] void fail(const string &message) {
+    throw "pattern " + pattern + ": " + message;
+  }
+
+  int addState() {
+    nfa.push_back(NfaState());
+    return nfa.size() - 1;
+  }
+
+  bool atEnd() const { return position == pattern.size(); }
+
+  pair<int, int> parseAlternation() {
+    pair<int, int> fragment = parseSequence();
+    while (!atEnd() && pattern[position] == '|') {
+      position++;
+      pair<int, int> alternative = parseSequence();
+      int start = addState();
+      int end = addState();
+      nfa[start].epsilon.push_back(fragment.first);
+      nfa[start].epsilon.push_back(alternative.first);
+      nfa[fragment.second].epsilon.push_back(end);
+      nfa[alternative.second].epsilon.push_back(end);
+      fragment = make_pair(start, end);
+    }
+    return fragment;
+  }
+
+  pair<int, int> parseSequence() {
+    int start = addState();
+    int end = start;
+    while (!atEnd() && pattern[position] != '|' && pattern[position] != ')') {
+      pair<int, int> fragment = parseRepeat();
+      nfa[end].epsilon.push_back(fragment.first);
+      end = fragment.second;
+    }
+    return make_pair(start, end);
+  }
+
+  pair<int, int> parseRepeat() {
+    pair<int, int> fragment = parseAtom();
+    while (!atEnd() && (pattern[position] == '*' || pattern[position] == '+' ||
+                        pattern[position] == '?')) {
+      char op = pattern[position++];
+      int start = addState();
+      int end = addState();
+      nfa[start].epsilon.push_back(fragment.first);
+      nfa[fragment.second].epsilon.push_back(end);
+      if (op != '+') {
+        nfa[start].epsilon.push_back(end);
+      }
+      if (op != '?') {
+        nfa[fragment.second].epsilon.push_back(fragment.first);
+      }
+      fragment = make_pair(start, end);
+    }
+    return fragment;
+  }
+
+  pair<int, int> parseAtom() {
+    char c = pattern[position++];
+    bitset<256> bytes;
+    if (c == '(') {
+      pair<int, int> fragment = parseAlternation();
+      if (atEnd() || pattern[position] != ')') {
+        fail("missing ')'");
+      }
+      position++;
+      return fragment;
+    } else if (c == '*' || c == '+' || c == '?') {
+      fail(string("nothing to repeat before '") + c + "'");
+    } else if (c == '.') {
+      bytes.set();
+      bytes.reset('\n');
+    } else if (c == '[') {
+      bytes = parseClass();
+    } else if (c == '\\') {
+      bytes = parseEscape();
+    } else {
+      bytes.set((unsigned char)c);
+    }
+
+    int start = addState();
+    int end = addState();
+    nfa[start].bytes = bytes;
+    nfa[start].next = end;
+    return make_pair(start, end);
+  }
+
+  // Function to parse the byte after a backslash, which may stand for a
+  // whole class
+  bitset<256> parseEscape() {
+    if (atEnd()) {
+      fail("trailing '\\'");
+    }
+    char c = pattern[position++];
+    bitset<256> bytes;
+    switch (c) {
+    case 'n': bytes.set('\n'); break;
+    case 't': bytes.set('\t'); break;
+    case 'r': bytes.set('\r'); break;
+    case 'f': bytes.set('\f'); break;
+    case 'v': bytes.set('\v'); break;
+    case '0': bytes.set(0); break;
+    case 'x': {
+      if (position + 2 > pattern.size() || !isxdigit(pattern[position]) ||
+          !isxdigit(pattern[position + 1])) {
+        fail("expected two hex digits after \\x");
+      }
+      bytes.set(stoi(pattern.substr(position, 2), NULL, 16));
+      position += 2;
+      break;
+    }
+    case 'd': case 'D': case 'w': case 'W': case 's': case 'S':
+      for (int b = 0; b < 256; b++) {
+        char lower = tolower(c);
+        bool in = lower == 'd' ? isdigit(b)
+                : lower == 'w' ? isalnum(b) || b == '_'
+                               : b == ' ' || (b >= '\t' && b <= '\r');
+        bytes[b] = (b < 128 && in) != (bool)isupper(c);
+      }
+      break;
+    default:
+      bytes.set((unsigned char)c);
+      break;
+    }
+    return bytes;
+  }
+
+  static int singleByte(const bitset<256> &bytes) {
+    int b = 0;
+    while (!bytes[b]) {
+      b++;
+    }
+    return b;
+  }
+
+  // Function to parse a bracketed class after its '['
+  bitset<256> parseClass() {
+    bitset<256> bytes;
+    bool negated = !atEnd() && pattern[position] == '^';
+    if (negated) {
+      position++;
+    }
+    bool first = true;
+    while (!atEnd() && (pattern[position] != ']' || first)) {
+      first = false;
+      bitset<256> item;
+      int low = -1;
+      if (pattern[position] == '\\') {
+        position++;
+        item = parseEscape();
+        if (item.count() == 1) {
+          low = singleByte(item);
+        }
+      } else {
+        low = (unsigned char)pattern[position++];
+        item.set(low);
+      }
+      // A range; a '-' before ']' is an ordinary byte
+      if (low >= 0 && position + 1 < pattern.size() &&
+          pattern[position] == '-' && pattern[position + 1] != ']') {
+        position++;
+        int high = (unsigned char)pattern[position++];
+        if (high == '\\') {
+          bitset<256> last = parseEscape();
+          if (last.count() != 1) {
+            fail("a class cannot end a range");
           }
-          // If the first symbol is a non-terminal, compute its first set and
-          // add it to the first set of the current non-terminal
-        } else {
-          // If the first symbol is a terminal, add it to the first set of the
-          // current non-terminal
-          first.insert(firstSymbol);
+          high = singleByte(last);
+        }
+        if (high < low) {
+          fail("range out of order");
         }
+        for (int b = low; b <= high; b++) {
+          item.set(b);
+        }
+      }
+      bytes |= item;
+    }
+    if (atEnd()) {
+      fail("missing ']'");
+    }
+    position++;
+    return negated ? ~bytes : bytes;
+  }
+};
+
+// Function to collect the epsilon closure of a set of NFA states, returned
+// sorted
+void nfaClosure(const vector<NfaState> &nfa, vector<int> &states,
+                vector<char> &seen) {
+  vector<int> work = states;
+  for (int state : states) {
+    seen[state] = true;
+  }
+  while (!work.empty()) {
+    int state = work.back();
+    work.pop_back();
+    for (int target : nfa[state].epsilon) {
+      if (!seen[target]) {
+        seen[target] = true;
+        states.push_back(target);
+        work.push_back(target);
       }
     }
   }
-  // Cache the computed first set for future use
-  firstSets[nonTerminal] = first;
+  for (int state : states) {
+    seen[state] = false;
+  }
+  sort(states.begin(), states.end());
+}
 
-  // Return the computed first set
-  return first;
+// Function to compute the self-loop run of a DFA state as byte ranges
+LexerRun findRun(const LexerDfa &dfa, int state) {
+  LexerRun run;
+  int b = 0;
+  while (b < 256) {
+    auto loops = [&](int c) {
+      return dfa.next[state * dfa.numClasses + dfa.byteClass[c]] == state;
+    };
+    if (!loops(b)) {
+      b++;
+      continue;
+    }
+    int low = b;
+    while (b < 256 && loops(b)) {
+      b++;
+    }
+    if (run.numRanges == 4) {
+      run.numRanges = 0;
+      return run;
+    }
+    run.low[run.numRanges] = low;
+    run.high[run.numRanges] = b - 1;
+    run.numRanges++;
+  }
+  return run;
 }
 
-// A function to compute the follow set for a non-terminal symbol
-set<char> computeFollowSet(char nonTerminal,
-                           vector<vector<string> > &productions,
-                           map<char, set<char> > &firstSets,
-                           map<char, set<char> > &followSets) {
-  // Check if we've already computed the follow set for this non-terminal
-  if (followSets.find(nonTerminal) != followSets.end()) {
-    return followSets[nonTerminal];
+// Function to compile lexer rules into a minimized DFA. Every terminal in
+// literals is matched by its name and takes priority over the rules, which
+// take priority over each other in order; longer matches always win. Throws
+// on a malformed pattern or one matching the empty string.
+void compileLexer(const vector<LexerRule> &rules,
+                  const vector<pair<int, string> > &literals, LexerDfa &dfa) {
+  // One NFA with an epsilon move from the start to every rule
+  vector<NfaState> nfa(1);
+  vector<int> ruleToken;
+  RegexCompiler compiler(nfa);
+  for (size_t i = 0; i < literals.size() + rules.size(); i++) {
+    pair<int, int> fragment;
+    if (i < literals.size()) {
+      fragment = compiler.compileLiteral(literals[i].second);
+      ruleToken.push_back(literals[i].first);
+    } else {
+      const LexerRule &rule = rules[i - literals.size()];
+      fragment = compiler.compile(rule.pattern);
+      ruleToken.push_back(rule.terminal < 0 ? LEX_SKIP : rule.terminal);
+    }
+    nfa[0].epsilon.push_back(fragment.first);
+    nfa[fragment.second].rule = i;
+  }
+  dfa.nfaStates = nfa.size();
+
+  // Bytes that every NFA move treats alike share a class
+  map<vector<bool>, int> classOf;
+  for (int b = 0; b < 256; b++) {
+    vector<bool> signature;
+    for (const NfaState &state : nfa) {
+      if (state.next >= 0) {
+        signature.push_back(state.bytes[b]);
+      }
+    }
+    auto inserted = classOf.insert(make_pair(signature, (int)classOf.size()));
+    dfa.byteClass[b] = inserted.first->second;
+  }
+  dfa.numClasses = classOf.size();
+  vector<int> classByte(dfa.numClasses);
+  for (int b = 255; b >= 0; b--) {
+    classByte[dfa.byteClass[b]] = b;
   }
-  // Create an empty set to hold the follow symbols
-  set<char> follow;
 
-  // The start symbol's follow set contains the end-of-input symbol ($)
-  if (nonTerminal == 'D') {
-    follow.insert('$');
+  // Subset construction
+  vector<char> seen(nfa.size(), false);
+  vector<vector<int> > subsets(1, vector<int>(1, 0));
+  nfaClosure(nfa, subsets[0], seen);
+  map<vector<int>, int> subsetIndex;
+  subsetIndex[subsets[0]] = 0;
+  vector<int32_t> next;
+  vector<int32_t> accept;
+  for (size_t s = 0; s < subsets.size(); s++) {
+    int bestRule = -1;
+    for (int state : subsets[s]) {
+      if (nfa[state].rule >= 0 &&
+          (bestRule < 0 || nfa[state].rule < bestRule)) {
+        bestRule = nfa[state].rule;
+      }
+    }
+    if (s == 0 && bestRule >= 0) {
+      throw "pattern " + rules[bestRule - literals.size()].pattern +
+          ": matches the empty string";
+    }
+    accept.push_back(bestRule < 0 ? -1 : ruleToken[bestRule]);
+
+    for (int c = 0; c < dfa.numClasses; c++) {
+      vector<int> target;
+      for (int state : subsets[s]) {
+        if (nfa[state].next >= 0 && nfa[state].bytes[classByte[c]]) {
+          target.push_back(nfa[state].next);
+        }
+      }
+      if (target.empty()) {
+        next.push_back(-1);
+        continue;
+      }
+      sort(target.begin(), target.end());
+      target.erase(unique(target.begin(), target.end()), target.end());
+      nfaClosure(nfa, target, seen);
+      auto inserted = subsetIndex.insert(make_pair(target, (int)subsets.size()));
+      if (inserted.second) {
+        subsets.push_back(target);
+      }
+      next.push_back(inserted.first->second);
+    }
+  }
+  int numSubsets = subsets.size();
+  dfa.subsetStates = numSubsets;
+
+  // Moore minimization: split blocks by accepted token, then by the blocks
+  // their moves lead to, until nothing splits
+  vector<int> block(numSubsets);
+  int numBlocks = 0;
+  for (bool changed = true; changed;) {
+    map<vector<int>, int> blockOf;
+    vector<int> refined(numSubsets);
+    for (int s = 0; s < numSubsets; s++) {
+      vector<int> signature(1, numBlocks == 0 ? accept[s] : block[s]);
+      if (numBlocks > 0) {
+        for (int c = 0; c < dfa.numClasses; c++) {
+          int target = next[s * dfa.numClasses + c];
+          signature.push_back(target < 0 ? -1 : block[target]);
+        }
+      }
+      // Blocks are numbered by first member, so the start state stays 0
+      auto inserted = blockOf.insert(make_pair(signature, (int)blockOf.size()));
+      refined[s] = inserted.first->second;
+    }
+    changed = numBlocks == 0 || (int)blockOf.size() != numBlocks;
+    numBlocks = blockOf.size();
+    block = refined;
   }
 
-  // Iterate through each production rule
-  for (auto &rule : productions) {
-    for (int i = 0; i < rule[1].size(); i++) {
-      string rhsSymbol = rule[1];
+  dfa.numStates = numBlocks;
+  dfa.next.assign(numBlocks * dfa.numClasses, -1);
+  dfa.accept.assign(numBlocks, -1);
+  for (int s = 0; s < numSubsets; s++) {
+    dfa.accept[block[s]] = accept[s];
+    for (int c = 0; c < dfa.numClasses; c++) {
+      int target = next[s * dfa.numClasses + c];
+      dfa.next[block[s] * dfa.numClasses + c] = target < 0 ? -1 : block[target];
+    }
+  }
+  dfa.runs.clear();
+  for (int s = 0; s < dfa.numStates; s++) {
+    dfa.runs.push_back(findRun(dfa, s));
+  }
+}
 
-      for (int j = 0; j < rhsSymbol.length(); j++) {
-        if (rhsSymbol[j] == nonTerminal) {
-          if (isupper(rhsSymbol[j + 1])) {
-            int count = 1;
-            bool flag = true;
-            while (flag) {
-              set<char> firstSymbolFirstSet =
-                  computeFirstSet(rhsSymbol[j + count], productions, firstSets);
+// A production as read from a grammar, with its symbols still as names
+struct NamedProduction {
+  string lhs;
+  vector<string> rhs; // Empty for an epsilon production
+};
 
+// Grammar with every symbol replaced by a dense id. Terminals take the ids
+// 0..numTerminals-1 in ACTION column order with '$' last, non-terminals the
+// ids after them in GOTO column order.
+struct Grammar {
+  int numTerminals = 0;
+  SymbolTable symbols;           // Name of every symbol id
+  vector<SymbolId> lhs;          // Symbol id of each production's LHS
+  vector<vector<SymbolId> > rhs; // Symbol ids of each production's RHS
+  vector<int> symbolRank;        // Order in which goto targets are numbered
+
+  // Single-character grammars (S->AA) parse input character by character;
+  // grammars with named symbols read whitespace-separated symbol names,
+  // unless they declare lexer rules, in which case the lexer splits the
+  // input into terminals
+  bool namedSymbols = false;
+  vector<LexerRule> lexerRules; // The %token and %skip rules, in order
+  LexerDfa lexer;               // Compiled from lexerRules and the literals
+
+  int numSymbols() const { return symbols.size(); }
+  int numNonTerminals() const { return symbols.size() - numTerminals; }
+  bool isTerminal(int symbol) const { return symbol < numTerminals; }
+  const string &name(int symbol) const { return symbols.name(symbol); }
+  bool hasLexer() const { return !lexerRules.empty(); }
+};
 
-              if (firstSymbolFirstSet.find('~') != firstSymbolFirstSet.end()) {
+// Function to number the symbols of a grammar and translate its productions
+// into symbol ids. Every LHS and every name in nonTerminalOrder is a
+// non-terminal, everything else a terminal. Both kinds are numbered in the
+// given order first and in order of appearance after that, and '$' is
+// added as the last terminal.
+void buildGrammar(Grammar &grammar, const vector<NamedProduction> &productions,
+                  const vector<string> &terminalOrder,
+                  const vector<string> &nonTerminalOrder) {
+  SymbolTable nonTerminalNames;
+  for (const string &name : nonTerminalOrder) {
+    nonTerminalNames.intern(name);
+  }
+  for (const NamedProduction &production : productions) {
+    nonTerminalNames.intern(production.lhs);
+  }
 
+  grammar.symbols.clear();
+  for (const string &name : terminalOrder) {
+    if (name != "$" && nonTerminalNames.find(name) < 0) {
+      grammar.symbols.intern(name);
+    }
+  }
+  for (const NamedProduction &production : productions) {
+    for (const string &name : production.rhs) {
+      if (name != "$" && nonTerminalNames.find(name) < 0) {
+        grammar.symbols.intern(name);
+      }
+    }
+  }
+  grammar.symbols.intern("$");
+  grammar.numTerminals = grammar.symbols.size();
 
-                firstSymbolFirstSet.erase('~');
-                count++;
-                follow.insert(firstSymbolFirstSet.begin(),
-                              firstSymbolFirstSet.end());
-              } else if (rhsSymbol[j + count] == '\0' && rhsSymbol[j] != rule[0][0]) {
+  for (int i = 0; i < nonTerminalNames.size(); i++) {
+    grammar.symbols.intern(nonTerminalNames.name(i));
+  }
 
-                set<char> lhsFollowSet = computeFollowSet(
-                    rule[0][0], productions, firstSets, followSets);
+  grammar.lhs.clear();
+  grammar.rhs.clear();
+  grammar.lexerRules.clear();
+  for (const NamedProduction &production : productions) {
+    grammar.lhs.push_back(grammar.symbols.find(production.lhs));
+    vector<SymbolId> rhs;
+    for (const string &name : production.rhs) {
+      rhs.push_back(grammar.symbols.find(name));
+    }
+    grammar.rhs.push_back(rhs);
+  }
+  if (grammar.lhs.size() > 0xFFFF) {
+    throw string("Too many productions");
+  }
 
-                follow.insert(lhsFollowSet.begin(), lhsFollowSet.end());
+  // Goto targets are numbered in name order, which for single-character
+  // grammars is the character order they have always used
+  vector<int> byName(grammar.numSymbols());
+  for (int i = 0; i < grammar.numSymbols(); i++) {
+    byName[i] = i;
+  }
+  sort(byName.begin(), byName.end(), [&grammar](int a, int b) {
+    return grammar.name(a) < grammar.name(b);
+  });
+  grammar.symbolRank.assign(grammar.numSymbols(), 0);
+  for (int i = 0; i < grammar.numSymbols(); i++) {
+    grammar.symbolRank[byName[i]] = i;
+  }
+}
 
-                flag = false;
-              } else {
+// Function to compile a single-character grammar as read by getProductions.
+// '~' is dropped, so an RHS of '~' becomes an empty RHS, and upper-case
+// letters without productions are still non-terminals.
+void compileGrammar(Grammar &grammar, vector<char> &nonTerminals,
+                    vector<char> &terminals,
+                    vector<vector<string> > &productions) {
+  vector<NamedProduction> namedProductions;
+  vector<string> terminalOrder;
+  vector<string> nonTerminalOrder;
 
-                follow.insert(firstSymbolFirstSet.begin(),
-                              firstSymbolFirstSet.end());
-                flag = false;
-              }
-            }
-          } else if (rhsSymbol[j + 1] == '\0' && rhsSymbol[j] != rule[0][0]) {
+  for (char symbol : terminals) {
+    if (symbol != '~') {
+      terminalOrder.push_back(string(1, symbol));
+    }
+  }
+  for (char symbol : nonTerminals) {
+    nonTerminalOrder.push_back(string(1, symbol));
+  }
 
-            set<char> lhsFollowSet = computeFollowSet(rule[0][0], productions,
-                                                      firstSets, followSets);
+  for (const vector<string> &production : productions) {
+    NamedProduction namedProduction;
+    namedProduction.lhs = production[0];
+    for (char symbol : production[1]) {
+      if (symbol == '~') {
+        continue;
+      }
+      namedProduction.rhs.push_back(string(1, symbol));
+      if (isupper(symbol)) {
+        nonTerminalOrder.push_back(string(1, symbol));
+      }
+    }
+    namedProductions.push_back(namedProduction);
+  }
 
-            follow.insert(lhsFollowSet.begin(), lhsFollowSet.end());
-          } else {
+  buildGrammar(grammar, namedProductions, terminalOrder, nonTerminalOrder);
+  grammar.namedSymbols = false;
+}
 
-            follow.insert(rhsSymbol[j + 1]);
-          }
-        }
+// Function to split a line of a named grammar into symbols. Symbols are
+// separated by whitespace and a symbol in single quotes is taken literally,
+// so that '|' or '->' can be terminals.
+vector<pair<string, bool> > splitGrammarLine(const string &line) {
+  vector<pair<string, bool> > words; // Word and whether it was quoted
+  size_t i = 0;
+  while (i < line.size()) {
+    if (isspace((unsigned char)line[i])) {
+      i++;
+    } else if (line[i] == '\'' && line.find('\'', i + 1) != string::npos) {
+      size_t close = line.find('\'', i + 1);
+      words.push_back(make_pair(line.substr(i + 1, close - i - 1), true));
+      i = close + 1;
+    } else {
+      size_t end = i;
+      while (end < line.size() && !isspace((unsigned char)line[end])) {
+        end++;
       }
+      words.push_back(make_pair(line.substr(i, end - i), false));
+      i = end;
     }
   }
-  // Cache the computed follow set for future use
-  followSets[nonTerminal] = follow;
-  // Return the computed follow set
-  return follow;
+  return words;
 }
 
-// Function to compute the canonical collection of LR(0) items
-vector<set<LR0Item> >
-computeCanonicalCollection(vector<char> &nonTerminals, vector<char> &terminals,
-                           vector<vector<string> > &productions,
-                           map<pair<int, char>, string> &parsingTable,
-                           map<pair<int, char>, int> &gotoTable) {
-  vector<set<LR0Item> > canonicalCollection;
-  set<LR0Item> initialItem;
+// Function to read a grammar with named symbols:
+//   expr   -> expr + term | term
+//   term   -> term * factor | factor
+//   factor -> ( expr ) | id
+// A line starting with '|' adds alternatives to the previous LHS, '~' or
+// %empty stands for the empty string and '#' starts a comment line. The
+// first LHS is the start symbol; the augmented start production is added
+// as production 0. Input is then read as whitespace-separated names, unless
+// the grammar gives lexer rules:
+//   %token id [A-Za-z_][A-Za-z0-9_]*
+//   %skip [ \t]+
+// where the pattern is the rest of the line. Every terminal without a
+// %token rule is then matched literally by its name. Returns false with a
+// message on a malformed line or pattern.
+bool readNamedGrammar(istream &in, Grammar &grammar, string &error) {
+  vector<NamedProduction> productions(1);
+  vector<pair<string, string> > directives; // Token name ("" to skip), pattern
+  vector<string> tokenNames;
+  string line;
+  string lhs;
+  int lineNumber = 0;
+
+  while (getline(in, line)) {
+    lineNumber++;
+    vector<pair<string, bool> > words = splitGrammarLine(line);
+    if (words.empty() || (!words[0].second && words[0].first[0] == '#')) {
+      continue;
+    }
+
+    if (!words[0].second &&
+        (words[0].first == "%token" || words[0].first == "%skip")) {
+      bool skip = words[0].first == "%skip";
+      size_t nameCount = skip ? 0 : 1;
+      if (words.size() < 2 + nameCount) {
+        error = "line " + to_string(lineNumber) + ": expected " +
+                (skip ? "'%skip pattern'" : "'%token name pattern'");
+        return false;
+      }
+      // The pattern is the rest of the line, spaces included
+      size_t position = line.find(words[0].first) + words[0].first.size();
+      if (!skip) {
+        position = line.find_first_not_of(" \t", position);
+        position = line.find_first_of(" \t", position);
+      }
+      size_t first = line.find_first_not_of(" \t", position);
+      size_t last = line.find_last_not_of(" \t\r");
+      string name = skip ? "" : words[1].first;
+      if (name == "$") {
+        error = "line " + to_string(lineNumber) + ": '$' is reserved";
+        return false;
+      }
+      directives.push_back(make_pair(name, line.substr(first, last - first + 1)));
+      if (!skip) {
+        tokenNames.push_back(name);
+      }
+      continue;
+    }
 
-  // Create a map to cache the computed first sets
-  map<char, set<char> > firstSets;
+    size_t start;
+    if (words.size() >= 2 && !words[1].second && words[1].first == "->") {
+      lhs = words[0].first;
+      start = 2;
+    } else if (!words[0].second && words[0].first == "|" && !lhs.empty()) {
+      start = 1;
+    } else {
+      error = "line " + to_string(lineNumber) + ": expected 'name -> symbols'";
+      return false;
+    }
 
-  // Iterate through each non-terminal symbol and compute its first set
-  for (auto &rule : productions) {
-    char nonTerminal = rule[0][0];
-    computeFirstSet(nonTerminal, productions, firstSets);
+    NamedProduction production;
+    production.lhs = lhs;
+    for (size_t i = start; i <= words.size(); i++) {
+      if (i == words.size() || (!words[i].second && words[i].first == "|")) {
+        productions.push_back(production);
+        production.rhs.clear();
+      } else if (words[i].second ||
+                 (words[i].first != "~" && words[i].first != "%empty")) {
+        if (words[i].first == "$") {
+          error = "line " + to_string(lineNumber) + ": '$' is reserved";
+          return false;
+        }
+        production.rhs.push_back(words[i].first);
+      }
+    }
   }
-    
-  cout << "First of Production Rules: \n" << endl;
 
-  for (auto &entry : firstSets) {
-    char nonTerminal = entry.first;
-    set<char> firstSet = entry.second;
+  if (productions.size() == 1) {
+    error = "no productions";
+    return false;
+  }
 
-    cout << "FIRST(" << nonTerminal << ") = {";
-    for (auto &symbol : firstSet) {
-      cout << symbol << " ";
+  // The augmented start symbol takes primes until its name is unused
+  string start = productions[1].lhs + "'";
+  bool taken = true;
+  while (taken) {
+    taken = false;
+    for (const NamedProduction &production : productions) {
+      taken = taken || production.lhs == start ||
+              find(production.rhs.begin(), production.rhs.end(), start) !=
+                  production.rhs.end();
     }
-    cout << "}" << endl;
+    if (taken) {
+      start += "'";
+    }
+  }
+  productions[0].lhs = start;
+  productions[0].rhs.push_back(productions[1].lhs);
+
+  buildGrammar(grammar, productions, tokenNames, vector<string>(1, start));
+  grammar.namedSymbols = true;
+
+  vector<char> hasRule(grammar.numTerminals, false);
+  for (const pair<string, string> &directive : directives) {
+    LexerRule rule;
+    rule.terminal = -1;
+    rule.pattern = directive.second;
+    if (!directive.first.empty()) {
+      rule.terminal = grammar.symbols.find(directive.first);
+      if (!grammar.isTerminal(rule.terminal)) {
+        error = "%token " + directive.first + ": not a terminal";
+        return false;
+      }
+      hasRule[rule.terminal] = true;
+    }
+    grammar.lexerRules.push_back(rule);
   }
 
-  map<char, set<char> > followSets;
+  if (grammar.hasLexer()) {
+    // '$' is the end of the input, never a lexeme
+    vector<pair<int, string> > literals;
+    for (int t = 0; t + 1 < grammar.numTerminals; t++) {
+      if (!hasRule[t]) {
+        literals.push_back(make_pair(t, grammar.name(t)));
+      }
+    }
+    try {
+      compileLexer(grammar.lexerRules, literals, grammar.lexer);
+    } catch (string e) {
+      error = e;
+      return false;
+    }
+  }
+  return true;
+}
 
-  for (auto &rule : productions) {
-    char nonTerminal = rule[0][0];
-    computeFollowSet(nonTerminal, productions, firstSets, followSets);
+// Function to write a grammar back out in the format it was read in
+void writeGrammar(ostream &out, const Grammar &grammar) {
+  for (const LexerRule &rule : grammar.lexerRules) {
+    if (rule.terminal < 0) {
+      out << "%skip " << rule.pattern << "\n";
+    } else {
+      out << "%token " << grammar.name(rule.terminal) << " " << rule.pattern
+          << "\n";
+    }
   }
-  cout << "\nFollow of Production Rules: \n" << endl;
 
-  for (auto &entry : followSets) {
-    char nonTerminal = entry.first;
-    set<char> followSet = entry.second;
+  // Production 0 is the augmented start production the readers add
+  for (size_t p = 1; p < grammar.lhs.size(); p++) {
+    if (!grammar.namedSymbols) {
+      out << grammar.name(grammar.lhs[p]) << "->";
+      for (SymbolId symbol : grammar.rhs[p]) {
+        out << grammar.name(symbol);
+      }
+      out << (grammar.rhs[p].empty() ? "~" : "") << "\n";
+      continue;
+    }
 
-    cout << "FOLLOW(" << nonTerminal << ") = {";
-    for (auto &symbol : followSet) {
-      cout << symbol << " ";
+    out << grammar.name(grammar.lhs[p]) << " ->";
+    for (SymbolId symbol : grammar.rhs[p]) {
+      const string &name = grammar.name(symbol);
+      bool quote = name == "|" || name == "->" || name == "~" ||
+                   name == "%empty" || name[0] == '#' || name[0] == '\'';
+      out << " " << (quote ? "'" + name + "'" : name);
     }
-    cout << "}" << endl;
+    out << (grammar.rhs[p].empty() ? " %empty" : "") << "\n";
   }
+}
 
-  // Add the initial item to the canonical collection
-  LR0Item item;
-  item.lhs = nonTerminals[0];
-  item.rhs = "." + productions[0][1];
-  initialItem.insert(item);
-  initialItem = computeClosure(item, nonTerminals, productions);
-  canonicalCollection.push_back(initialItem);
+// Kinds of entries in the ACTION table. Each action is packed into a single
+// int: the kind lives in the low two bits and the target (state for a shift,
+// production index for a reduce) in the remaining bits.
+enum ActionKind {
+  ACTION_ERROR = 0,
+  ACTION_SHIFT = 1,
+  ACTION_REDUCE = 2,
+  ACTION_ACCEPT = 3
+};
 
+inline int packAction(int kind, int target) { return (target << 2) | kind; }
+inline int actionKind(int action) { return action & 3; }
+inline int actionTarget(int action) { return action >> 2; }
+
+// Dense ACTION/GOTO tables laid out row-major as state x symbol id. Terminals
+// and non-terminals are numbered by their column in the respective table.
+struct ParseTables {
+  int numStates = 0;
+  vector<string> terminals;    // ACTION columns, '$' is always the last one
+  vector<string> nonTerminals; // GOTO columns
+  int terminalIndex[256]; // Character -> column of a one-character terminal
+  vector<int> action;        // Packed actions, ACTION_ERROR when empty
+  vector<int> goTo;          // Target states, -1 when empty
+  vector<int> productionLhs;    // GOTO column of each production's LHS
+  vector<int> productionLength; // Number of RHS symbols of each production
+
+  // Filled by eliminateUnitReductions: for every GOTO cell that bypasses a
+  // chain of unit reductions, the offset in unitChains of the chain length
+  // followed by its productions in the order they were reduced, else -1.
+  // Empty when no chain was bypassed.
+  vector<int> gotoChain;
+  vector<int> unitChains;
+
+  // Every ACTION cell where items of the state want different actions,
+  // with all of them: the shift first, then the reductions in the order of
+  // the closure. The cell itself keeps the last of them, as it always has.
+  map<int, vector<int> > conflicts;
+
+  int actionAt(int state, int terminal) const {
+    return action[state * terminals.size() + terminal];
+  }
 
+  int gotoAt(int state, int nonTerminal) const {
+    return goTo[state * nonTerminals.size() + nonTerminal];
+  }
+};
 
-  for (size_t i = 0; i < canonicalCollection.size(); i++) {
-    set<LR0Item> currentItemSet = canonicalCollection[i];
+// Read-only view of the arrays the parser needs. It points either into a
+// ParseTables or into a memory-mapped table cache, so the parse loop does
+// not care where the tables came from.
+struct TableView {
+  int numStates = 0;
+  int numTerminals = 0;
+  int numNonTerminals = 0;
+  const int *terminalIndex = NULL; // 256 entries
+  const int *action = NULL;
+  const int *goTo = NULL;
+  const int *productionLhs = NULL;
+  const int *productionLength = NULL;
+  const int *gotoChain = NULL; // NULL when no unit reductions are bypassed
+  const int *unitChains = NULL;
+
+  int actionAt(int state, int terminal) const {
+    return action[state * numTerminals + terminal];
+  }
 
-    // Find all unique symbols following the dot in the current item set
-    set<char> symbols;
-    for (const LR0Item &item : currentItemSet) {
+  int gotoAt(int state, int nonTerminal) const {
+    return goTo[state * numNonTerminals + nonTerminal];
+  }
+};
 
-      size_t dotPosition = item.rhs.find('.');
+// Function to view tables built in memory
+TableView viewTables(const ParseTables &tables) {
+  TableView view;
+  view.numStates = tables.numStates;
+  view.numTerminals = tables.terminals.size();
+  view.numNonTerminals = tables.nonTerminals.size();
+  view.terminalIndex = tables.terminalIndex;
+  view.action = tables.action.data();
+  view.goTo = tables.goTo.data();
+  view.productionLhs = tables.productionLhs.data();
+  view.productionLength = tables.productionLength.data();
+  if (!tables.gotoChain.empty()) {
+    view.gotoChain = tables.gotoChain.data();
+    view.unitChains = tables.unitChains.data();
+  }
+  return view;
+}
 
-      if (dotPosition != string::npos && dotPosition < item.rhs.length() - 1) {
+// Function to set up the symbol columns and production metadata of the tables
+void initParseTables(ParseTables &tables, const Grammar &grammar) {
+  fill(begin(tables.terminalIndex), end(tables.terminalIndex), -1);
 
-        char symbol = item.rhs[dotPosition + 1];
-        symbols.insert(symbol);
-      }
+  tables.terminals.clear();
+  tables.nonTerminals.clear();
+  for (int i = 0; i < grammar.numSymbols(); i++) {
+    if (grammar.isTerminal(i)) {
+      tables.terminals.push_back(grammar.name(i));
+    } else {
+      tables.nonTerminals.push_back(grammar.name(i));
+    }
+  }
+
+  // The last column, '$', gets no character: records end where their
+  // range does, so a '$' inside one is outside the grammar
+  for (size_t i = 0; i + 1 < tables.terminals.size(); i++) {
+    if (tables.terminals[i].size() == 1) {
+      tables.terminalIndex[(unsigned char)tables.terminals[i][0]] = i;
     }
-    // Compute the Goto sets for each symbol and add them to the canonical
-    // collection
-    for (char symbol : symbols) {
+  }
 
-      set<LR0Item> goToSet =
-          computeGoto(currentItemSet, symbol, nonTerminals, productions);
+  tables.productionLhs.clear();
+  tables.productionLength.clear();
+  for (size_t i = 0; i < grammar.lhs.size(); i++) {
+    tables.productionLhs.push_back(grammar.lhs[i] - grammar.numTerminals);
+    tables.productionLength.push_back(grammar.rhs[i].size());
+  }
+}
 
+// Function to collect the items non-terminal start contributes to a
+// closure: X -> .w for each X reachable from it through leftmost
+// non-terminals, itself included. productionsOf lists the productions of
+// every non-terminal; visitedBy is scratch space per non-terminal that
+// must not hold start on entry.
+void collectNonTerminalClosure(const Grammar &grammar,
+                               const vector<vector<int> > &productionsOf,
+                               int start, vector<int> &visitedBy,
+                               vector<int> &stack, ItemSet &closure) {
+  closure.clear();
+  visitedBy[start] = start;
+  stack.push_back(start);
 
+  while (!stack.empty()) {
+    int nonTerminal = stack.back();
+    stack.pop_back();
 
-      // Check if the computed Goto set already exists in the canonical
-      // collection
-      auto it =
-          find(canonicalCollection.begin(), canonicalCollection.end(), goToSet);
-      if (it == canonicalCollection.end()) {
+    for (int production : productionsOf[nonTerminal]) {
+      closure.push_back(makeItem(production, 0));
 
-        canonicalCollection.push_back(goToSet);
+      const vector<SymbolId> &rhs = grammar.rhs[production];
+      if (!rhs.empty() && !grammar.isTerminal(rhs[0])) {
+        int next = rhs[0] - grammar.numTerminals;
+        if (visitedBy[next] != start) {
+          visitedBy[next] = start;
+          stack.push_back(next);
+        }
       }
     }
   }
-  // Construct the parsing table
-  for (size_t i = 0; i < canonicalCollection.size(); i++) {
-    const set<LR0Item> &itemSet = canonicalCollection[i];
-
-    for (const LR0Item &item : itemSet) {
-      size_t dotPosition = item.rhs.find('.');
-      if (dotPosition != string::npos && dotPosition < item.rhs.length() - 1) {
-        char symbol = item.rhs[dotPosition + 1];
-        if (find(terminals.begin(), terminals.end(), symbol) !=
-            terminals.end()) {
-          // Shift action
-          int nextState = distance(
-              canonicalCollection.begin(),
-              find(canonicalCollection.begin(), canonicalCollection.end(),
-                   computeGoto(itemSet, symbol, nonTerminals, productions)));
-          parsingTable[make_pair(i, symbol)] = "Shift " + to_string(nextState);
-        } else {
-          // Goto action
-          int nextState = distance(
-              canonicalCollection.begin(),
-              find(canonicalCollection.begin(), canonicalCollection.end(),
-                   computeGoto(itemSet, symbol, nonTerminals, productions)));
-          gotoTable[make_pair(i, symbol)] = nextState;
-        }
-      } else if (item.lhs != 'D') {
+  sort(closure.begin(), closure.end());
+}
 
-        vector<string> toSend;
+// Function to compute, once per grammar, the items every non-terminal
+// contributes to a closure. Indexed by non-terminal number.
+vector<ItemSet> computeNonTerminalClosures(const Grammar &grammar) {
+  int numNonTerminals = grammar.numNonTerminals();
+  vector<vector<int> > productionsOf(numNonTerminals);
+  for (size_t i = 0; i < grammar.lhs.size(); i++) {
+    productionsOf[grammar.lhs[i] - grammar.numTerminals].push_back(i);
+  }
 
-        toSend.push_back(string(1, item.lhs));
-        toSend.push_back(item.rhs.substr(0, item.rhs.length() - 1));
+  vector<ItemSet> closures(numNonTerminals);
+  vector<int> visitedBy(numNonTerminals, -1);
+  vector<int> stack;
 
-        int productionIndex =
-            distance(productions.begin(),
-                     find(productions.begin(), productions.end(), toSend));
+  for (int start = 0; start < numNonTerminals; start++) {
+    collectNonTerminalClosure(grammar, productionsOf, start, visitedBy, stack,
+                              closures[start]);
+  }
 
-        if (followSets.find(item.lhs) != followSets.end()) {
-          for (auto &follow : followSets[item.lhs]) {
-            parsingTable[make_pair(i, follow)] =
-                "Reduce " + to_string(productionIndex);
-          }
-        }
-        // Reduce action
+  return closures;
+}
+
+// Function to compute the closure of a kernel by merging the precomputed
+// closures of the non-terminals that follow a dot. `expanded` and `added`
+// are scratch flags per non-terminal and per production, all false on entry
+// and on return.
+ItemSet computeClosure(const ItemSet &kernel, const Grammar &grammar,
+                       const vector<ItemSet> &nonTerminalClosures,
+                       vector<char> &expanded, vector<char> &added) {
+  ItemSet closure = kernel;
+  for (LR0Item item : kernel) {
+    added[itemProduction(item)] = itemDot(item) == 0;
+  }
+
+  vector<int> expandedList;
+  for (LR0Item item : kernel) {
+    const vector<SymbolId> &rhs = grammar.rhs[itemProduction(item)];
+    int dot = itemDot(item);
+    if (dot < (int)rhs.size() && !grammar.isTerminal(rhs[dot])) {
+      int nonTerminal = rhs[dot] - grammar.numTerminals;
+      if (expanded[nonTerminal]) {
+        continue;
+      }
+      expanded[nonTerminal] = true;
+      expandedList.push_back(nonTerminal);
+
+      for (LR0Item closureItem : nonTerminalClosures[nonTerminal]) {
+        if (!added[itemProduction(closureItem)]) {
+          added[itemProduction(closureItem)] = true;
+          closure.push_back(closureItem);
+        }
+      }
+    }
+  }
+
+  for (int nonTerminal : expandedList) {
+    expanded[nonTerminal] = false;
+  }
+  for (LR0Item item : closure) {
+    added[itemProduction(item)] = false;
+  }
+
+  sort(closure.begin(), closure.end());
+  return closure;
+}
+
+// Hash over the items of a set, used to index states by their kernel
+struct ItemSetHash {
+  size_t operator()(const ItemSet &items) const {
+    size_t hash = 14695981039346656037ULL;
+    for (LR0Item item : items) {
+      hash = (hash ^ item) * 1099511628211ULL;
+    }
+    return hash;
+  }
+};
+
+// Matrix of bitsets with one row per non-terminal and one bit per terminal,
+// used for the FIRST and FOLLOW sets
+struct TerminalSets {
+  int wordsPerRow = 0;
+  vector<uint64_t> bits;
+
+  void init(int rows, int numTerminals) {
+    wordsPerRow = (numTerminals + 63) / 64;
+    bits.assign((size_t)rows * wordsPerRow, 0);
+  }
+
+  uint64_t *row(int r) { return &bits[(size_t)r * wordsPerRow]; }
+  const uint64_t *row(int r) const { return &bits[(size_t)r * wordsPerRow]; }
+
+  bool test(int r, int terminal) const {
+    return (row(r)[terminal / 64] >> (terminal % 64)) & 1;
+  }
+
+  void insert(int r, int terminal) {
+    row(r)[terminal / 64] |= (uint64_t)1 << (terminal % 64);
+  }
+
+  // Function to add the bits of another row, returning whether any were new
+  bool unite(int to, const uint64_t *from) {
+    uint64_t *target = row(to);
+    uint64_t changed = 0;
+    for (int w = 0; w < wordsPerRow; w++) {
+      changed |= from[w] & ~target[w];
+      target[w] |= from[w];
+    }
+    return changed != 0;
+  }
+
+  // Function to call visit(terminal) for every bit set in a row
+  template <typename Visitor> void forEach(int r, Visitor visit) const {
+    const uint64_t *words = row(r);
+    for (int w = 0; w < wordsPerRow; w++) {
+      uint64_t word = words[w];
+      while (word != 0) {
+        visit(w * 64 + __builtin_ctzll(word));
+        word &= word - 1;
+      }
+    }
+  }
+};
+
+// FIRST, FOLLOW and nullable of every non-terminal, indexed by non-terminal
+// number (symbol id minus numTerminals)
+struct FirstFollowSets {
+  vector<char> nullable;
+  TerminalSets first;
+  TerminalSets follow;
+};
+
+// Time spent in each phase of building the tables, in microseconds. The
+// builders fill it in when they are given one.
+struct BuildTimings {
+  double first = 0;      // Nullable and FIRST
+  double follow = 0;     // FOLLOW
+  double closures = 0;   // Closure items of every non-terminal
+  double collection = 0; // Canonical collection and its transitions
+  double lookaheads = 0; // LALR(1) lookaheads, for LALR(1) tables only
+  double table = 0;      // ACTION and GOTO entries
+
+  double total() const {
+    return first + follow + closures + collection + lookaheads + table;
+  }
+};
+
+// How the tables place reductions: on FOLLOW of the LHS, or on the LALR(1)
+// lookaheads of the state, which can only remove entries and conflicts
+enum TableMethod { TABLE_SLR, TABLE_LALR };
+
+// Function to return the microseconds since start
+inline double microsecondsSince(chrono::steady_clock::time_point start) {
+  chrono::duration<double, micro> elapsed = chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// Function to solve set equations of the form
+//   sets[x] = sets[x] | union of sets[y] for every edge x -> y
+// over the graph of non-terminals. The strongly connected components are
+// found with an iterative Tarjan search, which finishes every component
+// after all components it depends on; the members of a component share
+// one result, so each row is united only once per edge.
+void solveSetEquations(TerminalSets &sets, const vector<vector<int> > &edges) {
+  int numNodes = edges.size();
+  vector<int> index(numNodes, -1);
+  vector<int> lowLink(numNodes, 0);
+  vector<char> onStack(numNodes, false);
+  vector<int> componentStack;
+  vector<pair<int, size_t> > callStack;
+  int nextIndex = 0;
+
+  for (int root = 0; root < numNodes; root++) {
+    if (index[root] >= 0) {
+      continue;
+    }
+    callStack.push_back(make_pair(root, 0));
+    index[root] = lowLink[root] = nextIndex++;
+    componentStack.push_back(root);
+    onStack[root] = true;
+
+    while (!callStack.empty()) {
+      int node = callStack.back().first;
+      size_t &nextEdge = callStack.back().second;
+
+      if (nextEdge < edges[node].size()) {
+        int successor = edges[node][nextEdge++];
+        if (index[successor] < 0) {
+          index[successor] = lowLink[successor] = nextIndex++;
+          componentStack.push_back(successor);
+          onStack[successor] = true;
+          callStack.push_back(make_pair(successor, 0));
+        } else if (onStack[successor]) {
+          lowLink[node] = min(lowLink[node], index[successor]);
+        } else {
+          // Finished component: its set is final
+          sets.unite(node, sets.row(successor));
+        }
+        continue;
+      }
+
+      callStack.pop_back();
+      if (!callStack.empty()) {
+        int parent = callStack.back().first;
+        lowLink[parent] = min(lowLink[parent], lowLink[node]);
+      }
+
+      if (lowLink[node] == index[node]) {
+        // Node is the root of a component: collect the union of all its
+        // members, then hand that union to every member
+        size_t start = componentStack.size();
+        while (componentStack[start - 1] != node) {
+          start--;
+        }
+        start--;
+        for (size_t i = start + 1; i < componentStack.size(); i++) {
+          sets.unite(node, sets.row(componentStack[i]));
+        }
+        for (size_t i = start; i < componentStack.size(); i++) {
+          int member = componentStack[i];
+          if (member != node) {
+            sets.unite(member, sets.row(node));
+          }
+          onStack[member] = false;
+        }
+        componentStack.resize(start);
+
+        if (!callStack.empty()) {
+          sets.unite(callStack.back().first, sets.row(node));
+        }
+      }
+    }
+  }
+}
+
+// Function to compute nullable, FIRST and FOLLOW for every non-terminal.
+// Nullable is propagated with per-production counters, FIRST and FOLLOW are
+// each one pass to collect direct terminals and dependency edges followed
+// by solveSetEquations, so left recursion and chains of nullable
+// non-terminals need no special treatment.
+void computeFirstFollowSets(const Grammar &grammar, FirstFollowSets &sets,
+                            BuildTimings *timings = NULL) {
+  auto phaseStart = chrono::steady_clock::now();
+  int numTerminals = grammar.numTerminals;
+  int numNonTerminals = grammar.numNonTerminals();
+  int numProductions = grammar.lhs.size();
+
+  // Nullable: a production becomes nullable once every symbol of its RHS is
+  sets.nullable.assign(numNonTerminals, false);
+  vector<int> pending(numProductions, 0);
+  vector<vector<int> > occurrences(numNonTerminals);
+  vector<int> worklist;
+  for (int p = 0; p < numProductions; p++) {
+    for (int symbol : grammar.rhs[p]) {
+      if (grammar.isTerminal(symbol)) {
+        // A terminal can never vanish, so the production is never nullable
+        pending[p] = -1;
+        break;
+      }
+    }
+    if (pending[p] < 0) {
+      continue;
+    }
+    for (int symbol : grammar.rhs[p]) {
+      occurrences[symbol - numTerminals].push_back(p);
+      pending[p]++;
+    }
+    int lhs = grammar.lhs[p] - numTerminals;
+    if (pending[p] == 0 && !sets.nullable[lhs]) {
+      sets.nullable[lhs] = true;
+      worklist.push_back(lhs);
+    }
+  }
+  while (!worklist.empty()) {
+    int nonTerminal = worklist.back();
+    worklist.pop_back();
+    for (int p : occurrences[nonTerminal]) {
+      int lhs = grammar.lhs[p] - numTerminals;
+      if (--pending[p] == 0 && !sets.nullable[lhs]) {
+        sets.nullable[lhs] = true;
+        worklist.push_back(lhs);
+      }
+    }
+  }
+
+  // FIRST(A) holds the terminals and includes FIRST(B) of every symbol that
+  // can start a production of A after a nullable prefix
+  sets.first.init(numNonTerminals, numTerminals);
+  vector<vector<int> > edges(numNonTerminals);
+  for (int p = 0; p < numProductions; p++) {
+    int lhs = grammar.lhs[p] - numTerminals;
+    for (int symbol : grammar.rhs[p]) {
+      if (grammar.isTerminal(symbol)) {
+        sets.first.insert(lhs, symbol);
+        break;
+      }
+      edges[lhs].push_back(symbol - numTerminals);
+      if (!sets.nullable[symbol - numTerminals]) {
+        break;
+      }
+    }
+  }
+  solveSetEquations(sets.first, edges);
+  if (timings != NULL) {
+    timings->first = microsecondsSince(phaseStart);
+    phaseStart = chrono::steady_clock::now();
+  }
+
+  // FOLLOW(B) holds FIRST of whatever can follow B in a production, and
+  // includes FOLLOW(A) when B ends a production of A up to a nullable
+  // suffix. The suffix FIRST set is carried right to left in one row.
+  sets.follow.init(numNonTerminals, numTerminals);
+  sets.follow.insert(grammar.lhs[0] - numTerminals, numTerminals - 1);
+  for (vector<int> &nodeEdges : edges) {
+    nodeEdges.clear();
+  }
+  TerminalSets trailer;
+  trailer.init(1, numTerminals);
+  for (int p = 0; p < numProductions; p++) {
+    int lhs = grammar.lhs[p] - numTerminals;
+    const vector<SymbolId> &rhs = grammar.rhs[p];
+    fill(trailer.bits.begin(), trailer.bits.end(), 0);
+    bool trailerNullable = true;
+
+    for (size_t i = rhs.size(); i-- > 0;) {
+      int symbol = rhs[i];
+      if (grammar.isTerminal(symbol)) {
+        fill(trailer.bits.begin(), trailer.bits.end(), 0);
+        trailer.insert(0, symbol);
+        trailerNullable = false;
+        continue;
+      }
+
+      int nonTerminal = symbol - numTerminals;
+      sets.follow.unite(nonTerminal, trailer.row(0));
+      if (trailerNullable && nonTerminal != lhs) {
+        edges[nonTerminal].push_back(lhs);
+      }
+
+      if (!sets.nullable[nonTerminal]) {
+        fill(trailer.bits.begin(), trailer.bits.end(), 0);
+        trailerNullable = false;
+      }
+      trailer.unite(0, sets.first.row(nonTerminal));
+    }
+  }
+  solveSetEquations(sets.follow, edges);
+  if (timings != NULL) {
+    timings->follow = microsecondsSince(phaseStart);
+  }
+}
+
+// Function to print FIRST or FOLLOW of every non-terminal with productions,
+// in name order. Nullable non-terminals show '~' in their FIRST set.
+void printTerminalSets(const string &name, const Grammar &grammar,
+                       const TerminalSets &sets, const vector<char> *nullable) {
+  vector<int> nonTerminals;
+  for (int lhs : grammar.lhs) {
+    nonTerminals.push_back(lhs);
+  }
+  sort(nonTerminals.begin(), nonTerminals.end(), [&grammar](int a, int b) {
+    return grammar.symbolRank[a] < grammar.symbolRank[b];
+  });
+  nonTerminals.erase(unique(nonTerminals.begin(), nonTerminals.end()),
+                     nonTerminals.end());
+
+  for (int symbol : nonTerminals) {
+    int row = symbol - grammar.numTerminals;
+    vector<string> members;
+    sets.forEach(row, [&](int terminal) {
+      members.push_back(grammar.name(terminal));
+    });
+    if (nullable != NULL && (*nullable)[row]) {
+      members.push_back("~");
+    }
+    sort(members.begin(), members.end());
+
+    cout << name << "(" << grammar.name(symbol) << ") = {";
+    for (const string &member : members) {
+      cout << member << " ";
+    }
+    cout << "}" << endl;
+  }
+}
+
+// Lookaheads of the reductions of every state for LALR(1) tables. Every
+// completed item of a state other than the accepting one has a row of
+// sets, rows of state s being firstRow[s] to firstRow[s + 1] - 1.
+struct LalrLookaheads {
+  vector<int> firstRow;
+  vector<int> production; // Production of every row
+  TerminalSets sets;
+
+  // Function to visit the lookaheads of the reduction by production in
+  // state
+  template <typename Visitor>
+  void forEach(int state, int reduced, Visitor visit) const {
+    for (int row = firstRow[state]; row < firstRow[state + 1]; row++) {
+      if (production[row] == reduced) {
+        sets.forEach(row, visit);
+        return;
+      }
+    }
+  }
+};
+
+// Function to compute the LALR(1) lookaheads of every reduction over the
+// LR(0) automaton, with the relations of DeRemer and Pennello. For every
+// non-terminal transition (p, A):
+//   DR(p, A)     the terminals shifted from goto(p, A), and '$' after the
+//                start symbol
+//   reads        (p, A) reads (r, C) when r = goto(p, A), C is nullable
+//                and goto(r, C) exists
+//   includes     (p, A) includes (p', B) when B -> x A y, y is nullable and
+//                x leads from p' to p
+// Read is DR closed over reads, Follow is Read closed over includes, both
+// solved by solveSetEquations in time linear in the relations, and the
+// lookaheads of A -> w in state q are the union of Follow(p, A) over the
+// transitions (p, A) from which w leads to q.
+void computeLalrLookaheads(const Grammar &grammar,
+                           const FirstFollowSets &firstFollow,
+                           const vector<ItemSet> &canonicalCollection,
+                           const vector<vector<pair<int, int> > > &transitions,
+                           LalrLookaheads &lookaheads) {
+  int numStates = canonicalCollection.size();
+  int numTerminals = grammar.numTerminals;
+  int numProductions = grammar.lhs.size();
+
+  // The edges of every state sorted by symbol, numbering the non-terminal
+  // ones as transitions
+  vector<int> edgeStart(numStates + 1, 0);
+  vector<pair<int, int> > edges;
+  for (int state = 0; state < numStates; state++) {
+    edgeStart[state] = edges.size();
+    edges.insert(edges.end(), transitions[state].begin(),
+                 transitions[state].end());
+    sort(edges.begin() + edgeStart[state], edges.end());
+  }
+  edgeStart[numStates] = edges.size();
+  vector<int> transitionOf(edges.size(), -1);
+  vector<int> transitionEdge;
+  for (size_t e = 0; e < edges.size(); e++) {
+    if (!grammar.isTerminal(edges[e].first)) {
+      transitionOf[e] = transitionEdge.size();
+      transitionEdge.push_back(e);
+    }
+  }
+  int numTransitions = transitionEdge.size();
+  auto findEdge = [&](int state, int symbol) {
+    auto first = edges.begin() + edgeStart[state];
+    auto last = edges.begin() + edgeStart[state + 1];
+    auto it = lower_bound(first, last, make_pair(symbol, -1));
+    return it != last && it->first == symbol ? int(it - edges.begin()) : -1;
+  };
+
+  // A row for every reduction
+  lookaheads.firstRow.assign(numStates + 1, 0);
+  lookaheads.production.clear();
+  for (int state = 0; state < numStates; state++) {
+    lookaheads.firstRow[state] = lookaheads.production.size();
+    for (LR0Item item : canonicalCollection[state]) {
+      int production = itemProduction(item);
+      if (production != 0 &&
+          itemDot(item) == (int)grammar.rhs[production].size()) {
+        lookaheads.production.push_back(production);
+      }
+    }
+  }
+  lookaheads.firstRow[numStates] = lookaheads.production.size();
+  int numRows = lookaheads.production.size();
+
+  // DR and reads
+  TerminalSets follow;
+  follow.init(numTransitions, numTerminals);
+  vector<vector<int> > relation(numTransitions);
+  const LR0Item accepting = makeItem(0, 1);
+  for (int t = 0; t < numTransitions; t++) {
+    int target = edges[transitionEdge[t]].second;
+    for (int e = edgeStart[target]; e < edgeStart[target + 1]; e++) {
+      int symbol = edges[e].first;
+      if (grammar.isTerminal(symbol)) {
+        follow.insert(t, symbol);
+      } else if (firstFollow.nullable[symbol - numTerminals]) {
+        relation[t].push_back(transitionOf[e]);
+      }
+    }
+    const ItemSet &items = canonicalCollection[target];
+    if (binary_search(items.begin(), items.end(), accepting)) {
+      follow.insert(t, numTerminals - 1);
+    }
+  }
+  solveSetEquations(follow, relation);
+
+  // Includes and lookback, found by walking the right-hand side of every
+  // production of A from every transition (p, A)
+  vector<vector<int> > productionsOf(grammar.numNonTerminals());
+  vector<int> nullableFrom(numProductions);
+  for (int p = 0; p < numProductions; p++) {
+    productionsOf[grammar.lhs[p] - numTerminals].push_back(p);
+    const vector<SymbolId> &rhs = grammar.rhs[p];
+    int from = rhs.size();
+    while (from > 0 && !grammar.isTerminal(rhs[from - 1]) &&
+           firstFollow.nullable[rhs[from - 1] - numTerminals]) {
+      from--;
+    }
+    nullableFrom[p] = from;
+  }
+  for (vector<int> &edgesOf : relation) {
+    edgesOf.clear();
+  }
+  vector<vector<int> > lookback(numRows);
+  for (int t = 0; t < numTransitions; t++) {
+    int origin = upper_bound(edgeStart.begin(), edgeStart.end(),
+                             transitionEdge[t]) -
+                 edgeStart.begin() - 1;
+    int nonTerminal = edges[transitionEdge[t]].first;
+    for (int p : productionsOf[nonTerminal - numTerminals]) {
+      const vector<SymbolId> &rhs = grammar.rhs[p];
+      int state = origin;
+      for (size_t i = 0; i < rhs.size() && state >= 0; i++) {
+        int e = findEdge(state, rhs[i]);
+        if (e < 0) {
+          state = -1;
+          break;
+        }
+        if (transitionOf[e] >= 0 && (int)i + 1 >= nullableFrom[p]) {
+          relation[transitionOf[e]].push_back(t);
+        }
+        state = edges[e].second;
+      }
+      if (state < 0) {
+        continue;
+      }
+      for (int row = lookaheads.firstRow[state];
+           row < lookaheads.firstRow[state + 1]; row++) {
+        if (lookaheads.production[row] == p) {
+          lookback[row].push_back(t);
+        }
+      }
+    }
+  }
+  solveSetEquations(follow, relation);
+
+  lookaheads.sets.init(numRows, numTerminals);
+  for (int row = 0; row < numRows; row++) {
+    for (int t : lookback[row]) {
+      lookaheads.sets.unite(row, follow.row(t));
+    }
+  }
+}
+
+// Function to fill the ACTION and GOTO rows of a state, which are empty on
+// entry, from its closure and its outgoing (symbol, target) edges.
+// Reductions are placed on FOLLOW of their LHS, or on their LALR(1)
+// lookaheads when given.
+void fillTableRow(const Grammar &grammar, const FirstFollowSets &firstFollow,
+                  const ItemSet &closure,
+                  const vector<pair<int, int> > &transitions,
+                  ParseTables &tables, int i,
+                  const LalrLookaheads *lookaheads = NULL) {
+  int rowStart = i * tables.terminals.size();
+  tables.conflicts.erase(tables.conflicts.lower_bound(rowStart),
+                         tables.conflicts.lower_bound(rowStart +
+                                                      tables.terminals.size()));
+  // Function to set an ACTION cell, keeping every action of a conflict
+  auto setAction = [&tables](int cell, int action) {
+    int previous = tables.action[cell];
+    if (previous != ACTION_ERROR && previous != action) {
+      vector<int> &actions = tables.conflicts[cell];
+      if (actions.empty()) {
+        actions.push_back(previous);
+      }
+      if (find(actions.begin(), actions.end(), action) == actions.end()) {
+        actions.push_back(action);
+      }
+    }
+    tables.action[cell] = action;
+  };
+
+  // Shift and goto entries come straight from the recorded transitions
+  for (const pair<int, int> &edge : transitions) {
+    int symbol = edge.first;
+    if (grammar.isTerminal(symbol)) {
+      // Shift action
+      setAction(rowStart + symbol, packAction(ACTION_SHIFT, edge.second));
+    } else {
+      // Goto action
+      tables.goTo[i * tables.nonTerminals.size() + symbol -
+                  grammar.numTerminals] = edge.second;
+    }
+  }
+
+  for (LR0Item item : closure) {
+    int productionIndex = itemProduction(item);
+    if (itemDot(item) < (int)grammar.rhs[productionIndex].size()) {
+      // Shift and goto entries were filled from the transitions above
+      continue;
+    } else if (productionIndex != 0) {
+      // Reduce action on every terminal in FOLLOW of the LHS, or in the
+      // lookaheads of the item
+      auto reduce = [&](int terminal) {
+        setAction(rowStart + terminal,
+                  packAction(ACTION_REDUCE, productionIndex));
+      };
+      if (lookaheads != NULL) {
+        lookaheads->forEach(i, productionIndex, reduce);
+      } else {
+        firstFollow.follow.forEach(
+            grammar.lhs[productionIndex] - grammar.numTerminals, reduce);
+      }
+    } else {
+      // Accept action
+      setAction(rowStart + grammar.numTerminals - 1,
+                packAction(ACTION_ACCEPT, 0));
+    }
+  }
+}
+
+// Function to construct the parsing table from the canonical collection and
+// the transitions recorded while it was built, as (symbol, target) edges
+// per state
+void fillParseTables(const Grammar &grammar,
+                     const FirstFollowSets &firstFollow,
+                     const vector<ItemSet> &canonicalCollection,
+                     const vector<vector<pair<int, int> > > &transitions,
+                     ParseTables &tables,
+                     const LalrLookaheads *lookaheads = NULL) {
+  initParseTables(tables, grammar);
+  tables.numStates = canonicalCollection.size();
+  tables.action.assign(tables.numStates * tables.terminals.size(),
+                       ACTION_ERROR);
+  tables.goTo.assign(tables.numStates * tables.nonTerminals.size(), -1);
+  tables.conflicts.clear();
+
+  for (size_t i = 0; i < canonicalCollection.size(); i++) {
+    fillTableRow(grammar, firstFollow, canonicalCollection[i], transitions[i],
+                 tables, i, lookaheads);
+  }
+}
+
+// Function to compute the goto kernels of a state: the dot of every item is
+// advanced over the symbol following it, and the results are bucketed in
+// gotoKernels by that symbol. symbols lists the non-empty buckets in goto
+// numbering order. Items are sorted, so every bucket comes out sorted too.
+void computeGotoKernels(const ItemSet &state, const Grammar &grammar,
+                        vector<ItemSet> &gotoKernels, vector<int> &symbols) {
+  symbols.clear();
+  for (LR0Item item : state) {
+    int production = itemProduction(item);
+    int dot = itemDot(item);
+    if (dot < (int)grammar.rhs[production].size()) {
+      int symbol = grammar.rhs[production][dot];
+      if (gotoKernels[symbol].empty()) {
+        symbols.push_back(symbol);
+      }
+      gotoKernels[symbol].push_back(makeItem(production, dot + 1));
+    }
+  }
+  sort(symbols.begin(), symbols.end(), [&grammar](int a, int b) {
+    return grammar.symbolRank[a] < grammar.symbolRank[b];
+  });
+}
+
+// Function to compute the canonical collection of LR(0) items and the
+// tables, SLR(1) or LALR(1) as method says. When timings is given, the time
+// of every construction phase is stored in it.
+vector<ItemSet> computeCanonicalCollection(const Grammar &grammar,
+                                           ParseTables &tables,
+                                           bool verbose = true,
+                                           BuildTimings *timings = NULL,
+                                           TableMethod method = TABLE_SLR) {
+  vector<ItemSet> canonicalCollection;
+
+  FirstFollowSets firstFollow;
+  computeFirstFollowSets(grammar, firstFollow, timings);
+
+  if (verbose) {
+    cout << "First of Production Rules: \n" << endl;
+    printTerminalSets("FIRST", grammar, firstFollow.first,
+                      &firstFollow.nullable);
+
+    cout << "\nFollow of Production Rules: \n" << endl;
+    printTerminalSets("FOLLOW", grammar, firstFollow.follow, NULL);
+  }
+
+  auto phaseStart = chrono::steady_clock::now();
+  vector<ItemSet> nonTerminalClosures = computeNonTerminalClosures(grammar);
+  if (timings != NULL) {
+    timings->closures = microsecondsSince(phaseStart);
+    phaseStart = chrono::steady_clock::now();
+  }
+  vector<char> expanded(grammar.numNonTerminals(), false);
+  vector<char> added(grammar.lhs.size(), false);
+
+  // States are identified by their kernel: two goto sets are equal exactly
+  // when their kernels are, so the index never has to compare closures
+  unordered_map<ItemSet, int, ItemSetHash> stateIndex;
+
+  // Transitions recorded while the collection is built, as (symbol, target)
+  // edges per state
+  vector<vector<pair<int, int> > > transitions;
+
+  // Add the initial item to the canonical collection
+  ItemSet initialKernel(1, makeItem(0, 0));
+  stateIndex[initialKernel] = 0;
+  canonicalCollection.push_back(computeClosure(
+      initialKernel, grammar, nonTerminalClosures, expanded, added));
+  transitions.push_back(vector<pair<int, int> >());
+
+  // Goto kernels of the current state, bucketed by the symbol after the dot
+  vector<ItemSet> gotoKernels(grammar.numSymbols());
+  vector<int> symbols;
+
+  for (size_t i = 0; i < canonicalCollection.size(); i++) {
+    computeGotoKernels(canonicalCollection[i], grammar, gotoKernels, symbols);
+
+    // Look the goto sets up and add the new ones to the canonical collection
+    for (int symbol : symbols) {
+      ItemSet &kernel = gotoKernels[symbol];
+
+      auto it = stateIndex.find(kernel);
+      int nextState;
+      if (it == stateIndex.end()) {
+        nextState = canonicalCollection.size();
+        canonicalCollection.push_back(computeClosure(
+            kernel, grammar, nonTerminalClosures, expanded, added));
+        stateIndex.emplace(move(kernel), nextState);
+        transitions.push_back(vector<pair<int, int> >());
+      } else {
+        nextState = it->second;
+      }
+      transitions[i].push_back(make_pair(symbol, nextState));
+      kernel.clear();
+    }
+  }
+  if (timings != NULL) {
+    timings->collection = microsecondsSince(phaseStart);
+    phaseStart = chrono::steady_clock::now();
+  }
+
+  LalrLookaheads lookaheads;
+  if (method == TABLE_LALR) {
+    computeLalrLookaheads(grammar, firstFollow, canonicalCollection,
+                          transitions, lookaheads);
+    if (timings != NULL) {
+      timings->lookaheads = microsecondsSince(phaseStart);
+      phaseStart = chrono::steady_clock::now();
+    }
+  }
+
+  fillParseTables(grammar, firstFollow, canonicalCollection, transitions,
+                  tables, method == TABLE_LALR ? &lookaheads : NULL);
+  if (timings != NULL) {
+    timings->table = microsecondsSince(phaseStart);
+  }
+  return canonicalCollection;
+}
+
+// Grammar under development whose tables are kept up to date as
+// productions are added and removed. An edit recomputes the closures of
+// non-terminals that reach the edited LHS through leftmost non-terminals,
+// re-expands only the states with the dot before one of them, drops states
+// that become unreachable and rewrites the table rows of states whose
+// closure, transitions or reductions changed. FIRST and FOLLOW are
+// recomputed in full, which is linear and cheap next to the rest.
+//
+// State numbers stay stable across edits, so the tables describe the same
+// automaton as a full rebuild but may number it differently and contain
+// unreachable rows. They are renumbered the way a full rebuild numbers
+// them whenever the symbol columns change or half the rows are unused.
+class GrammarSession {
+public:
+  explicit GrammarSession(const Grammar &grammar)
+      : named(grammar.namedSymbols) {
+    for (size_t p = 0; p < grammar.lhs.size(); p++) {
+      NamedProduction production;
+      production.lhs = grammar.name(grammar.lhs[p]);
+      for (SymbolId symbol : grammar.rhs[p]) {
+        production.rhs.push_back(grammar.name(symbol));
+      }
+      namedProductions.push_back(production);
+    }
+    for (int i = 0; i < grammar.numSymbols(); i++) {
+      if (!grammar.isTerminal(i)) {
+        nonTerminalOrder.push_back(grammar.name(i));
+      } else if (grammar.name(i) != "$") {
+        terminalOrder.push_back(grammar.name(i));
+      }
+    }
+    buildGrammar(current, namedProductions, terminalOrder, nonTerminalOrder);
+    current.namedSymbols = named;
+    nonTerminalClosures = computeNonTerminalClosures(current);
+    computeFirstFollowSets(current, firstFollow);
+
+    kernels.assign(1, ItemSet(1, makeItem(0, 0)));
+    stateIndex.clear();
+    stateIndex[kernels[0]] = 0;
+    closures.assign(1, ItemSet());
+    transitions.assign(1, vector<pair<int, int> >());
+    live.assign(1, true);
+    vector<int> worklist(1, 0);
+    expandStates(worklist);
+    compactStates();
+  }
+
+  const Grammar &grammar() const { return current; }
+  const ParseTables &tables() const { return parseTables; }
+  const vector<NamedProduction> &productions() const {
+    return namedProductions;
+  }
+
+  // Work done by the last edit: closures recomputed and table rows written
+  size_t lastClosures() const { return closuresComputed; }
+  size_t lastRows() const { return rowsWritten; }
+
+  // Function to build the grammar and tables of the current productions
+  // from scratch, numbering the symbols as the session does
+  void buildFromScratch(Grammar &grammar, ParseTables &tables) const {
+    buildGrammar(grammar, namedProductions, terminalOrder, nonTerminalOrder);
+    grammar.namedSymbols = named;
+    computeCanonicalCollection(grammar, tables, false);
+  }
+
+  // Function to add the production lhs -> rhs and return its index. Throws
+  // a string when it would change the augmented start production.
+  int addProduction(const string &lhs, const vector<string> &rhs) {
+    const string &start = namedProductions[0].lhs;
+    if (lhs.empty() || lhs == start || lhs == "$") {
+      throw string("cannot add a production for '" + lhs + "'");
+    }
+    for (const string &name : rhs) {
+      if (name == start) {
+        throw string("'" + name + "' cannot appear in a production");
+      }
+    }
+
+    // New names are appended to the symbol order, so that removing the
+    // production again does not renumber the other symbols
+    if (find(nonTerminalOrder.begin(), nonTerminalOrder.end(), lhs) ==
+        nonTerminalOrder.end()) {
+      nonTerminalOrder.push_back(lhs);
+    }
+    for (const string &name : rhs) {
+      bool known = name == "$" ||
+                   find(terminalOrder.begin(), terminalOrder.end(), name) !=
+                       terminalOrder.end() ||
+                   find(nonTerminalOrder.begin(), nonTerminalOrder.end(),
+                        name) != nonTerminalOrder.end();
+      if (!known) {
+        // Single-character grammars take upper-case letters as
+        // non-terminals even without productions
+        if (!named && isupper((unsigned char)name[0])) {
+          nonTerminalOrder.push_back(name);
+        } else {
+          terminalOrder.push_back(name);
+        }
+      }
+    }
+
+    NamedProduction production;
+    production.lhs = lhs;
+    production.rhs = rhs;
+    namedProductions.push_back(production);
+    update(lhs, -1);
+    return namedProductions.size() - 1;
+  }
+
+  // Function to remove a production; later productions move down by one.
+  // Throws a string for production 0 or an index out of range.
+  void removeProduction(int production) {
+    if (production <= 0 || production >= (int)namedProductions.size()) {
+      throw string("no production " + to_string(production) + " to remove");
+    }
+    string lhs = namedProductions[production].lhs;
+    namedProductions.erase(namedProductions.begin() + production);
+    update(lhs, production);
+  }
+
+private:
+  // Function to bring everything up to date after the productions of lhs
+  // changed. removed is the index of a removed production, or -1.
+  void update(const string &lhs, int removed) {
+    closuresComputed = 0;
+    rowsWritten = 0;
+
+    Grammar previous = move(current);
+    buildGrammar(current, namedProductions, terminalOrder, nonTerminalOrder);
+    current.namedSymbols = named;
+    int numNonTerminals = current.numNonTerminals();
+
+    // Symbols keep their names; their ids move when one is added
+    vector<int> symbolMap(previous.numSymbols());
+    bool layoutChanged = previous.numSymbols() != current.numSymbols();
+    for (int i = 0; i < previous.numSymbols(); i++) {
+      symbolMap[i] = current.symbols.find(previous.name(i));
+      layoutChanged = layoutChanged || symbolMap[i] != i ||
+                      previous.isTerminal(i) != current.isTerminal(i);
+    }
+    auto mapProduction = [removed](int production) {
+      return removed < 0 || production < removed
+                 ? production
+                 : production == removed ? -1 : production - 1;
+    };
+    auto mapItems = [&](ItemSet &items) {
+      size_t kept = 0;
+      for (LR0Item item : items) {
+        int production = mapProduction(itemProduction(item));
+        if (production >= 0) {
+          items[kept++] = makeItem(production, itemDot(item));
+        }
+      }
+      bool lost = kept < items.size();
+      items.resize(kept);
+      return lost;
+    };
+
+    // Carry the closures of non-terminals over by name. The ones that
+    // reach lhs through leftmost non-terminals are recomputed below.
+    vector<ItemSet> previousClosures;
+    previousClosures.swap(nonTerminalClosures);
+    nonTerminalClosures.assign(numNonTerminals, ItemSet());
+    for (int i = previous.numTerminals; i < previous.numSymbols(); i++) {
+      int symbol = symbolMap[i];
+      if (!current.isTerminal(symbol)) {
+        nonTerminalClosures[symbol - current.numTerminals].swap(
+            previousClosures[i - previous.numTerminals]);
+        mapItems(nonTerminalClosures[symbol - current.numTerminals]);
+      }
+    }
+
+    vector<vector<int> > productionsOf(numNonTerminals);
+    vector<vector<int> > leftCornerOf(numNonTerminals);
+    for (size_t p = 0; p < current.lhs.size(); p++) {
+      int nonTerminal = current.lhs[p] - current.numTerminals;
+      productionsOf[nonTerminal].push_back(p);
+      const vector<SymbolId> &rhs = current.rhs[p];
+      if (!rhs.empty() && !current.isTerminal(rhs[0])) {
+        leftCornerOf[rhs[0] - current.numTerminals].push_back(nonTerminal);
+      }
+    }
+    vector<char> affected(numNonTerminals, false);
+    vector<int> stack(1, current.symbols.find(lhs) - current.numTerminals);
+    affected[stack[0]] = true;
+    while (!stack.empty()) {
+      int nonTerminal = stack.back();
+      stack.pop_back();
+      for (int user : leftCornerOf[nonTerminal]) {
+        if (!affected[user]) {
+          affected[user] = true;
+          stack.push_back(user);
+        }
+      }
+    }
+    // A symbol that just became a non-terminal has no closure to carry over
+    for (int i = 0; i < previous.numSymbols(); i++) {
+      if (previous.isTerminal(i) && !current.isTerminal(symbolMap[i])) {
+        affected[symbolMap[i] - current.numTerminals] = true;
+      }
+    }
+    vector<int> visitedBy(numNonTerminals, -1);
+    for (int nonTerminal = 0; nonTerminal < numNonTerminals; nonTerminal++) {
+      if (affected[nonTerminal]) {
+        collectNonTerminalClosure(current, productionsOf, nonTerminal,
+                                  visitedBy, stack,
+                                  nonTerminalClosures[nonTerminal]);
+      }
+    }
+
+    // Renumber the items and symbols of the states. A state whose kernel
+    // used the removed production cannot be reached any more.
+    size_t numStates = kernels.size();
+    vector<char> dirty(numStates, false);
+    if (removed >= 0) {
+      stateIndex.clear();
+    }
+    for (size_t state = 0; state < numStates; state++) {
+      if (!live[state]) {
+        continue;
+      }
+      if (removed >= 0) {
+        if (mapItems(kernels[state])) {
+          dropState(state);
+          continue;
+        }
+        mapItems(closures[state]);
+        stateIndex[kernels[state]] = state;
+      }
+      if (layoutChanged) {
+        for (pair<int, int> &edge : transitions[state]) {
+          edge.first = symbolMap[edge.first];
+        }
+      }
+      for (LR0Item item : kernels[state]) {
+        const vector<SymbolId> &rhs = current.rhs[itemProduction(item)];
+        int dot = itemDot(item);
+        if (dot < (int)rhs.size() && !current.isTerminal(rhs[dot]) &&
+            affected[rhs[dot] - current.numTerminals]) {
+          dirty[state] = true;
+        }
+      }
+    }
+
+    vector<int> worklist;
+    for (size_t state = 0; state < numStates; state++) {
+      if (dirty[state]) {
+        worklist.push_back(state);
+      }
+    }
+    expandStates(worklist);
+    dirty.resize(kernels.size(), true); // New states need their rows
+
+    // Drop the states nothing reaches any more
+    vector<char> reached(kernels.size(), false);
+    reached[0] = true;
+    worklist.assign(1, 0);
+    while (!worklist.empty()) {
+      int state = worklist.back();
+      worklist.pop_back();
+      for (const pair<int, int> &edge : transitions[state]) {
+        if (!reached[edge.second]) {
+          reached[edge.second] = true;
+          worklist.push_back(edge.second);
+        }
+      }
+    }
+    size_t numLive = 0;
+    for (size_t state = 0; state < kernels.size(); state++) {
+      if (live[state] && !reached[state]) {
+        dropState(state);
+      }
+      numLive += live[state];
+    }
+
+    FirstFollowSets previousSets;
+    swap(previousSets, firstFollow);
+    computeFirstFollowSets(current, firstFollow);
+
+    if (layoutChanged || numLive * 2 < kernels.size()) {
+      compactStates();
+      return;
+    }
+
+    // Rows also change where a reduction's FOLLOW set or production index
+    // changed, and unreachable rows are cleared
+    vector<char> followChanged(numNonTerminals, false);
+    for (int nonTerminal = 0; nonTerminal < numNonTerminals; nonTerminal++) {
+      followChanged[nonTerminal] =
+          !equal(firstFollow.follow.row(nonTerminal),
+                 firstFollow.follow.row(nonTerminal) +
+                     firstFollow.follow.wordsPerRow,
+                 previousSets.follow.row(nonTerminal));
+    }
+    initParseTables(parseTables, current);
+    size_t numTerminals = parseTables.terminals.size();
+    size_t numGotoColumns = parseTables.nonTerminals.size();
+    size_t previousStates = parseTables.numStates;
+    parseTables.numStates = kernels.size();
+    parseTables.action.resize(kernels.size() * numTerminals, ACTION_ERROR);
+    parseTables.goTo.resize(kernels.size() * numGotoColumns, -1);
+    for (size_t state = 0; state < kernels.size(); state++) {
+      bool rewrite = dirty[state] || state >= previousStates ||
+                     (!live[state] && !closures[state].empty());
+      for (LR0Item item : closures[state]) {
+        int production = itemProduction(item);
+        if (rewrite) {
+          break;
+        }
+        if (itemDot(item) == (int)current.rhs[production].size()) {
+          rewrite = (removed >= 0 && production >= removed) ||
+                    followChanged[current.lhs[production] -
+                                  current.numTerminals];
+        }
+      }
+      if (!rewrite) {
+        continue;
+      }
+      fill_n(parseTables.action.begin() + state * numTerminals, numTerminals,
+             ACTION_ERROR);
+      fill_n(parseTables.goTo.begin() + state * numGotoColumns,
+             numGotoColumns, -1);
+      if (live[state]) {
+        fillTableRow(current, firstFollow, closures[state], transitions[state],
+                     parseTables, state);
+      } else {
+        parseTables.conflicts.erase(
+            parseTables.conflicts.lower_bound(state * numTerminals),
+            parseTables.conflicts.lower_bound((state + 1) * numTerminals));
+        closures[state].clear();
+      }
+      rowsWritten++;
+    }
+  }
+
+  // Function to compute the closure and transitions of every state in the
+  // worklist, adding states for goto kernels not seen before
+  void expandStates(vector<int> &worklist) {
+    expanded.assign(current.numNonTerminals(), false);
+    added.assign(current.lhs.size(), false);
+    gotoKernels.assign(current.numSymbols(), ItemSet());
+    while (!worklist.empty()) {
+      int state = worklist.back();
+      worklist.pop_back();
+      closures[state] = computeClosure(kernels[state], current,
+                                       nonTerminalClosures, expanded, added);
+      closuresComputed++;
+
+      computeGotoKernels(closures[state], current, gotoKernels, symbols);
+      transitions[state].clear();
+      for (int symbol : symbols) {
+        ItemSet &kernel = gotoKernels[symbol];
+        auto it = stateIndex.find(kernel);
+        int target;
+        if (it == stateIndex.end()) {
+          target = kernels.size();
+          stateIndex.emplace(kernel, target);
+          kernels.push_back(move(kernel));
+          closures.push_back(ItemSet());
+          transitions.push_back(vector<pair<int, int> >());
+          live.push_back(true);
+          worklist.push_back(target);
+        } else {
+          target = it->second;
+        }
+        transitions[state].push_back(make_pair(symbol, target));
+        kernel.clear();
+      }
+    }
+  }
+
+  // Function to mark a state unused. Its closure is kept until its table
+  // row has been cleared.
+  void dropState(int state) {
+    auto it = stateIndex.find(kernels[state]);
+    if (it != stateIndex.end() && it->second == state) {
+      stateIndex.erase(it);
+    }
+    live[state] = false;
+    kernels[state].clear();
+    transitions[state].clear();
+  }
+
+  // Function to renumber the live states in the order a full build numbers
+  // them, breadth first from state 0 with the edges of every state in goto
+  // numbering order, and to rebuild the tables
+  void compactStates() {
+    vector<int> order(1, 0);
+    vector<int> number(kernels.size(), -1);
+    number[0] = 0;
+    for (size_t i = 0; i < order.size(); i++) {
+      vector<pair<int, int> > &edges = transitions[order[i]];
+      sort(edges.begin(), edges.end(),
+           [this](const pair<int, int> &a, const pair<int, int> &b) {
+             return current.symbolRank[a.first] < current.symbolRank[b.first];
+           });
+      for (const pair<int, int> &edge : edges) {
+        if (number[edge.second] < 0) {
+          number[edge.second] = order.size();
+          order.push_back(edge.second);
+        }
+      }
+    }
+
+    vector<ItemSet> newKernels(order.size());
+    vector<ItemSet> newClosures(order.size());
+    vector<vector<pair<int, int> > > newTransitions(order.size());
+    for (size_t i = 0; i < order.size(); i++) {
+      newKernels[i].swap(kernels[order[i]]);
+      newClosures[i].swap(closures[order[i]]);
+      newTransitions[i].swap(transitions[order[i]]);
+      for (pair<int, int> &edge : newTransitions[i]) {
+        edge.second = number[edge.second];
+      }
+    }
+    kernels.swap(newKernels);
+    closures.swap(newClosures);
+    transitions.swap(newTransitions);
+    live.assign(order.size(), true);
+
+    for (auto it = stateIndex.begin(); it != stateIndex.end();) {
+      if (number[it->second] < 0) {
+        it = stateIndex.erase(it);
+      } else {
+        it->second = number[it->second];
+        ++it;
+      }
+    }
+
+    fillParseTables(current, firstFollow, closures, transitions, parseTables);
+    rowsWritten = parseTables.numStates;
+  }
+
+  vector<NamedProduction> namedProductions;
+  vector<string> terminalOrder;    // Symbol order passed to buildGrammar
+  vector<string> nonTerminalOrder;
+  bool named;
+  Grammar current;
+  FirstFollowSets firstFollow;
+  vector<ItemSet> nonTerminalClosures;
+
+  // Every state by number, with the kernel that identifies it. Dropped
+  // states stay as unused numbers until the next compaction.
+  vector<ItemSet> kernels;
+  vector<ItemSet> closures;
+  vector<vector<pair<int, int> > > transitions;
+  vector<char> live;
+  unordered_map<ItemSet, int, ItemSetHash> stateIndex;
+  ParseTables parseTables;
+
+  // Scratch space for expandStates
+  vector<char> expanded;
+  vector<char> added;
+  vector<ItemSet> gotoKernels;
+  vector<int> symbols;
+
+  size_t closuresComputed = 0;
+  size_t rowsWritten = 0;
+};
+
+// Function to tell whether two tables for the same grammar describe the
+// same automaton, whatever their state numbers. The states reachable from
+// state 0 are paired off breadth first along their shift and goto entries;
+// every pair must have the same reduce and accept entries and lead to
+// paired states everywhere else. Both sides follow the same edges, so the
+// pairing covers every reachable state of both.
+bool equivalentTables(const ParseTables &a, const ParseTables &b) {
+  if (a.terminals != b.terminals || a.nonTerminals != b.nonTerminals ||
+      a.productionLhs != b.productionLhs ||
+      a.productionLength != b.productionLength) {
+    return false;
+  }
+  vector<int> partnerOfA(a.numStates, -1);
+  vector<int> partnerOfB(b.numStates, -1);
+  auto match = [&](int x, int y) {
+    if (partnerOfA[x] < 0 && partnerOfB[y] < 0) {
+      partnerOfA[x] = y;
+      partnerOfB[y] = x;
+      return true;
+    }
+    return partnerOfA[x] == y;
+  };
+
+  match(0, 0);
+  vector<int> queue(1, 0);
+  for (size_t i = 0; i < queue.size(); i++) {
+    int x = queue[i];
+    int y = partnerOfA[x];
+    for (size_t t = 0; t < a.terminals.size(); t++) {
+      // Conflicts are compared action by action
+      vector<int> actionsA(1, a.actionAt(x, t));
+      vector<int> actionsB(1, b.actionAt(y, t));
+      auto conflictA = a.conflicts.find(x * a.terminals.size() + t);
+      auto conflictB = b.conflicts.find(y * b.terminals.size() + t);
+      if (conflictA != a.conflicts.end()) {
+        actionsA = conflictA->second;
+      }
+      if (conflictB != b.conflicts.end()) {
+        actionsB = conflictB->second;
+      }
+      if (actionsA.size() != actionsB.size()) {
+        return false;
+      }
+      for (size_t k = 0; k < actionsA.size(); k++) {
+        int actionA = actionsA[k];
+        int actionB = actionsB[k];
+        if (actionKind(actionA) != actionKind(actionB)) {
+          return false;
+        }
+        if (actionKind(actionA) != ACTION_SHIFT) {
+          if (actionA != actionB) {
+            return false;
+          }
+          continue;
+        }
+        bool isNew = partnerOfA[actionTarget(actionA)] < 0;
+        if (!match(actionTarget(actionA), actionTarget(actionB))) {
+          return false;
+        }
+        if (isNew) {
+          queue.push_back(actionTarget(actionA));
+        }
+      }
+    }
+    for (size_t n = 0; n < a.nonTerminals.size(); n++) {
+      int targetA = a.gotoAt(x, n);
+      int targetB = b.gotoAt(y, n);
+      if ((targetA < 0) != (targetB < 0)) {
+        return false;
+      }
+      if (targetA < 0) {
+        continue;
+      }
+      bool isNew = partnerOfA[targetA] < 0;
+      if (!match(targetA, targetB)) {
+        return false;
+      }
+      if (isNew) {
+        queue.push_back(targetA);
+      }
+    }
+  }
+
+  return true;
+}
+
+// Function to render a packed action the way it is shown in the table
+string describeAction(int action) {
+  switch (actionKind(action)) {
+  case ACTION_SHIFT:
+    return "Shift " + to_string(actionTarget(action));
+  case ACTION_REDUCE:
+    return "Reduce " + to_string(actionTarget(action));
+  case ACTION_ACCEPT:
+    return "Accept";
+  default:
+    return "";
+  }
+}
+
+void printParsingTable(const ParseTables &tables) {
+  // The '$' column is always the last ACTION column
+  size_t numTerminals = tables.terminals.size() - 1;
+
+  cout << "Parsing Table:" << endl;
+  cout << "+----------";
+  for (size_t j = 0; j < numTerminals; j++) {
+    cout << "----------";
+  }
+    cout << "------";
+
+  cout << "----------+" << endl;
+
+  cout << "| " << setw(8) << "State"
+       << " |";
+  for (size_t j = 0; j < numTerminals; j++) {
+    cout << " " << setw(8) << tables.terminals[j] << " |";
+  }
+  cout << " " << setw(8) << "$"
+       << " |" << endl;
+
+  cout << "|----------";
+  for (size_t j = 0; j < numTerminals; j++) {
+    cout << "----------";
+  }
+    cout << "------";
+
+  cout << "----------|" << endl;
+
+  for (int i = 0; i < tables.numStates; i++) {
+    cout << "| " << setw(8) << i << " |";
+    for (size_t j = 0; j <= numTerminals; j++) {
+      int action = tables.actionAt(i, j);
+      if (actionKind(action) != ACTION_ERROR) {
+        cout << " " << setw(8) << describeAction(action) << " |";
+      } else {
+        cout << "          |";
+      }
+    }
+    cout << endl;
+  }
+
+  cout << "+----------";
+  for (size_t j = 0; j < numTerminals; j++) {
+    cout << "----------";
+  }
+    cout << "------";
+
+  cout << "----------+" << endl;
+
+  // Display the goto table
+  cout << "Goto Table:" << endl;
+  cout << "+----------";
+  for (size_t j = 0; j < tables.nonTerminals.size(); j++) {
+    cout << "----------";
+  }
+
+  cout << "----+" << endl;
+
+  cout << "| " << setw(8) << "State"
+       << " |";
+  for (const string &symbol : tables.nonTerminals) {
+    cout << " " << setw(8) << symbol << " |";
+  }
+  cout << endl;
+
+  cout << "|----------";
+  for (size_t j = 0; j < tables.nonTerminals.size(); j++) {
+    cout << "----------";
+  }
+
+  cout << "----|" << endl;
+
+  for (int i = 0; i < tables.numStates; i++) {
+    cout << "| " << setw(8) << i << " |";
+    for (size_t j = 0; j < tables.nonTerminals.size(); j++) {
+      int nextState = tables.gotoAt(i, j);
+      if (nextState >= 0) {
+        cout << " " << setw(8) << nextState << " |";
+      } else {
+        cout << "          |";
+      }
+    }
+    cout << endl;
+  }
+
+  cout << "+----------";
+  for (size_t j = 0; j < tables.nonTerminals.size(); j++) {
+    cout << "----------";
+  }
+
+  cout << "----+" << endl;
+}
+
+// Function to bypass chains of unit reductions in finished tables. A state
+// reached by a goto on A whose only action is to reduce B -> A, on every
+// lookahead where it does not fail, does nothing but pop itself and take
+// the goto on B from the state below. Such a goto from state s is pointed
+// straight at the state goto(s, B), and chains of them collapse the same
+// way. A bypass is only made when the target fails on every lookahead the
+// skipped state failed on, so every input is accepted or rejected at the
+// same terminal as before. The skipped productions are recorded per GOTO
+// cell for parsers that run semantic actions. Returns the number of GOTO
+// entries rewritten.
+size_t eliminateUnitReductions(ParseTables &tables) {
+  int numTerminals = tables.terminals.size();
+  int numNonTerminals = tables.nonTerminals.size();
+
+  // The unit production every state reduces by, if that is all it does.
+  // States with conflicts do more than their cells show.
+  vector<char> conflicted(tables.numStates, false);
+  for (const auto &conflict : tables.conflicts) {
+    conflicted[conflict.first / numTerminals] = true;
+  }
+  vector<int> unitReduction(tables.numStates, -1);
+  for (int state = 0; state < tables.numStates; state++) {
+    int production = -1;
+    for (int t = 0; t < numTerminals && !conflicted[state]; t++) {
+      int action = tables.actionAt(state, t);
+      if (action == ACTION_ERROR) {
+        continue;
+      }
+      if (actionKind(action) != ACTION_REDUCE ||
+          tables.productionLength[actionTarget(action)] != 1 ||
+          (production >= 0 && actionTarget(action) != production)) {
+        production = -1;
+        break;
+      }
+      production = actionTarget(action);
+    }
+    unitReduction[state] = production;
+  }
+
+  // Function to tell whether target fails on every lookahead state fails on
+  auto failsWhere = [&](int target, int state) {
+    for (int t = 0; t < numTerminals; t++) {
+      if (tables.actionAt(target, t) != ACTION_ERROR &&
+          tables.actionAt(state, t) == ACTION_ERROR) {
+        return false;
+      }
+    }
+    return true;
+  };
+
+  vector<int> goTo = tables.goTo;
+  tables.gotoChain.assign(goTo.size(), -1);
+  tables.unitChains.clear();
+  size_t bypassed = 0;
+  vector<int> chain;
+  for (int state = 0; state < tables.numStates; state++) {
+    for (int nonTerminal = 0; nonTerminal < numNonTerminals; nonTerminal++) {
+      int cell = state * numNonTerminals + nonTerminal;
+      int target = goTo[cell];
+      chain.clear();
+      // Every step reduces to another non-terminal; a cycle of unit
+      // productions would come back to one, so the chain is bounded
+      while (target >= 0 && unitReduction[target] >= 0 &&
+             (int)chain.size() < numNonTerminals) {
+        int production = unitReduction[target];
+        int next = goTo[state * numNonTerminals +
+                        tables.productionLhs[production]];
+        if (next < 0 || !failsWhere(next, target)) {
+          break;
+        }
+        chain.push_back(production);
+        target = next;
+      }
+      if (chain.empty()) {
+        continue;
+      }
+      tables.goTo[cell] = target;
+      tables.gotoChain[cell] = tables.unitChains.size();
+      tables.unitChains.push_back(chain.size());
+      tables.unitChains.insert(tables.unitChains.end(), chain.begin(),
+                               chain.end());
+      bypassed++;
+    }
+  }
+  if (bypassed == 0) {
+    tables.gotoChain.clear();
+  }
+  return bypassed;
+}
+
+// Function to renumber the states of finished tables: order[i] is the
+// state that becomes state i, and state 0 has to stay first because every
+// parse starts in it. Rows are moved, and shift and goto targets follow
+// their states, as do the actions of conflicts, so the tables accept
+// exactly the same inputs.
+void renumberStates(ParseTables &tables, const vector<int> &order) {
+  int numTerminals = tables.terminals.size();
+  int numNonTerminals = tables.nonTerminals.size();
+  if ((int)order.size() != tables.numStates || order.empty() || order[0] != 0) {
+    throw string("State order does not start with state 0");
+  }
+  vector<int> number(tables.numStates, -1);
+  for (int i = 0; i < tables.numStates; i++) {
+    if (order[i] < 0 || order[i] >= tables.numStates || number[order[i]] >= 0) {
+      throw string("State order is not a permutation of the states");
+    }
+    number[order[i]] = i;
+  }
+
+  vector<int> action(tables.action.size());
+  vector<int> goTo(tables.goTo.size());
+  vector<int> gotoChain(tables.gotoChain.size());
+  for (int i = 0; i < tables.numStates; i++) {
+    int state = order[i];
+    for (int t = 0; t < numTerminals; t++) {
+      int entry = tables.actionAt(state, t);
+      if (actionKind(entry) == ACTION_SHIFT) {
+        entry = packAction(ACTION_SHIFT, number[actionTarget(entry)]);
+      }
+      action[i * numTerminals + t] = entry;
+    }
+    for (int n = 0; n < numNonTerminals; n++) {
+      int target = tables.gotoAt(state, n);
+      goTo[i * numNonTerminals + n] = target >= 0 ? number[target] : -1;
+      if (!gotoChain.empty()) {
+        gotoChain[i * numNonTerminals + n] =
+            tables.gotoChain[state * numNonTerminals + n];
+      }
+    }
+  }
+  tables.action.swap(action);
+  tables.goTo.swap(goTo);
+  tables.gotoChain.swap(gotoChain);
+
+  map<int, vector<int> > conflicts;
+  for (const auto &conflict : tables.conflicts) {
+    int cell = number[conflict.first / numTerminals] * numTerminals +
+               conflict.first % numTerminals;
+    vector<int> &actions = conflicts[cell];
+    for (int entry : conflict.second) {
+      if (actionKind(entry) == ACTION_SHIFT) {
+        entry = packAction(ACTION_SHIFT, number[actionTarget(entry)]);
+      }
+      actions.push_back(entry);
+    }
+  }
+  tables.conflicts.swap(conflicts);
+}
+
+// Function to order the states for renumberStates from a profile of state
+// visits and of transitions between consecutively visited states, keyed by
+// (from << 32) | to. Chains of states are merged along the heaviest
+// transitions first, the way procedures are placed by call frequency, so
+// rows read one after the other end up next to each other. Chains are laid
+// out hottest first after state 0, and unvisited states go last in their
+// original order.
+vector<int> profileStateOrder(int numStates, const vector<uint64_t> &visits,
+                              const unordered_map<uint64_t, uint64_t> &
+                                  transitions) {
+  // Transitions in both directions count for the same pair of rows
+  map<pair<int, int>, uint64_t> pairs;
+  for (const auto &transition : transitions) {
+    int from = transition.first >> 32;
+    int to = transition.first & 0xffffffff;
+    if (from > 0 && to > 0 && from < numStates && to < numStates) {
+      pairs[make_pair(min(from, to), max(from, to))] += transition.second;
+    }
+  }
+  vector<pair<uint64_t, pair<int, int> > > edges;
+  for (const auto &entry : pairs) {
+    edges.push_back(make_pair(entry.second, entry.first));
+  }
+  stable_sort(edges.begin(), edges.end(),
+              [](const pair<uint64_t, pair<int, int> > &a,
+                 const pair<uint64_t, pair<int, int> > &b) {
+                return a.first > b.first;
+              });
+
+  // Chains as doubly linked lists, with a union-find over their members
+  vector<int> next(numStates, -1), previous(numStates, -1), chain(numStates);
+  for (int state = 0; state < numStates; state++) {
+    chain[state] = state;
+  }
+  function<int(int)> find = [&](int state) {
+    return chain[state] == state ? state : chain[state] = find(chain[state]);
+  };
+  for (const auto &edge : edges) {
+    int a = edge.second.first, b = edge.second.second;
+    if (find(a) == find(b)) {
+      continue;
+    }
+    // Join the chains when one ends where the other starts
+    if (next[a] < 0 && previous[b] < 0) {
+      next[a] = b;
+      previous[b] = a;
+    } else if (next[b] < 0 && previous[a] < 0) {
+      next[b] = a;
+      previous[a] = b;
+    } else {
+      continue;
+    }
+    chain[find(a)] = find(b);
+  }
+
+  vector<uint64_t> weight(numStates, 0);
+  for (int state = 1; state < numStates; state++) {
+    weight[find(state)] += state < (int)visits.size() ? visits[state] : 0;
+  }
+  vector<int> heads;
+  for (int state = 1; state < numStates; state++) {
+    if (previous[state] < 0) {
+      heads.push_back(state);
+    }
+  }
+  stable_sort(heads.begin(), heads.end(), [&](int a, int b) {
+    return weight[find(a)] > weight[find(b)];
+  });
+
+  vector<int> order(1, 0);
+  for (int head : heads) {
+    for (int state = head; state >= 0; state = next[state]) {
+      order.push_back(state);
+    }
+  }
+  return order;
+}
+
+// Function to measure how far apart the rows read one after the other are:
+// the mean distance in rows between the states of every profiled transition
+double meanTransitionDistance(const unordered_map<uint64_t, uint64_t> &
+                                  transitions,
+                              const vector<int> &number) {
+  double distance = 0;
+  uint64_t total = 0;
+  for (const auto &transition : transitions) {
+    int from = number[transition.first >> 32];
+    int to = number[transition.first & 0xffffffff];
+    distance += (double)abs(from - to) * transition.second;
+    total += transition.second;
+  }
+  return total > 0 ? distance / total : 0;
+}
+
+// Probe that runParser reports every step of a parse to. Its members are
+// empty, so a parser instantiated with it compiles to the same code as one
+// without instrumentation; ParseProfile is the probe that counts.
+struct NoProbe {
+  void begin() {}
+  void visit(int, size_t) {}
+  void shift(int) {}
+  void reduce(int) {}
+  void gotoState(int) {}
+  void accept() {}
+  void error(int, int) {}
+};
+
+// Function to quote a string as a JSON string
+string jsonString(const string &text) {
+  string quoted = "\"";
+  for (unsigned char c : text) {
+    if (c == '"' || c == '\\') {
+      quoted += '\\';
+      quoted += c;
+    } else if (c < 0x20) {
+      char escape[8];
+      snprintf(escape, sizeof(escape), "\\u%04x", c);
+      quoted += escape;
+    } else {
+      quoted += c;
+    }
+  }
+  return quoted + "\"";
+}
+
+// Where a parse failed: the parse it happened in, counted from 1, the
+// number of terminals shifted before the failure, the state on top of the
+// stack and the offending terminal (-1 for a symbol outside the grammar)
+struct ParseErrorSite {
+  uint64_t parse;
+  uint64_t position;
+  int state;
+  int symbol;
+};
+
+// Probe that counts what runParser does over any number of parses: visits
+// of every state, shifts of every terminal, reductions by every production
+// and gotos on every non-terminal, the stack depth at every step as a
+// histogram with power-of-two buckets, and the first MAX_ERROR_SITES
+// errors
+struct ParseProfile {
+  static constexpr size_t MAX_ERROR_SITES = 256;
+
+  vector<uint64_t> stateVisits;
+  vector<uint64_t> terminalShifts;
+  vector<uint64_t> productionReductions;
+  vector<uint64_t> nonTerminalGotos;
+  vector<uint64_t> depthHistogram; // Bucket b counts depths in [2^b, 2^(b+1))
+  size_t maxDepth = 0;
+  uint64_t parses = 0;
+  uint64_t accepted = 0;
+  uint64_t errors = 0;
+  vector<ParseErrorSite> errorSites;
+  uint64_t position = 0; // Terminals shifted in the current parse
+
+  // How often the parser went from one state on top of the stack to
+  // another, keyed by (from << 32) | to. These are the rows read one after
+  // the other, which profileStateOrder places next to each other.
+  unordered_map<uint64_t, uint64_t> stateTransitions;
+  int lastState = -1; // State visited last in the current parse
+
+  void init(const TableView &tables, int numProductions) {
+    stateVisits.assign(tables.numStates, 0);
+    terminalShifts.assign(tables.numTerminals, 0);
+    productionReductions.assign(numProductions, 0);
+    nonTerminalGotos.assign(tables.numNonTerminals, 0);
+    depthHistogram.assign(64, 0);
+    maxDepth = 0;
+    parses = accepted = errors = position = 0;
+    errorSites.clear();
+    stateTransitions.clear();
+    lastState = -1;
+  }
+
+  void begin() {
+    parses++;
+    position = 0;
+    lastState = -1;
+  }
+
+  void visit(int state, size_t depth) {
+    stateVisits[state]++;
+    if (lastState >= 0 && lastState != state) {
+      stateTransitions[(uint64_t)lastState << 32 | state]++;
+    }
+    lastState = state;
+    depthHistogram[63 - __builtin_clzll(depth)]++;
+    maxDepth = max(maxDepth, depth);
+  }
+
+  void shift(int terminal) {
+    terminalShifts[terminal]++;
+    position++;
+  }
+
+  void reduce(int production) { productionReductions[production]++; }
+  void gotoState(int nonTerminal) { nonTerminalGotos[nonTerminal]++; }
+  void accept() { accepted++; }
+
+  void error(int state, int symbol) {
+    errors++;
+    if (errorSites.size() < MAX_ERROR_SITES) {
+      errorSites.push_back({parses, position, state, symbol});
+    }
+  }
+
+  static uint64_t sum(const vector<uint64_t> &counts) {
+    uint64_t total = 0;
+    for (uint64_t count : counts) {
+      total += count;
+    }
+    return total;
+  }
+
+  uint64_t shifts() const { return sum(terminalShifts); }
+  uint64_t reductions() const { return sum(productionReductions); }
+  uint64_t gotos() const { return sum(nonTerminalGotos); }
+
+  // Function to write the counters as a JSON object, naming terminals,
+  // non-terminals and productions after the grammar they were built from
+  void writeJson(ostream &out, const Grammar &grammar) const {
+    auto writeCounts = [&out](const char *name, const vector<uint64_t> &counts,
+                              auto label) {
+      out << "  " << jsonString(name) << ": [";
+      const char *separator = "";
+      for (size_t i = 0; i < counts.size(); i++) {
+        if (counts[i] != 0) {
+          out << separator << "\n    {" << label(i) << ", \"count\": "
+              << counts[i] << "}";
+          separator = ",";
+        }
+      }
+      out << "\n  ],\n";
+    };
+    auto productionText = [&grammar](size_t p) {
+      string text = grammar.name(grammar.lhs[p]) + " ->";
+      for (SymbolId symbol : grammar.rhs[p]) {
+        text += " " + grammar.name(symbol);
+      }
+      return text;
+    };
+
+    out << "{\n";
+    out << "  \"parses\": " << parses << ",\n";
+    out << "  \"accepted\": " << accepted << ",\n";
+    out << "  \"errors\": " << errors << ",\n";
+    out << "  \"shifts\": " << shifts() << ",\n";
+    out << "  \"reductions\": " << reductions() << ",\n";
+    out << "  \"gotos\": " << gotos() << ",\n";
+    out << "  \"maxStackDepth\": " << maxDepth << ",\n";
+    writeCounts("stateVisits", stateVisits, [](size_t i) {
+      return "\"state\": " + to_string(i);
+    });
+    vector<pair<uint64_t, uint64_t> > transitions(stateTransitions.begin(),
+                                                  stateTransitions.end());
+    sort(transitions.begin(), transitions.end());
+    out << "  \"stateTransitions\": [";
+    for (size_t i = 0; i < transitions.size(); i++) {
+      out << (i > 0 ? "," : "") << "\n    {\"from\": "
+          << (transitions[i].first >> 32)
+          << ", \"to\": " << (transitions[i].first & 0xffffffff)
+          << ", \"count\": " << transitions[i].second << "}";
+    }
+    out << "\n  ],\n";
+    writeCounts("shiftsByTerminal", terminalShifts, [&grammar](size_t i) {
+      return "\"terminal\": " + jsonString(grammar.name(i));
+    });
+    writeCounts("reductionsByProduction", productionReductions,
+                [&](size_t i) {
+                  return "\"production\": " + to_string(i) +
+                         ", \"rule\": " + jsonString(productionText(i));
+                });
+    writeCounts("gotosByNonTerminal", nonTerminalGotos, [&grammar](size_t i) {
+      return "\"nonTerminal\": " +
+             jsonString(grammar.name(grammar.numTerminals + i));
+    });
+    writeCounts("stackDepthHistogram", depthHistogram, [](size_t i) {
+      return "\"min\": " + to_string(1ull << i) +
+             ", \"max\": " + to_string((2ull << i) - 1);
+    });
+    out << "  \"errorSites\": [";
+    for (size_t i = 0; i < errorSites.size(); i++) {
+      const ParseErrorSite &site = errorSites[i];
+      out << (i > 0 ? "," : "") << "\n    {\"parse\": " << site.parse
+          << ", \"position\": " << site.position
+          << ", \"state\": " << site.state << ", \"terminal\": "
+          << (site.symbol >= 0 ? jsonString(grammar.name(site.symbol))
+                               : string("null"))
+          << "}";
+    }
+    out << "\n  ]\n}";
+  }
+};
+
+// Function to run the table-driven parser over the terminals produced by
+// nextSymbol, which returns the ACTION column of the next input symbol,
+// the '$' column at the end of the input and -1 for a symbol outside the
+// grammar. The state stack is supplied by the caller so it can be reused
+// across calls without reallocating. Every step is reported to probe.
+template <typename NextSymbol, typename Probe>
+bool runParser(const TableView &tables, vector<int> &stateStack,
+               NextSymbol nextSymbol, Probe &probe) {
+  stateStack.clear();
+  stateStack.push_back(0);
+  probe.begin();
+
+  int currentSymbol = nextSymbol();
+
+  while (true) {
+    int currentState = stateStack.back();
+    probe.visit(currentState, stateStack.size());
+
+    // Symbols outside the grammar have no column in the table
+    if (currentSymbol < 0) {
+      probe.error(currentState, currentSymbol);
+      return false;
+    }
+
+    int action = tables.actionAt(currentState, currentSymbol);
+
+    if (actionKind(action) == ACTION_SHIFT) {
+      // Shift action
+      stateStack.push_back(actionTarget(action));
+      probe.shift(currentSymbol);
+
+      // Move to the next symbol
+      currentSymbol = nextSymbol();
+    } else if (actionKind(action) == ACTION_REDUCE) {
+      // Reduce action
+      int productionIndex = actionTarget(action);
+      probe.reduce(productionIndex);
+
+      // Pop the states based on the length of the production's RHS
+      stateStack.resize(stateStack.size() -
+                        tables.productionLength[productionIndex]);
+
+      // Get the non-terminal on the LHS of the production
+      int nonTerminal = tables.productionLhs[productionIndex];
+      int nextState = tables.gotoAt(stateStack.back(), nonTerminal);
+
+      // Check if there's a valid action in the goto table
+      if (nextState >= 0) {
+        stateStack.push_back(nextState);
+        probe.gotoState(nonTerminal);
+      } else {
+        // Invalid goto action
+        probe.error(stateStack.back(), currentSymbol);
+        return false;
+      }
+    } else if (actionKind(action) == ACTION_ACCEPT) {
+      // Accept action
+      probe.accept();
+      return true;
+    } else {
+      // No valid action in the parsing table
+      probe.error(currentState, currentSymbol);
+      return false;
+    }
+  }
+}
+
+// Function to run the table-driven parser without instrumentation
+template <typename NextSymbol>
+bool runParser(const TableView &tables, vector<int> &stateStack,
+               NextSymbol nextSymbol) {
+  NoProbe probe;
+  return runParser(tables, stateStack, nextSymbol, probe);
+}
+
+// Function to run the table-driven parser like runParser while running
+// semantic actions over a value stack that moves in step with the state
+// stack. Actions supplies
+//   typedef ... Value;
+//   Value shift(int terminal, size_t position);
+//   Value reduce(int production, Value *children, int count);
+// where position counts the terminals shifted before this one and children
+// are the values of the RHS symbols, left to right. On accept result is
+// the value of the start symbol. Both stacks are supplied by the caller, so
+// nothing is allocated once they have grown to the depth of the input.
+template <typename Actions, typename NextSymbol>
+bool runParserWithActions(const TableView &tables, vector<int> &stateStack,
+                          vector<typename Actions::Value> &valueStack,
+                          Actions &actions, NextSymbol nextSymbol,
+                          typename Actions::Value &result) {
+  stateStack.clear();
+  stateStack.push_back(0);
+  valueStack.clear();
+
+  size_t position = 0;
+  int currentSymbol = nextSymbol();
+
+  while (currentSymbol >= 0) {
+    int action = tables.actionAt(stateStack.back(), currentSymbol);
+
+    if (actionKind(action) == ACTION_SHIFT) {
+      stateStack.push_back(actionTarget(action));
+      valueStack.push_back(actions.shift(currentSymbol, position++));
+      currentSymbol = nextSymbol();
+    } else if (actionKind(action) == ACTION_REDUCE) {
+      int productionIndex = actionTarget(action);
+      int length = tables.productionLength[productionIndex];
+
+      stateStack.resize(stateStack.size() - length);
+      typename Actions::Value value = actions.reduce(
+          productionIndex, valueStack.data() + valueStack.size() - length,
+          length);
+      valueStack.resize(valueStack.size() - length);
+
+      int nonTerminal = tables.productionLhs[productionIndex];
+      int nextState = tables.gotoAt(stateStack.back(), nonTerminal);
+      if (nextState < 0) {
+        return false;
+      }
+
+      // A goto that bypasses unit reductions still reports each of them
+      if (tables.gotoChain != NULL) {
+        int chain = tables.gotoChain[stateStack.back() *
+                                         tables.numNonTerminals +
+                                     nonTerminal];
+        if (chain >= 0) {
+          const int *productions = tables.unitChains + chain + 1;
+          for (int i = 0; i < tables.unitChains[chain]; i++) {
+            value = actions.reduce(productions[i], &value, 1);
+          }
+        }
+      }
+      stateStack.push_back(nextState);
+      valueStack.push_back(value);
+    } else if (actionKind(action) == ACTION_ACCEPT) {
+      result = valueStack.back();
+      return true;
+    } else {
+      return false;
+    }
+  }
+  return false;
+}
+
+// Function to parse the characters in [begin, end) with a single-character
+// grammar. The end of the range is read as the '$' end marker, so a record
+// does not need to carry one.
+template <typename Probe>
+bool parseRecord(const char *begin, const char *end, const TableView &tables,
+                 vector<int> &stateStack, Probe &probe) {
+  const int endMarker = tables.numTerminals - 1;
+  const char *currentPosition = begin;
+  return runParser(tables, stateStack, [&]() {
+    return currentPosition < end
+               ? tables.terminalIndex[(unsigned char)*currentPosition++]
+               : endMarker;
+  }, probe);
+}
+
+bool parseRecord(const char *begin, const char *end, const TableView &tables,
+                 vector<int> &stateStack) {
+  NoProbe probe;
+  return parseRecord(begin, end, tables, stateStack, probe);
+}
+
+// Function to parse a sequence of terminal ids, followed by an implicit '$'
+template <typename Probe>
+bool parseTokens(const int *tokens, size_t count, const TableView &tables,
+                 vector<int> &stateStack, Probe &probe) {
+  const int endMarker = tables.numTerminals - 1;
+  size_t currentPosition = 0;
+  return runParser(tables, stateStack, [&]() {
+    return currentPosition < count ? tokens[currentPosition++] : endMarker;
+  }, probe);
+}
+
+bool parseTokens(const int *tokens, size_t count, const TableView &tables,
+                 vector<int> &stateStack) {
+  NoProbe probe;
+  return parseTokens(tokens, count, tables, stateStack, probe);
+}
+
+// Function to split [begin, end) into whitespace-separated symbol names and
+// translate them into terminal ids, -1 for names that are not terminals
+void tokenizeNames(const char *begin, const char *end, const Grammar &grammar,
+                   vector<int> &tokens, vector<TokenSpan> *spans = NULL) {
+  tokens.clear();
+  if (spans != NULL) {
+    spans->clear();
+  }
+  const char *position = begin;
+  while (true) {
+    while (position < end && isspace((unsigned char)*position)) {
+      position++;
+    }
+    if (position == end) {
+      return;
+    }
+    const char *nameStart = position;
+    while (position < end && !isspace((unsigned char)*position)) {
+      position++;
+    }
+    int id = grammar.symbols.find(nameStart, position - nameStart);
+    tokens.push_back(id >= 0 && grammar.isTerminal(id) ? id : -1);
+    if (spans != NULL) {
+      spans->push_back(TokenSpan(nameStart - begin, position - begin));
+    }
+  }
+}
+
+// Function to split a record of a named grammar into terminal ids, with the
+// grammar's lexer if it has one and as whitespace-separated names otherwise
+void tokenizeInput(const char *begin, const char *end, const Grammar &grammar,
+                   vector<int> &tokens, vector<TokenSpan> *spans = NULL) {
+  if (grammar.hasLexer()) {
+    grammar.lexer.tokenize(begin, end, tokens, spans);
+  } else {
+    tokenizeNames(begin, end, grammar, tokens, spans);
+  }
+}
+
+// Scratch space of the parser that is reused from one parse to the next:
+// the state stack and the terminal ids of a named-grammar record, both
+// contiguous and reserved up front. Once they have grown to the deepest
+// stack and the longest record seen, a parse allocates nothing. There is
+// no symbol stack, as the symbol below every state is the one the state is
+// entered on; reductions pop productionLength states and look the GOTO
+// entry of productionLhs up, both precomputed per production.
+struct ParseContext {
+  vector<int> stateStack;
+  vector<int> tokens;
+
+  explicit ParseContext(size_t depth = 256, size_t length = 256) {
+    stateStack.reserve(depth);
+    tokens.reserve(length);
+  }
+};
+
+// Function to parse a record in a reused context: single-character
+// grammars read every character as a terminal, named grammars go through
+// tokenizeInput
+bool parseInput(const char *begin, const char *end, const TableView &tables,
+                const Grammar &grammar, ParseContext &context) {
+  if (!grammar.namedSymbols) {
+    return parseRecord(begin, end, tables, context.stateStack);
+  }
+  tokenizeInput(begin, end, grammar, context.tokens);
+  return parseTokens(context.tokens.data(), context.tokens.size(), tables,
+                     context.stateStack);
+}
+
+bool parseString(const string &input, const ParseTables &tables,
+                 ParseContext &context) {
+  return parseRecord(input.data(), input.data() + input.size(),
+                     viewTables(tables), context.stateStack);
+}
+
+// Function to parse a string of a single-character grammar in a context
+// kept per thread, so repeated calls do not allocate
+bool parseString(const string &input, const ParseTables &tables) {
+  static thread_local ParseContext context;
+  return parseString(input, tables, context);
+}
+
+// Parser for the records of a batch, with the tables and grammar bound to a
+// ParseContext. It owns the scratch space of one thread.
+class RecordParser {
+public:
+  RecordParser(const TableView &view, const Grammar &grammar)
+      : tables(view), grammar(grammar) {}
+
+  bool parse(const char *begin, const char *end) {
+    return parseInput(begin, end, tables, grammar, context);
+  }
+
+private:
+  TableView tables;
+  const Grammar &grammar;
+  ParseContext context;
+};
+
+// Parser that advances a group of independent parses in lockstep, for
+// batches of short records where parsing one record at a time is dominated
+// by dependent table lookups. The state on top of every lane's stack, its
+// lookahead and its input position are kept in arrays indexed by lane, so
+// one step looks up the ACTION entries of all lanes together, and the GOTO
+// entries of the lanes that reduced, with gathers where AVX2 is available.
+// A lane whose parse ends takes the next record, so the group stays full
+// until the input runs out. Results are the same as RecordParser's.
+class LockstepParser {
+public:
+  static constexpr int LANES = 8;
+
+  LockstepParser(const TableView &view, const Grammar &grammar)
+      : tables(view), grammar(grammar) {}
+
+  // Function to parse records of text, setting results[i] to whether
+  // record i is accepted
+  void parse(const vector<pair<const char *, const char *> > &records,
+             vector<char> &results) {
+    if (!grammar.namedSymbols) {
+      const int *terminalIndex = tables.terminalIndex;
+      run(records.data(), records.size(), results,
+          [terminalIndex](const char *p) {
+            return terminalIndex[(unsigned char)*p];
+          });
+      return;
+    }
+    // Every record is tokenized first, so the token arrays do not move
+    // while the lanes point into them
+    tokens.clear();
+    offsets.assign(1, 0);
+    for (const pair<const char *, const char *> &record : records) {
+      tokenizeInput(record.first, record.second, grammar, recordTokens);
+      tokens.insert(tokens.end(), recordTokens.begin(), recordTokens.end());
+      offsets.push_back(tokens.size());
+    }
+    tokenRecords.clear();
+    for (size_t i = 0; i < records.size(); i++) {
+      tokenRecords.push_back(make_pair(tokens.data() + offsets[i],
+                                       tokens.data() + offsets[i + 1]));
+    }
+    parseTokens(tokenRecords, results);
+  }
+
+  // Function to parse records of terminal ids, each followed by an implicit
+  // '$', setting results[i] to whether record i is accepted
+  void parseTokens(const vector<pair<const int *, const int *> > &records,
+                   vector<char> &results) {
+    run(records.data(), records.size(), results,
+        [](const int *p) { return *p; });
+  }
+
+private:
+  template <typename Unit, typename SymbolAt>
+  void run(const pair<const Unit *, const Unit *> *records, size_t count,
+           vector<char> &results, SymbolAt symbolAt) {
+    const int endMarker = tables.numTerminals - 1;
+    alignas(32) int state[LANES];  // Top of every lane's stack
+    alignas(32) int symbol[LANES]; // Lookahead, -1 outside the grammar
+    alignas(32) int action[LANES];
+    alignas(32) int gotoCell[LANES]; // GOTO entry to look up, -1 for none
+    alignas(32) int target[LANES];
+    alignas(32) int depth[LANES];    // States below the top of the stack
+    const Unit *position[LANES];
+    const Unit *end[LANES];
+    size_t record[LANES];
+    bool live[LANES];
+    int numLive = 0;
+    size_t nextRecord = 0;
+
+    results.assign(count, 0);
+    if (stackStride == 0) {
+      growStacks(256);
+    }
+
+    // Function to start the next record on a lane, or retire the lane.
+    // Retired lanes keep looking up state 0 so the gathers stay in bounds.
+    auto refill = [&](int lane) {
+      state[lane] = 0;
+      symbol[lane] = 0;
+      depth[lane] = 0;
+      if (nextRecord == count) {
+        live[lane] = false;
+        return;
+      }
+      live[lane] = true;
+      record[lane] = nextRecord;
+      position[lane] = records[nextRecord].first;
+      end[lane] = records[nextRecord].second;
+      symbol[lane] = position[lane] < end[lane] ? symbolAt(position[lane])
+                                                : endMarker;
+      nextRecord++;
+      numLive++;
+    };
+    auto finish = [&](int lane, bool accepted) {
+      results[record[lane]] = accepted;
+      numLive--;
+      refill(lane);
+    };
+    for (int lane = 0; lane < LANES; lane++) {
+      refill(lane);
+    }
+
+    const int numNonTerminals = tables.numNonTerminals;
+    const int *productionLength = tables.productionLength;
+    const int *productionLhs = tables.productionLhs;
+    while (numLive > 0) {
+      // Every lane pushes at most one state per step
+      int maxDepth = 0;
+      for (int lane = 0; lane < LANES; lane++) {
+        maxDepth = max(maxDepth, depth[lane]);
+      }
+      if (maxDepth + 1 >= stackStride) {
+        growStacks(stackStride * 2);
+      }
+      int *stacks = stackStorage.data();
+      const int stride = stackStride;
+
+      lookUpActions(state, symbol, action);
+
+      // Shifts, pops and ends of parses. The top is stored above the rest
+      // of the stack first, so a reduction of length 0 pops back to it and
+      // a shift has pushed it; the GOTO entries of the reductions are then
+      // looked up together.
+      for (int lane = 0; lane < LANES; lane++) {
+        int entry = symbol[lane] < 0 ? ACTION_ERROR : action[lane];
+        int kind = actionKind(entry);
+        gotoCell[lane] = -1;
+        if (!live[lane]) {
+          continue;
+        }
+        if (kind == ACTION_ACCEPT || kind == ACTION_ERROR) {
+          finish(lane, kind == ACTION_ACCEPT);
+          continue;
+        }
+        int *stack = stacks + lane * stride;
+        int top = depth[lane];
+        stack[top] = state[lane];
+        if (kind == ACTION_SHIFT) {
+          depth[lane] = top + 1;
+          state[lane] = actionTarget(entry);
+          const Unit *next = ++position[lane];
+          symbol[lane] = next < end[lane] ? symbolAt(next) : endMarker;
+        } else {
+          int production = actionTarget(entry);
+          top -= productionLength[production];
+          depth[lane] = top;
+          state[lane] = stack[top];
+          gotoCell[lane] =
+              stack[top] * numNonTerminals + productionLhs[production];
+        }
+      }
+
+      lookUpGotos(gotoCell, target);
+      for (int lane = 0; lane < LANES; lane++) {
+        if (gotoCell[lane] < 0) {
+          continue;
+        }
+        if (target[lane] < 0) {
+          finish(lane, false);
+        } else {
+          stacks[lane * stride + depth[lane]] = state[lane];
+          depth[lane]++;
+          state[lane] = target[lane];
+        }
+      }
+    }
+  }
+
+  // Function to give every lane's stack room for stride states
+  void growStacks(int stride) {
+    vector<int> storage(LANES * stride);
+    for (int lane = 0; lane < LANES && stackStride > 0; lane++) {
+      copy(stackStorage.begin() + lane * stackStride,
+           stackStorage.begin() + (lane + 1) * stackStride,
+           storage.begin() + lane * stride);
+    }
+    stackStorage.swap(storage);
+    stackStride = stride;
+  }
+
+  // Function to look up the ACTION entries of every lane. Lookaheads
+  // outside the grammar read column 0 and are treated as errors by the
+  // caller.
+  void lookUpActions(const int *state, const int *symbol, int *action) const {
+#ifdef __AVX2__
+    __m256i states = _mm256_load_si256((const __m256i *)state);
+    __m256i symbols = _mm256_max_epi32(
+        _mm256_load_si256((const __m256i *)symbol), _mm256_setzero_si256());
+    __m256i cells = _mm256_add_epi32(
+        _mm256_mullo_epi32(states, _mm256_set1_epi32(tables.numTerminals)),
+        symbols);
+    _mm256_store_si256((__m256i *)action,
+                       _mm256_i32gather_epi32(tables.action, cells, 4));
+#else
+    for (int lane = 0; lane < LANES; lane++) {
+      action[lane] = tables.actionAt(state[lane], max(symbol[lane], 0));
+    }
+#endif
+  }
+
+  // Function to look up the GOTO entries of the lanes with a cell to look
+  // up, leaving the other lanes' targets undefined
+  void lookUpGotos(const int *gotoCell, int *target) const {
+#ifdef __AVX2__
+    __m256i cells = _mm256_load_si256((const __m256i *)gotoCell);
+    __m256i mask = _mm256_cmpgt_epi32(cells, _mm256_set1_epi32(-1));
+    _mm256_store_si256((__m256i *)target,
+                       _mm256_mask_i32gather_epi32(_mm256_set1_epi32(-1),
+                                                   tables.goTo, cells, mask,
+                                                   4));
+#else
+    for (int lane = 0; lane < LANES; lane++) {
+      if (gotoCell[lane] >= 0) {
+        target[lane] = tables.goTo[gotoCell[lane]];
+      }
+    }
+#endif
+  }
+
+  TableView tables;
+  const Grammar &grammar;
+  // States below the top of every lane's stack, stackStride apart
+  vector<int> stackStorage;
+  int stackStride = 0;
+  vector<int> tokens;
+  vector<size_t> offsets;
+  vector<int> recordTokens;
+  vector<pair<const int *, const int *> > tokenRecords;
+};
+
+// Result of a push parser so far
+enum ParseStatus {
+  PARSE_PENDING,  // More input is needed to decide
+  PARSE_ACCEPTED, // The input was accepted at finish()
+  PARSE_FAILED    // The input has no valid continuation
+};
+
+// Parser that is handed its input in chunks, for data arriving from pipes
+// and sockets. feed() consumes a chunk and suspends at its end, and finish()
+// marks the end of the input. Nothing before the current lexeme is kept, so
+// memory is bounded by the depth of the state stack. An error is reported
+// by the feed() call that reads the first terminal with no action.
+class PushParser {
+public:
+  PushParser(const TableView &view, const Grammar &grammar)
+      : tables(view), grammar(grammar), lexer(grammar.lexer) {
+    stateStack.reserve(256);
+    reset();
+  }
+
+  // Function to start over on a new input
+  void reset() {
+    stateStack.assign(1, 0);
+    partialName.clear();
+    lexer.reset();
+    currentStatus = PARSE_PENDING;
+  }
+
+  ParseStatus status() const { return currentStatus; }
+
+  ParseStatus feed(const string &chunk) {
+    return feed(chunk.data(), chunk.size());
+  }
+
+  ParseStatus feed(const char *data, size_t length) {
+    if (currentStatus != PARSE_PENDING) {
+      return currentStatus;
+    }
+    const char *end = data + length;
+    auto emit = [this](int terminal) { return pushTerminal(terminal); };
+
+    if (!grammar.namedSymbols) {
+      for (const char *p = data; p < end && currentStatus == PARSE_PENDING;
+           p++) {
+        pushTerminal(tables.terminalIndex[(unsigned char)*p]);
+      }
+    } else if (grammar.hasLexer()) {
+      if (!lexer.scan(data, end, emit)) {
+        currentStatus = PARSE_FAILED;
+      }
+    } else {
+      feedNames(data, end);
+    }
+    return currentStatus;
+  }
+
+  // Function to end the input: flushes the last symbol and reads '$'
+  ParseStatus finish() {
+    if (currentStatus != PARSE_PENDING) {
+      return currentStatus;
+    }
+    auto emit = [this](int terminal) { return pushTerminal(terminal); };
+    if (grammar.hasLexer() && !lexer.finish(emit)) {
+      currentStatus = PARSE_FAILED;
+    } else if (!partialName.empty()) {
+      pushName(partialName.data(), partialName.size());
+      partialName.clear();
+    }
+    if (currentStatus == PARSE_PENDING) {
+      pushTerminal(tables.numTerminals - 1);
+    }
+    // '$' is either accepted or an error, so the input is decided here
+    if (currentStatus == PARSE_PENDING) {
+      currentStatus = PARSE_FAILED;
+    }
+    return currentStatus;
+  }
+
+private:
+  TableView tables;
+  const Grammar &grammar;
+  LexerStream lexer;
+  vector<int> stateStack;
+  string partialName; // Name cut off by the end of the last chunk
+  ParseStatus currentStatus;
+
+  // Function to run the reductions the terminal calls for and then shift
+  // it. Returns false once the input is decided.
+  bool pushTerminal(int terminal) {
+    if (terminal < 0) {
+      currentStatus = PARSE_FAILED;
+      return false;
+    }
+    while (true) {
+      int action = tables.actionAt(stateStack.back(), terminal);
+      if (actionKind(action) == ACTION_SHIFT) {
+        stateStack.push_back(actionTarget(action));
+        return true;
+      } else if (actionKind(action) == ACTION_REDUCE) {
+        int productionIndex = actionTarget(action);
+        stateStack.resize(stateStack.size() -
+                          tables.productionLength[productionIndex]);
+        int nextState = tables.gotoAt(stateStack.back(),
+                                      tables.productionLhs[productionIndex]);
+        if (nextState < 0) {
+          currentStatus = PARSE_FAILED;
+          return false;
+        }
+        stateStack.push_back(nextState);
+      } else {
+        currentStatus =
+            actionKind(action) == ACTION_ACCEPT ? PARSE_ACCEPTED : PARSE_FAILED;
+        return false;
+      }
+    }
+  }
+
+  void pushName(const char *name, size_t length) {
+    int id = grammar.symbols.find(name, length);
+    pushTerminal(id >= 0 && grammar.isTerminal(id) ? id : -1);
+  }
+
+  // Function to feed whitespace-separated names. Names inside the chunk are
+  // looked up in place; only a name running into the end of the chunk is
+  // copied, to be completed by the next one.
+  void feedNames(const char *p, const char *end) {
+    while (p < end && currentStatus == PARSE_PENDING) {
+      if (isspace((unsigned char)*p)) {
+        if (!partialName.empty()) {
+          pushName(partialName.data(), partialName.size());
+          partialName.clear();
+        }
+        p++;
+        continue;
+      }
+      const char *nameStart = p;
+      while (p < end && !isspace((unsigned char)*p)) {
+        p++;
+      }
+      if (p == end) {
+        partialName.append(nameStart, end);
+      } else if (!partialName.empty()) {
+        partialName.append(nameStart, p);
+        pushName(partialName.data(), partialName.size());
+        partialName.clear();
+      } else {
+        pushName(nameStart, p - nameStart);
+      }
+    }
+  }
+};
+
+// Bump allocator for parse trees. Memory is handed out from large blocks
+// and released all at once by reset(), which keeps the blocks for the next
+// parse, so a parser that has warmed up allocates nothing per node.
+class ParseArena {
+public:
+  explicit ParseArena(size_t blockSize = 1 << 16) : blockSize(blockSize) {}
+
+  void *allocate(size_t size) {
+    size = (size + 7) & ~(size_t)7;
+    if (current == blocks.size() || used + size > blocks[current].second) {
+      nextBlock(size);
+    }
+    void *memory = blocks[current].first.get() + used;
+    used += size;
+    return memory;
+  }
+
+  template <typename T> T *allocateArray(size_t count) {
+    return (T *)allocate(sizeof(T) * count);
+  }
+
+  // Function to release everything allocated so far, keeping the blocks
+  void reset() {
+    current = 0;
+    used = 0;
+  }
+
+  size_t numBlocks() const { return blocks.size(); }
+
+private:
+  size_t blockSize;
+  vector<pair<unique_ptr<char[]>, size_t> > blocks; // Memory and size
+  size_t current = 0;
+  size_t used = 0;
+
+  void nextBlock(size_t size) {
+    if (current < blocks.size()) {
+      current++;
+    }
+    used = 0;
+    if (current < blocks.size() && blocks[current].second >= size) {
+      return;
+    }
+    // No kept block is big enough, so a new one goes in at this point
+    size_t newSize = max(blockSize, size);
+    blocks.insert(blocks.begin() + current,
+                  make_pair(unique_ptr<char[]>(new char[newSize]), newSize));
+  }
+};
+
+// Node of a parse tree. Terminals are leaves with production -1; the span
+// is the range of terminals the node covers, [first, end).
+struct ParseNode {
+  int symbol;     // Grammar symbol id
+  int production; // Production reduced to build the node, -1 for a leaf
+  uint32_t first;
+  uint32_t end;
+  uint32_t numChildren;
+  ParseNode **children;
+};
+
+// Semantic actions for runParserWithActions that build a parse tree in an
+// arena
+struct TreeBuilder {
+  typedef ParseNode *Value;
+
+  TreeBuilder(ParseArena &arena, const TableView &tables)
+      : arena(arena), tables(tables) {}
+
+  Value shift(int terminal, size_t position) {
+    ParseNode *node = arena.allocateArray<ParseNode>(1);
+    node->symbol = terminal;
+    node->production = -1;
+    node->first = position;
+    node->end = position + 1;
+    node->numChildren = 0;
+    node->children = NULL;
+    nextPosition = position + 1;
+    return node;
+  }
+
+  Value reduce(int production, Value *children, int count) {
+    ParseNode *node = arena.allocateArray<ParseNode>(1);
+    node->symbol = tables.numTerminals + tables.productionLhs[production];
+    node->production = production;
+    // An empty RHS covers no terminals, at the point it was reduced
+    node->first = count > 0 ? children[0]->first : nextPosition;
+    node->end = count > 0 ? children[count - 1]->end : nextPosition;
+    node->numChildren = count;
+    node->children = arena.allocateArray<ParseNode *>(count);
+    copy(children, children + count, node->children);
+    return node;
+  }
+
+  ParseArena &arena;
+  const TableView &tables;
+  uint32_t nextPosition = 0;
+};
+
+// Parser that builds the parse tree of a record. The tree lives in the
+// parser's arena and stays valid until the next call to parse.
+class TreeParser {
+public:
+  TreeParser(const TableView &view, const Grammar &grammar)
+      : tables(view), grammar(grammar) {
+    stateStack.reserve(256);
+    valueStack.reserve(256);
+  }
+
+  // Function to parse [begin, end), returning the root or NULL on an error
+  const ParseNode *parse(const char *begin, const char *end) {
+    arena.reset();
+    text = begin;
+    TreeBuilder builder(arena, tables);
+    ParseNode *root = NULL;
+    bool accepted;
+
+    if (!grammar.namedSymbols) {
+      const int endMarker = tables.numTerminals - 1;
+      const char *currentPosition = begin;
+      accepted = runParserWithActions(
+          tables, stateStack, valueStack, builder,
+          [&]() {
+            return currentPosition < end
+                       ? tables.terminalIndex[(unsigned char)*currentPosition++]
+                       : endMarker;
+          },
+          root);
+    } else {
+      tokenizeInput(begin, end, grammar, tokens, &spans);
+      const int endMarker = tables.numTerminals - 1;
+      size_t currentPosition = 0;
+      accepted = runParserWithActions(
+          tables, stateStack, valueStack, builder,
+          [&]() {
+            return currentPosition < tokens.size() ? tokens[currentPosition++]
+                                                   : endMarker;
+          },
+          root);
+    }
+    return accepted ? root : NULL;
+  }
+
+  // Function to write a tree as nested lists, (lhs child ...), with the
+  // text of every leaf
+  void writeTree(ostream &out, const ParseNode *node) const {
+    if (node->production < 0) {
+      if (grammar.namedSymbols) {
+        const TokenSpan &span = spans[node->first];
+        out.write(text + span.first, span.second - span.first);
+      } else {
+        out << text[node->first];
+      }
+      return;
+    }
+    out << "(" << grammar.name(node->symbol);
+    for (uint32_t i = 0; i < node->numChildren; i++) {
+      out << " ";
+      writeTree(out, node->children[i]);
+    }
+    out << ")";
+  }
+
+  const ParseArena &memory() const { return arena; }
+
+private:
+  TableView tables;
+  const Grammar &grammar;
+  ParseArena arena;
+  vector<int> stateStack;
+  vector<ParseNode *> valueStack;
+  vector<int> tokens;
+  vector<TokenSpan> spans;
+  const char *text = NULL;
+};
+
+// Shared packed parse forest built by GlrParser. A node covers the input
+// terminals [start, end) with one symbol and is shared by every derivation
+// that uses it. Terminal nodes have no alternatives; every alternative of a
+// non-terminal node is a production followed by the nodes of its
+// right-hand side, so an ambiguous node keeps all of its derivations.
+struct ParseForest {
+  struct Node {
+    int symbol;
+    uint32_t start;
+    uint32_t end;
+    vector<vector<int> > alternatives;
+  };
+
+  vector<Node> nodes;
+  unordered_map<uint64_t, int> index; // (symbol, start, end) -> node
+  uint64_t span = 1; // One more than the largest position
+
+  void clear(size_t length) {
+    nodes.clear();
+    index.clear();
+    span = length + 1;
+  }
+
+  // Function to find or add the node of symbol over [start, end)
+  int node(int symbol, uint32_t start, uint32_t end) {
+    uint64_t key = (symbol * span + start) * span + end;
+    auto it = index.find(key);
+    if (it != index.end()) {
+      return it->second;
+    }
+    index.emplace(key, nodes.size());
+    nodes.push_back(Node{symbol, start, end, vector<vector<int> >()});
+    return nodes.size() - 1;
+  }
+
+  // Function to add a derivation to a node unless it already has it
+  void addAlternative(int node, const vector<int> &alternative) {
+    vector<vector<int> > &alternatives = nodes[node].alternatives;
+    if (find(alternatives.begin(), alternatives.end(), alternative) ==
+        alternatives.end()) {
+      alternatives.push_back(alternative);
+    }
+  }
+};
+
+// Generalized LR parser for tables with conflicts. It runs the ordinary
+// deterministic parser on a plain state stack until it reaches a cell with
+// a conflict, then turns the stack into a graph-structured stack and tries
+// every action of every conflict, one input terminal at a time, merging
+// the stacks that reach the same state at the same position. Once a single
+// stack is left, it goes back to the deterministic parser. Conflicts are
+// handled the way Tomita's algorithm with Farshi's correction does, so
+// grammars with empty productions and ambiguous grammars are parsed too.
+// With buildForest, every derivation is kept in a ParseForest.
+class GlrParser {
+public:
+  GlrParser(const ParseTables &tables, const Grammar &grammar,
+            bool buildForest)
+      : tables(tables), grammar(grammar), buildForest(buildForest),
+        numTerminals(tables.terminals.size()), conflicted(tables.numStates, false),
+        nodeAtState(tables.numStates, -1) {
+    for (const auto &conflict : tables.conflicts) {
+      conflicted[conflict.first / numTerminals] = true;
+    }
+  }
+
+  // Function to parse [begin, end), returning whether it is accepted
+  bool parse(const char *begin, const char *end) {
+    if (!grammar.namedSymbols) {
+      tokens.clear();
+      for (const char *p = begin; p < end; p++) {
+        tokens.push_back(tables.terminalIndex[(unsigned char)*p]);
+      }
+    } else {
+      tokenizeInput(begin, end, grammar, tokens, &spans);
+    }
+    return parseTokens(tokens.data(), tokens.size());
+  }
+
+  // Function to parse a sequence of terminal ids, followed by an implicit
+  // '$', returning whether it is accepted
+  bool parseTokens(const int *input, size_t count) {
+    this->input = input;
+    this->count = count;
+    root = -1;
+    glrTerminals = 0;
+    if (buildForest) {
+      forest.clear(count);
+    }
+    states.assign(1, 0);
+    values.assign(1, -1);
+    positions.assign(1, 0);
+    position = 0;
+    while (true) {
+      int result = runDeterministic();
+      if (result >= 0) {
+        return result;
+      }
+      result = runGeneralized();
+      if (result >= 0) {
+        return result;
+      }
+    }
+  }
+
+  // Forest of the last parse with buildForest, rooted at root()
+  const ParseForest &parseForest() const { return forest; }
+  int rootNode() const { return root; }
+
+  // Number of input terminals of the last parse read with more than one
+  // stack, counting the '$' at the end
+  size_t generalizedTerminals() const { return glrTerminals; }
+
+  // Function to write the forest under node as nested lists like
+  // TreeParser::writeTree. A node with several derivations is written as
+  // {#n alternative | alternative ...} the first time and as #n after that.
+  void writeForest(ostream &out, int node, const char *text) {
+    labels.assign(forest.nodes.size(), 0);
+    nextLabel = 0;
+    writeNode(out, node, text);
+  }
+
+private:
+  // Stack node of the graph-structured stack, with a link to every node
+  // below it. The value of a link is the forest node of the symbol between
+  // the two nodes, -1 without a forest.
+  struct Link {
+    int below;
+    int value;
+  };
+  struct StackVertex {
+    int state;
+    uint32_t position;
+    bool processed; // All reductions done at the current position
+    bool single;    // A single path leads from here down to the bottom
+    vector<Link> links;
+  };
+
+  int symbolAt(size_t position) const {
+    return position < count ? input[position] : numTerminals - 1;
+  }
+
+  // Function to get every action of a cell
+  const int *actionsAt(int state, int symbol, int &numActions) const {
+    int cell = state * numTerminals + symbol;
+    if (conflicted[state]) {
+      auto it = tables.conflicts.find(cell);
+      if (it != tables.conflicts.end()) {
+        numActions = it->second.size();
+        return it->second.data();
+      }
+    }
+    numActions = 1;
+    return &tables.action[cell];
+  }
+
+  // Function to make the forest node of a reduction over [start, end)
+  int reduceValue(int production, uint32_t start, const int *children) {
+    if (!buildForest) {
+      return -1;
+    }
+    int node = forest.node(grammar.lhs[production], start, position);
+    alternative.assign(1, production);
+    alternative.insert(alternative.end(), children,
+                       children + tables.productionLength[production]);
+    forest.addAlternative(node, alternative);
+    return node;
+  }
+
+  int shiftValue(int symbol) {
+    return buildForest ? forest.node(symbol, position, position + 1) : -1;
+  }
+
+  // Function to run the deterministic parser on the plain stack. Returns
+  // whether the input is accepted, or -1 on reaching a conflict. Without a
+  // forest only the states are kept.
+  //
+  // A cyclic grammar, with A =>+ A through unit or empty productions, can
+  // reduce forever without shifting, so the reductions between two shifts
+  // are bounded by what an acyclic grammar could need: a chain of distinct
+  // nonterminals over each span ending here. Past that the parse is handed
+  // to the generalized parser, whose merged stack tops end every cycle.
+  int runDeterministic() {
+    const int *action = tables.action.data();
+    const int *goTo = tables.goTo.data();
+    const int *productionLength = tables.productionLength.data();
+    const int *productionLhs = tables.productionLhs.data();
+    const int numGotoColumns = tables.nonTerminals.size();
+    size_t reductionsLeft = (states.size() + 1) * (numGotoColumns + 1);
+    while (true) {
+      int symbol = symbolAt(position);
+      if (symbol < 0) {
+        return 0;
+      }
+      int state = states.back();
+      int cell = state * numTerminals + symbol;
+      if (conflicted[state] && tables.conflicts.count(cell)) {
+        return -1;
+      }
+      int entry = action[cell];
+      if (actionKind(entry) == ACTION_SHIFT) {
+        states.push_back(actionTarget(entry));
+        if (buildForest) {
+          values.push_back(shiftValue(symbol));
+          positions.push_back(position + 1);
+        }
+        position++;
+        reductionsLeft = (states.size() + 1) * (numGotoColumns + 1);
+      } else if (actionKind(entry) == ACTION_REDUCE) {
+        if (reductionsLeft-- == 0) {
+          return -1;
+        }
+        int production = actionTarget(entry);
+        size_t base = states.size() - productionLength[production];
+        states.resize(base);
+        int target = goTo[states.back() * numGotoColumns +
+                          productionLhs[production]];
+        if (target < 0) {
+          return 0;
+        }
+        states.push_back(target);
+        if (buildForest) {
+          int value = reduceValue(production, positions[base - 1],
+                                  values.data() + base);
+          values.resize(base);
+          positions.resize(base);
+          values.push_back(value);
+          positions.push_back(position);
+        }
+      } else if (actionKind(entry) == ACTION_ACCEPT) {
+        root = buildForest ? values.back() : -1;
+        return 1;
+      } else {
+        return 0;
+      }
+    }
+  }
+
+  // Function to run the generalized parser from the plain stack until a
+  // single stack is left, which is copied back to the plain stack. Returns
+  // whether the input is accepted, or -1 to go on deterministically.
+  int runGeneralized() {
+    vertices.clear();
+    for (size_t i = 0; i < states.size(); i++) {
+      StackVertex vertex{states[i], buildForest ? positions[i] : 0, true, true,
+                         {}};
+      if (i > 0) {
+        vertex.links.push_back(Link{(int)i - 1, buildForest ? values[i] : -1});
+      }
+      vertices.push_back(vertex);
+    }
+    frontier.assign(1, vertices.size() - 1);
+
+    while (true) {
+      glrTerminals++;
+      int symbol = symbolAt(position);
+      if (symbol < 0) {
+        return 0;
+      }
+
+      // Reduce until every stack top wants to shift or accept
+      for (int vertex : frontier) {
+        nodeAtState[vertices[vertex].state] = vertex;
+        vertices[vertex].processed = false;
+      }
+      tasks.clear();
+      for (int vertex : frontier) {
+        tasks.push_back(Task{vertex, -1, -1});
+      }
+      while (!tasks.empty()) {
+        Task task = tasks.back();
+        tasks.pop_back();
+        runReductions(task, symbol);
+      }
+      // The stacks at this position are complete, and the ones shifted
+      // next are marked from them
+      markSinglePaths();
+
+      // Shift every stack that can, merging the ones that meet
+      nextFrontier.clear();
+      for (int vertex : frontier) {
+        nodeAtState[vertices[vertex].state] = -1;
+      }
+      int value = -1;
+      for (int vertex : frontier) {
+        int numActions;
+        const int *actions = actionsAt(vertices[vertex].state, symbol,
+                                       numActions);
+        for (int k = 0; k < numActions; k++) {
+          if (actionKind(actions[k]) == ACTION_ACCEPT) {
+            root = vertices[vertex].links.empty()
+                       ? -1
+                       : vertices[vertex].links[0].value;
+            for (int next : nextFrontier) {
+              nodeAtState[vertices[next].state] = -1;
+            }
+            return 1;
+          }
+          if (actionKind(actions[k]) != ACTION_SHIFT) {
+            continue;
+          }
+          if (value < 0) {
+            value = shiftValue(symbol);
+          }
+          int target = actionTarget(actions[k]);
+          int next = nodeAtState[target];
+          if (next < 0) {
+            next = vertices.size();
+            vertices.push_back(
+                StackVertex{target, (uint32_t)position + 1, false, false, {}});
+            nodeAtState[target] = next;
+            nextFrontier.push_back(next);
+          }
+          vertices[next].links.push_back(Link{vertex, value});
+        }
+      }
+      for (int next : nextFrontier) {
+        nodeAtState[vertices[next].state] = -1;
+      }
+      if (nextFrontier.empty()) {
+        return 0;
+      }
+      position++;
+      frontier.swap(nextFrontier);
+      markSinglePaths();
+
+      if (frontier.size() == 1 && vertices[frontier[0]].single) {
+        // Back to a plain stack, read off the single path
+        states.clear();
+        values.clear();
+        positions.clear();
+        for (int vertex = frontier[0]; vertex >= 0;) {
+          const StackVertex &v = vertices[vertex];
+          states.push_back(v.state);
+          positions.push_back(v.position);
+          values.push_back(v.links.empty() ? -1 : v.links[0].value);
+          vertex = v.links.empty() ? -1 : v.links[0].below;
+        }
+        reverse(states.begin(), states.end());
+        reverse(values.begin(), values.end());
+        reverse(positions.begin(), positions.end());
+        return -1;
+      }
+    }
+  }
+
+  // Reductions still to be done from a stack top: all of them, or only
+  // those whose path goes through the link linkIndex of linkVertex
+  struct Task {
+    int vertex;
+    int linkVertex;
+    int linkIndex;
+  };
+
+  // Function to do the reductions of a task on lookahead symbol
+  void runReductions(const Task &task, int symbol) {
+    StackVertex &top = vertices[task.vertex];
+    if (task.linkVertex < 0) {
+      top.processed = true;
+    }
+    int numActions;
+    const int *actions = actionsAt(top.state, symbol, numActions);
+    for (int k = 0; k < numActions; k++) {
+      if (actionKind(actions[k]) != ACTION_REDUCE) {
+        continue;
+      }
+      int production = actionTarget(actions[k]);
+      int length = tables.productionLength[production];
+      if (task.linkVertex >= 0 && length == 0) {
+        continue;
+      }
+      // Paths are collected first, as reducing adds links
+      paths.clear();
+      path.assign(length, -1);
+      collectPaths(task.vertex, length, task, false, length);
+      for (size_t p = 0; p < paths.size(); p += length + 1) {
+        int base = paths[p];
+        int value = reduceValue(production, vertices[base].position,
+                                paths.data() + p + 1);
+        int target = tables.gotoAt(vertices[base].state,
+                                   tables.productionLhs[production]);
+        if (target >= 0) {
+          addLink(target, base, value);
+        }
+      }
+    }
+  }
+
+  // Function to collect the paths of length links down from vertex into
+  // paths, each as its bottom vertex followed by the values along it from
+  // the bottom up. With a task restricted to a link, only paths through it.
+  void collectPaths(int vertex, int remaining, const Task &task, bool used,
+                    int length) {
+    if (remaining == 0) {
+      if (used || task.linkVertex < 0) {
+        paths.push_back(vertex);
+        paths.insert(paths.end(), path.begin(), path.end());
+      }
+      return;
+    }
+    const vector<Link> &links = vertices[vertex].links;
+    for (size_t i = 0; i < links.size(); i++) {
+      path[remaining - 1] = links[i].value;
+      collectPaths(links[i].below, remaining - 1, task,
+                   used || (vertex == task.linkVertex &&
+                            (int)i == task.linkIndex),
+                   length);
+    }
+  }
+
+  // Function to add a link from the stack top in state target at the
+  // current position down to base, adding the top if there is none
+  void addLink(int target, int base, int value) {
+    int vertex = nodeAtState[target];
+    if (vertex < 0) {
+      vertex = vertices.size();
+      vertices.push_back(
+          StackVertex{target, (uint32_t)position, false, false, {}});
+      vertices.back().links.push_back(Link{base, value});
+      nodeAtState[target] = vertex;
+      frontier.push_back(vertex);
+      tasks.push_back(Task{vertex, -1, -1});
+      return;
+    }
+    for (const Link &link : vertices[vertex].links) {
+      if (link.below == base) {
+        // The same symbol over the same span, whose forest node already
+        // has the new derivation
+        return;
+      }
+    }
+    vertices[vertex].links.push_back(Link{base, value});
+    // Stack tops already reduced have to redo the reductions that can now
+    // go through the new link
+    int linkIndex = vertices[vertex].links.size() - 1;
+    for (int other : frontier) {
+      if (vertices[other].processed) {
+        tasks.push_back(Task{other, vertex, linkIndex});
+      }
+    }
+  }
+
+  // Function to mark the stack tops with a single path to the bottom.
+  // Vertices below the current position do not change any more.
+  void markSinglePaths() {
+    for (int vertex : frontier) {
+      vertices[vertex].single = false;
+    }
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (int vertex : frontier) {
+        StackVertex &v = vertices[vertex];
+        bool single = v.links.size() == 1 && vertices[v.links[0].below].single;
+        if (single != v.single) {
+          v.single = single;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  void writeNode(ostream &out, int node, const char *text) {
+    const ParseForest::Node &n = forest.nodes[node];
+    if (n.alternatives.empty()) {
+      if (grammar.namedSymbols) {
+        const TokenSpan &span = spans[n.start];
+        out.write(text + span.first, span.second - span.first);
+      } else {
+        out << text[n.start];
+      }
+      return;
+    }
+    if (n.alternatives.size() > 1) {
+      if (labels[node] > 0) {
+        out << "#" << labels[node];
+        return;
+      }
+      labels[node] = ++nextLabel;
+      out << "{#" << labels[node] << " ";
+    }
+    for (size_t a = 0; a < n.alternatives.size(); a++) {
+      const vector<int> &alternative = n.alternatives[a];
+      out << (a > 0 ? " | " : "") << "(" << grammar.name(n.symbol);
+      for (size_t i = 1; i < alternative.size(); i++) {
+        out << " ";
+        writeNode(out, alternative[i], text);
+      }
+      out << ")";
+    }
+    if (n.alternatives.size() > 1) {
+      out << "}";
+    }
+  }
+
+  const ParseTables &tables;
+  const Grammar &grammar;
+  bool buildForest;
+  int numTerminals;
+  vector<char> conflicted; // States with a conflict in their row
+
+  const int *input = NULL;
+  size_t count = 0;
+  size_t position = 0;
+  vector<int> tokens;
+  vector<TokenSpan> spans;
+
+  // Plain stack of the deterministic parser: states, the forest nodes of
+  // the symbols between them and the positions where the states were
+  // pushed
+  vector<int> states;
+  vector<int> values;
+  vector<uint32_t> positions;
+
+  vector<StackVertex> vertices;
+  vector<int> frontier;     // Stack tops at the current position
+  vector<int> nextFrontier;
+  vector<int> nodeAtState;  // Stack top of every state, else -1
+  vector<Task> tasks;
+  vector<int> paths;
+  vector<int> path;
+  vector<int> alternative;
+
+  ParseForest forest;
+  int root = -1;
+  size_t glrTerminals = 0;
+  vector<int> labels;
+  int nextLabel = 0;
+};
+
+// Lexeme of an incrementally parsed document. examined is one past the last
+// byte the lexer looked at to produce this lexeme and those before it, so a
+// lexeme is still valid after an edit that starts at or after examined.
+struct Lexeme {
+  int terminal; // -1 for text no rule matches
+  uint32_t start;
+  uint32_t end;
+  uint32_t examined;
+};
+
+// Node of a state stack kept as a linked list, so that the stacks saved at
+// checkpoints share their common bottom part
+struct StackNode {
+  int state;
+  uint32_t depth;
+  StackNode *parent;
+};
+
+// State stack saved before the lexeme at position, with the outcome the
+// parse that saved it reached from there
+struct ParseCheckpoint {
+  uint32_t position;
+  StackNode *stack;
+  bool accepted;
+  uint32_t stop; // Lexeme the parse ended at
+};
+
+// Parser that keeps the previous parse of a document and, after an edit,
+// only re-lexes and re-parses around it. The state stack is saved every
+// CHECKPOINT_INTERVAL terminals. An edit relexes from the first lexeme whose
+// lookahead reached the edit until a lexeme starts where an old one did,
+// and reparses from the last checkpoint before the change until the stack
+// equals the one saved at an old checkpoint after it, from where the old
+// parse carries over unchanged. Checkpoints past a syntax error are kept
+// from the parse that last got there, so that fixing the error resumes it.
+// The lexeme and checkpoint arrays are spliced and shifted by the edit,
+// which is linear in the document but far cheaper than parsing it.
+class IncrementalParser {
+public:
+  static const uint32_t CHECKPOINT_INTERVAL = 64;
+
+  IncrementalParser(const TableView &view, const Grammar &grammar)
+      : tables(view), grammar(grammar) {}
+
+  // Function to parse a whole new document
+  bool parse(const string &text) {
+    document = text;
+    lexemes.clear();
+    appendLexemes(0, lexemes);
+    nodes.reset();
+    numNodes = 0;
+    checkpoints.clear();
+    loadStack(NULL);
+    ParseCheckpoint root = {0, snapshot(), false, 0};
+    checkpoints.push_back(root);
+    reparsedTokens = 0;
+    run(0, 0, vector<ParseCheckpoint>());
+    return accepted;
+  }
+
+  // Function to replace removed bytes at start with inserted and reparse
+  bool edit(size_t start, size_t removed, const string &inserted) {
+    size_t oldEditEnd = start + removed;
+    int64_t delta = (int64_t)inserted.size() - (int64_t)removed;
+    document.replace(start, removed, inserted);
+
+    // Relex from the end of the last lexeme that did not look at the edit
+    size_t first = upper_bound(lexemes.begin(), lexemes.end(), start,
+                               [](size_t position, const Lexeme &lexeme) {
+                                 return position < lexeme.examined;
+                               }) -
+                   lexemes.begin();
+    uint32_t position = first > 0 ? lexemes[first - 1].end : 0;
+    uint32_t examined = first > 0 ? lexemes[first - 1].examined : 0;
+    vector<Lexeme> fresh;
+    size_t last = first; // First old lexeme that survives
+    bool rejoined = false;
+    Lexeme lexeme;
+    while (lexAt(position, lexeme)) {
+      while (last < lexemes.size() &&
+             (lexemes[last].start < oldEditEnd ||
+              lexemes[last].start + delta < lexeme.start)) {
+        last++;
+      }
+      if (last < lexemes.size() && lexemes[last].start + delta == lexeme.start) {
+        rejoined = true;
+        break;
+      }
+      examined = max(examined, lexeme.examined);
+      lexeme.examined = examined;
+      fresh.push_back(lexeme);
+      position = lexeme.end;
+    }
+    if (!rejoined) {
+      last = lexemes.size();
+    }
+
+    // Splice the new lexemes in and move the ones after them
+    int64_t tokenDelta = (int64_t)fresh.size() - (int64_t)(last - first);
+    lexemes.erase(lexemes.begin() + first, lexemes.begin() + last);
+    lexemes.insert(lexemes.begin() + first, fresh.begin(), fresh.end());
+    for (size_t i = first + fresh.size(); i < lexemes.size(); i++) {
+      lexemes[i].start += delta;
+      lexemes[i].end += delta;
+      lexemes[i].examined = max<uint32_t>(lexemes[i].examined + delta, examined);
+      examined = lexemes[i].examined;
+    }
+
+    // Checkpoints of the current parse up to the edit stay where they are.
+    // Those from the first surviving lexeme on can resume the parse that
+    // saved them; everything in between is stale.
+    vector<ParseCheckpoint> resumable;
+    size_t kept = 0;
+    for (size_t i = 0; i < checkpoints.size(); i++) {
+      ParseCheckpoint checkpoint = checkpoints[i];
+      if (checkpoint.position <= first && checkpoint.position <= stopPosition) {
+        checkpoints[kept++] = checkpoint;
+      }
+      if (checkpoint.position >= last) {
+        checkpoint.position += tokenDelta;
+        checkpoint.stop += tokenDelta;
+        resumable.push_back(checkpoint);
+      }
+    }
+    checkpoints.resize(kept);
+
+    reparsedTokens = 0;
+    if (stopPosition < first) {
+      // The parse ends at an error before the edit, which it never reads
+      checkpoints.insert(checkpoints.end(), resumable.begin(), resumable.end());
+    } else {
+      loadStack(checkpoints.back().stack);
+      run(checkpoints.back().position, first + fresh.size(), resumable);
+    }
+
+    // Stack nodes of old parses are only dropped by a full parse
+    if (numNodes > 4 * (lexemes.size() + CHECKPOINT_INTERVAL)) {
+      string text;
+      text.swap(document);
+      parse(text);
+    }
+    return accepted;
+  }
+
+  bool isAccepted() const { return accepted; }
+  const string &text() const { return document; }
+  size_t numLexemes() const { return lexemes.size(); }
+  size_t lastReparsed() const { return reparsedTokens; }
+
+private:
+  TableView tables;
+  const Grammar &grammar;
+  string document;
+  vector<Lexeme> lexemes;
+  vector<ParseCheckpoint> checkpoints; // By position
+  ParseArena nodes;
+  size_t numNodes = 0;
+
+  // The working stack, with the list node of each depth below validDepth
+  vector<int> stack;
+  vector<StackNode *> stackNodes;
+  size_t validDepth = 0;
+
+  bool accepted = false;
+  uint32_t stopPosition = 0; // Lexeme the parse ended at
+  size_t reparsedTokens = 0;
+
+  // Function to read the lexeme at or after position, false at the end
+  bool lexAt(uint32_t position, Lexeme &lexeme) const {
+    const char *text = document.data();
+    uint32_t size = document.size();
+
+    if (!grammar.namedSymbols) {
+      if (position >= size) {
+        return false;
+      }
+      lexeme.terminal = tables.terminalIndex[(unsigned char)text[position]];
+      lexeme.start = position;
+      lexeme.end = position + 1;
+      lexeme.examined = position + 1;
+      return true;
+    }
+
+    if (!grammar.hasLexer()) {
+      while (position < size && isspace((unsigned char)text[position])) {
+        position++;
+      }
+      if (position == size) {
+        return false;
+      }
+      uint32_t end = position;
+      while (end < size && !isspace((unsigned char)text[end])) {
+        end++;
+      }
+      int id = grammar.symbols.find(text + position, end - position);
+      lexeme.terminal = id >= 0 && grammar.isTerminal(id) ? id : -1;
+      lexeme.start = position;
+      lexeme.end = end;
+      lexeme.examined = min(end + 1, size);
+      return true;
+    }
+
+    // Longest match as in LexerDfa::tokenize, tracking how far it looked
+    const LexerDfa &dfa = grammar.lexer;
+    uint32_t examined = position;
+    while (position < size) {
+      int state = 0;
+      int token = -1;
+      uint32_t tokenEnd = position;
+      uint32_t p = position;
+      while (p < size) {
+        state = dfa.next[state * dfa.numClasses +
+                         dfa.byteClass[(unsigned char)text[p]]];
+        p++;
+        if (state < 0) {
+          break;
+        }
+        if (dfa.runs[state].numRanges > 0) {
+          p = LexerDfa::skipRun(text + p, text + size, dfa.runs[state]) - text;
+        }
+        if (dfa.accept[state] != -1) {
+          token = dfa.accept[state];
+          tokenEnd = p;
+        }
+      }
+      examined = max(examined, p);
+      if (tokenEnd == position) {
+        // One byte no rule matches is a lexeme of its own
+        tokenEnd = position + 1;
+        token = -1;
+      }
+      if (token != LEX_SKIP) {
+        lexeme.terminal = token;
+        lexeme.start = position;
+        lexeme.end = tokenEnd;
+        lexeme.examined = examined;
+        return true;
+      }
+      position = tokenEnd;
+    }
+    return false;
+  }
+
+  void appendLexemes(uint32_t position, vector<Lexeme> &out) const {
+    Lexeme lexeme;
+    uint32_t examined = 0;
+    while (lexAt(position, lexeme)) {
+      examined = max(examined, lexeme.examined);
+      lexeme.examined = examined;
+      out.push_back(lexeme);
+      position = lexeme.end;
+    }
+  }
+
+  // Function to make the working stack the one saved in node, or just
+  // state 0 for NULL
+  void loadStack(StackNode *node) {
+    if (node == NULL) {
+      stack.assign(1, 0);
+      stackNodes.assign(1, NULL);
+      validDepth = 0;
+      return;
+    }
+    stack.resize(node->depth + 1);
+    stackNodes.resize(node->depth + 1);
+    for (StackNode *n = node; n != NULL; n = n->parent) {
+      stack[n->depth] = n->state;
+      stackNodes[n->depth] = n;
+    }
+    validDepth = stack.size();
+  }
+
+  // Function to save the working stack, creating list nodes only for the
+  // part pushed since the last save
+  StackNode *snapshot() {
+    for (size_t depth = validDepth; depth < stack.size(); depth++) {
+      StackNode *node = nodes.allocateArray<StackNode>(1);
+      node->state = stack[depth];
+      node->depth = depth;
+      node->parent = depth > 0 ? stackNodes[depth - 1] : NULL;
+      stackNodes[depth] = node;
+      numNodes++;
+    }
+    validDepth = stack.size();
+    return stackNodes.back();
+  }
+
+  static bool sameStack(const StackNode *a, const StackNode *b) {
+    while (a != b) {
+      if (a == NULL || b == NULL || a->state != b->state ||
+          a->depth != b->depth) {
+        return false;
+      }
+      a = a->parent;
+      b = b->parent;
+    }
+    return true;
+  }
+
+  // Function to parse from position with the working stack, saving
+  // checkpoints, until the input is decided or, from resumeFrom on, the
+  // stack matches a resumable checkpoint. Resumable checkpoints past an
+  // error are kept for later edits.
+  void run(uint32_t position, uint32_t resumeFrom,
+           const vector<ParseCheckpoint> &resumable) {
+    const int endMarker = tables.numTerminals - 1;
+    uint32_t numLexemes = lexemes.size();
+    uint32_t lastCheckpoint = position;
+    size_t candidate = 0;
+    bool resumed = false;
+
+    while (!step(position, endMarker, numLexemes)) {
+      while (candidate < resumable.size() &&
+             resumable[candidate].position < max(position, resumeFrom)) {
+        candidate++;
+      }
+      if (candidate < resumable.size() &&
+          resumable[candidate].position == position &&
+          sameStack(snapshot(), resumable[candidate].stack)) {
+        // From here on the parse that saved the checkpoint carries over
+        accepted = resumable[candidate].accepted;
+        stopPosition = resumable[candidate].stop;
+        resumed = true;
+        break;
+      }
+      if (position - lastCheckpoint >= CHECKPOINT_INTERVAL) {
+        ParseCheckpoint checkpoint = {position, snapshot(), false, 0};
+        checkpoints.push_back(checkpoint);
+        lastCheckpoint = position;
+      }
+    }
+
+    for (ParseCheckpoint &checkpoint : checkpoints) {
+      checkpoint.accepted = accepted;
+      checkpoint.stop = stopPosition;
+    }
+    // After an error, only checkpoints past it are kept, so that those up
+    // to stopPosition are always of the current parse
+    for (; candidate < resumable.size(); candidate++) {
+      if (resumed || resumable[candidate].position > stopPosition) {
+        checkpoints.push_back(resumable[candidate]);
+      }
+    }
+  }
+
+  // Function to read the lexeme at position: its reductions, then its
+  // shift. Returns true, with accepted and stopPosition set, once the
+  // input is decided.
+  bool step(uint32_t &position, int endMarker, uint32_t numLexemes) {
+    int terminal = position < numLexemes ? lexemes[position].terminal
+                                         : endMarker;
+    reparsedTokens++;
+    if (terminal < 0) {
+      accepted = false;
+      stopPosition = position;
+      return true;
+    }
+
+    while (true) {
+      int action = tables.actionAt(stack.back(), terminal);
+      if (actionKind(action) == ACTION_SHIFT) {
+        stack.push_back(actionTarget(action));
+        stackNodes.push_back(NULL);
+        position++;
+        return false;
+      } else if (actionKind(action) == ACTION_REDUCE) {
+        int productionIndex = actionTarget(action);
+        stack.resize(stack.size() - tables.productionLength[productionIndex]);
+        stackNodes.resize(stack.size());
+        validDepth = min(validDepth, stack.size());
+        int nextState = tables.gotoAt(stack.back(),
+                                      tables.productionLhs[productionIndex]);
+        if (nextState < 0) {
+          accepted = false;
+          stopPosition = position;
+          return true;
+        }
+        stack.push_back(nextState);
+        stackNodes.push_back(NULL);
+      } else {
+        accepted = actionKind(action) == ACTION_ACCEPT;
+        stopPosition = position;
+        return true;
+      }
+    }
+  }
+};
+
+// Function to render the RHS of an item with a '.' at its dot. Named
+// symbols are separated by spaces, characters are not.
+string itemRhsText(LR0Item item, const Grammar &grammar) {
+  string separator = grammar.namedSymbols ? " " : "";
+  const vector<SymbolId> &rhs = grammar.rhs[itemProduction(item)];
+  vector<string> parts;
+  for (SymbolId symbol : rhs) {
+    parts.push_back(grammar.name(symbol));
+  }
+  parts.insert(parts.begin() + itemDot(item), ".");
+
+  string text;
+  for (size_t j = 0; j < parts.size(); j++) {
+    text += (j > 0 ? separator : "") + parts[j];
+  }
+  return text;
+}
+
+// Function to display the canonical collection of LR(0) items
+void displayCanonicalCollection(const vector<ItemSet> &canonicalCollection,
+                                const Grammar &grammar) {
+  for (size_t i = 0; i < canonicalCollection.size(); i++) {
+    cout << "I" << i << ":" << endl;
+
+    // Items are listed by LHS and then by their rendered RHS
+    vector<pair<string, string> > lines;
+    for (LR0Item item : canonicalCollection[i]) {
+      int production = itemProduction(item);
+      lines.push_back(make_pair(grammar.name(grammar.lhs[production]),
+                                itemRhsText(item, grammar)));
+    }
+    sort(lines.begin(), lines.end());
+
+    for (const pair<string, string> &line : lines) {
+      cout << line.first << " -> " << line.second << endl;
+    }
+    cout << endl;
+  }
+}
+
+// A cell of the ACTION table that items of its state want different
+// actions in, with the items that want each of them
+struct TableConflict {
+  int state;
+  int terminal;
+  vector<pair<int, vector<LR0Item> > > actions; // (action, items) pairs
+};
+
+// Function to collect the conflicts of tables built from
+// canonicalCollection, in the order of their cells. A shift is wanted by
+// the items with the dot before the terminal, a reduction or the accept by
+// the completed item of its production.
+vector<TableConflict> collectConflicts(
+    const Grammar &grammar, const vector<ItemSet> &canonicalCollection,
+    const ParseTables &tables) {
+  vector<TableConflict> conflicts;
+  int numTerminals = tables.terminals.size();
+  for (const pair<const int, vector<int> > &cell : tables.conflicts) {
+    TableConflict conflict;
+    conflict.state = cell.first / numTerminals;
+    conflict.terminal = cell.first % numTerminals;
+    for (int action : cell.second) {
+      vector<LR0Item> items;
+      for (LR0Item item : canonicalCollection[conflict.state]) {
+        int production = itemProduction(item);
+        int dot = itemDot(item);
+        const vector<SymbolId> &rhs = grammar.rhs[production];
+        if (actionKind(action) == ACTION_SHIFT) {
+          if (dot < (int)rhs.size() && rhs[dot] == conflict.terminal) {
+            items.push_back(item);
+          }
+        } else if (dot == (int)rhs.size() &&
+                   production == (actionKind(action) == ACTION_ACCEPT
+                                      ? 0
+                                      : actionTarget(action))) {
+          items.push_back(item);
+        }
+      }
+      conflict.actions.push_back(make_pair(action, items));
+    }
+    conflicts.push_back(conflict);
+  }
+  return conflicts;
+}
+
+// Function to name the kind of a conflict: shift-reduce when one of its
+// actions is a shift, else reduce-reduce
+string conflictKind(const TableConflict &conflict) {
+  for (const pair<int, vector<LR0Item> > &action : conflict.actions) {
+    if (actionKind(action.first) == ACTION_SHIFT) {
+      return "shift-reduce";
+    }
+  }
+  return "reduce-reduce";
+}
+
+// Function to write a conflict report, one block per conflict listing
+// every competing action with the items behind it:
+//   State 4 on '+': shift-reduce
+//     Shift 6      E -> E . + E
+//     Reduce 1     E -> E + E .
+// or a JSON array of {"state", "terminal", "kind", "actions"} objects
+void writeConflictReport(ostream &out, const Grammar &grammar,
+                         const vector<TableConflict> &conflicts, bool json) {
+  // Function to render an item as LHS -> RHS
+  auto itemText = [&grammar](LR0Item item) {
+    return grammar.name(grammar.lhs[itemProduction(item)]) + " -> " +
+           itemRhsText(item, grammar);
+  };
+
+  if (json) {
+    out << "[";
+    for (size_t i = 0; i < conflicts.size(); i++) {
+      const TableConflict &conflict = conflicts[i];
+      out << (i > 0 ? ",\n " : "\n ") << "{\"state\": " << conflict.state
+          << ", \"terminal\": " << jsonString(grammar.name(conflict.terminal))
+          << ", \"kind\": \"" << conflictKind(conflict)
+          << "\", \"actions\": [";
+      for (size_t j = 0; j < conflict.actions.size(); j++) {
+        int action = conflict.actions[j].first;
+        static const char *kinds[] = {"error", "shift", "reduce", "accept"};
+        out << (j > 0 ? ", " : "") << "{\"action\": \""
+            << kinds[actionKind(action)] << "\"";
+        if (actionKind(action) != ACTION_ACCEPT) {
+          out << ", \"target\": " << actionTarget(action);
+        }
+        out << ", \"items\": [";
+        const vector<LR0Item> &items = conflict.actions[j].second;
+        for (size_t k = 0; k < items.size(); k++) {
+          out << (k > 0 ? ", " : "") << jsonString(itemText(items[k]));
+        }
+        out << "]}";
+      }
+      out << "]}";
+    }
+    out << (conflicts.empty() ? "]" : "\n]") << endl;
+    return;
+  }
+
+  for (const TableConflict &conflict : conflicts) {
+    out << "State " << conflict.state << " on '"
+        << grammar.name(conflict.terminal) << "': " << conflictKind(conflict)
+        << endl;
+    for (const pair<int, vector<LR0Item> > &action : conflict.actions) {
+      string name = describeAction(action.first);
+      for (LR0Item item : action.second) {
+        out << "  " << left << setw(12) << name << right << " "
+            << itemText(item) << endl;
+        name = "";
+      }
+    }
+  }
+}
+
+// Function to describe the conflicts of tables for the modes that follow a
+// single action per cell and so refuse them, or "" when there are none
+string describeConflicts(const ParseTables &tables) {
+  if (tables.conflicts.empty()) {
+    return "";
+  }
+  ostringstream out;
+  out << "the grammar has " << tables.conflicts.size() << " conflict"
+      << (tables.conflicts.size() == 1 ? "" : "s")
+      << ", which only the GLR parser follows (see --conflicts)";
+  return out.str();
+}
+
+// Function to read productions of the form S->AA from a stream until an empty
+// line or the end of the stream
+int readProductions(istream &in, vector<char> &nonTerminals,
+                    vector<char> &terminals,
+                    vector<vector<string> > &productions) {
+  nonTerminals.push_back('D');
+
+  bool first = true;
+
+  string line;
+
+  while (getline(in, line))
+  {
+      vector<string> production;
+      vector<string> productionZero;
+      if (!line.empty() && line.back() == '\r') {
+          line.pop_back();
+      }
+      if (line.empty()) {
+          break;
+      }
+      if(isupper(line[0]) && line[1] == '-' && line[2] == '>'){
+        auto it = find(nonTerminals.begin(),
+                 nonTerminals.end(), line[0]);
+
+        if (it == nonTerminals.end()) {
+          nonTerminals.push_back(line[0]);
+        }
+
+        if(first){
+          productionZero.push_back("D");
+          productionZero.push_back(string(1,line[0]));
+          productions.push_back(productionZero);
+          first = false;
+        }
+
+        production.push_back(string(1,line[0]));
+      }
+
+      for(size_t i = 3; i < line.length(); i++){
+        if(!isupper(line[i])){
+          auto it = find(terminals.begin(),
+                 terminals.end(), line[i]);
+          if (it == terminals.end()) {
+            terminals.push_back(line[i]);
+          }
+        }
+      }
+      production.push_back(line.substr(3, line.length()-1));
+
+      productions.push_back(production);
+  }
+  return 0;
+}
+
+int getProductions(vector<char> &nonTerminals, vector<char> &terminals, vector<vector<string> > &productions){
+  cout << "Please enter your grammar in the form \n\tS->AA\n\tA->aA\n\tA->b\n" << endl;
+
+  cin.ignore();
+
+  return readProductions(cin, nonTerminals, terminals, productions);
+}
+
+void getQuestionProductions(vector<char> &nonTerminals, vector<char> &terminals, vector<vector<string> > &productions){
+  nonTerminals.push_back('D');
+  nonTerminals.push_back('E');
+  nonTerminals.push_back('T');
+  nonTerminals.push_back('F');
+
+  terminals.push_back('*');
+  terminals.push_back('+');
+  terminals.push_back('i');
+  terminals.push_back('(');
+  terminals.push_back(')');
+
+  vector<string> prodZero;
+  vector<string> prodOne;
+  vector<string> prodTwo;
+  vector<string> prodThree;
+  vector<string> prodFour;
+  vector<string> prodFive;
+  vector<string> prodSix;
+
+  prodZero.push_back("D");
+  prodZero.push_back("E");
+
+  prodOne.push_back("E");
+  prodOne.push_back("E+T");
+
+  prodTwo.push_back("E");
+  prodTwo.push_back("T");
+
+  prodThree.push_back("T");
+  prodThree.push_back("T*F");
+
+  prodFour.push_back("T");
+  prodFour.push_back("F");
+
+  prodFive.push_back("F");
+  prodFive.push_back("(E)");
+
+  prodSix.push_back("F");
+  prodSix.push_back("i");
+
+  productions.push_back(prodZero);
+  productions.push_back(prodOne);
+  productions.push_back(prodTwo);
+  productions.push_back(prodThree);
+  productions.push_back(prodFour);
+  productions.push_back(prodFive);
+  productions.push_back(prodSix);
+}
+
+// ACTION/GOTO tables compressed in three steps:
+//  - identical rows are stored once and every state maps to its row
+//  - an ACTION row whose reduce entries all use one production keeps that
+//    reduce as its default; one bit per cell tells whether the dense entry
+//    was an error, so lookups stay exact
+//  - the remaining entries of all rows are overlaid in one comb vector,
+//    every row at its own displacement, with a check array naming the row
+//    that owns each slot
+struct CompressedTables {
+  int numTerminals = 0;
+  int numNonTerminals = 0;
+  int wordsPerRow = 0;
+  vector<int> actionRow;      // State -> merged ACTION row
+  vector<int> gotoRow;        // State -> merged GOTO row
+  vector<int> defaultAction;  // Merged ACTION row -> default reduce
+  vector<uint64_t> validBits; // Merged ACTION row x terminal, set if no error
+  vector<int> actionBase;
+  vector<int> actionNext;
+  vector<int> actionCheck;
+  vector<int> gotoBase;
+  vector<int> gotoNext;
+  vector<int> gotoCheck;
+
+  int actionAt(int state, int terminal) const {
+    int row = actionRow[state];
+    if (!((validBits[row * wordsPerRow + terminal / 64] >> (terminal % 64)) &
+          1)) {
+      return ACTION_ERROR;
+    }
+    int slot = actionBase[row] + terminal;
+    return actionCheck[slot] == row ? actionNext[slot] : defaultAction[row];
+  }
+
+  int gotoAt(int state, int nonTerminal) const {
+    int row = gotoRow[state];
+    int slot = gotoBase[row] + nonTerminal;
+    return gotoCheck[slot] == row ? gotoNext[slot] : -1;
+  }
+
+  size_t byteSize() const {
+    return sizeof(int) *
+               (actionRow.size() + gotoRow.size() + defaultAction.size() +
+                actionBase.size() + actionNext.size() + actionCheck.size() +
+                gotoBase.size() + gotoNext.size() + gotoCheck.size()) +
+           sizeof(uint64_t) * validBits.size();
+  }
+};
+
+// Function to map every row of a dense row-major table to the first row
+// with the same contents, returning the representative rows in order
+vector<int> mergeIdenticalRows(const vector<int> &table, int numRows,
+                               int numColumns, vector<int> &rowOf) {
+  unordered_map<string, int> rowIndex;
+  vector<int> uniqueRows;
+  rowOf.assign(numRows, 0);
+
+  for (int r = 0; r < numRows; r++) {
+    string key((const char *)&table[(size_t)r * numColumns],
+               numColumns * sizeof(int));
+    auto it = rowIndex.find(key);
+    if (it == rowIndex.end()) {
+      it = rowIndex.emplace(key, uniqueRows.size()).first;
+      uniqueRows.push_back(r);
+    }
+    rowOf[r] = it->second;
+  }
+  return uniqueRows;
+}
+
+// Function to overlay sparse rows of (column, value) entries in one comb
+// vector with first-fit row displacement. The arrays are padded by
+// numColumns so that base + column is always in range.
+void packCombVector(const vector<vector<pair<int, int> > > &rows,
+                    int numColumns, vector<int> &base, vector<int> &next,
+                    vector<int> &check) {
+  base.assign(rows.size(), 0);
+  next.clear();
+  check.clear();
+
+  // Fill the densest rows first, they are the hardest to place
+  vector<int> order(rows.size());
+  for (size_t r = 0; r < rows.size(); r++) {
+    order[r] = r;
+  }
+  stable_sort(order.begin(), order.end(), [&rows](int a, int b) {
+    return rows[a].size() > rows[b].size();
+  });
+
+  size_t firstFree = 0;
+  for (int r : order) {
+    const vector<pair<int, int> > &entries = rows[r];
+    if (entries.empty()) {
+      continue;
+    }
+
+    int offset = (int)firstFree - entries[0].first;
+    while (true) {
+      bool fits = offset >= 0;
+      for (size_t e = 0; fits && e < entries.size(); e++) {
+        size_t slot = offset + entries[e].first;
+        fits = slot >= check.size() || check[slot] < 0;
+      }
+      if (fits) {
+        break;
+      }
+      offset++;
+    }
+
+    base[r] = offset;
+    for (const pair<int, int> &entry : entries) {
+      size_t slot = offset + entry.first;
+      if (slot >= check.size()) {
+        check.resize(slot + 1, -1);
+        next.resize(slot + 1, 0);
+      }
+      check[slot] = r;
+      next[slot] = entry.second;
+    }
+    while (firstFree < check.size() && check[firstFree] >= 0) {
+      firstFree++;
+    }
+  }
+
+  check.resize(check.size() + numColumns, -1);
+  next.resize(next.size() + numColumns, 0);
+}
+
+// Function to build the compressed form of a set of tables
+CompressedTables compressTables(const ParseTables &tables) {
+  CompressedTables compressed;
+  int numStates = tables.numStates;
+  int numTerminals = tables.terminals.size();
+  int numNonTerminals = tables.nonTerminals.size();
+  compressed.numTerminals = numTerminals;
+  compressed.numNonTerminals = numNonTerminals;
+  compressed.wordsPerRow = (numTerminals + 63) / 64;
+
+  // ACTION: merge rows, pick default reductions, pack what is left
+  vector<int> actionRows = mergeIdenticalRows(
+      tables.action, numStates, numTerminals, compressed.actionRow);
+  compressed.validBits.assign(actionRows.size() * compressed.wordsPerRow, 0);
+  compressed.defaultAction.assign(actionRows.size(), ACTION_ERROR);
+  vector<vector<pair<int, int> > > actionEntries(actionRows.size());
+
+  for (size_t row = 0; row < actionRows.size(); row++) {
+    const int *cells = &tables.action[(size_t)actionRows[row] * numTerminals];
+
+    int reduce = ACTION_ERROR;
+    bool singleReduce = true;
+    for (int t = 0; t < numTerminals; t++) {
+      if (actionKind(cells[t]) == ACTION_REDUCE) {
+        singleReduce = singleReduce && (reduce == ACTION_ERROR ||
+                                        reduce == cells[t]);
+        reduce = cells[t];
+      }
+    }
+    if (singleReduce) {
+      compressed.defaultAction[row] = reduce;
+    }
+
+    for (int t = 0; t < numTerminals; t++) {
+      if (actionKind(cells[t]) == ACTION_ERROR) {
+        continue;
+      }
+      compressed.validBits[row * compressed.wordsPerRow + t / 64] |=
+          (uint64_t)1 << (t % 64);
+      if (cells[t] != compressed.defaultAction[row]) {
+        actionEntries[row].push_back(make_pair(t, cells[t]));
+      }
+    }
+  }
+  packCombVector(actionEntries, numTerminals, compressed.actionBase,
+                 compressed.actionNext, compressed.actionCheck);
+
+  // GOTO: merge rows and pack the non-empty entries
+  vector<int> gotoRows = mergeIdenticalRows(tables.goTo, numStates,
+                                            numNonTerminals, compressed.gotoRow);
+  vector<vector<pair<int, int> > > gotoEntries(gotoRows.size());
+  for (size_t row = 0; row < gotoRows.size(); row++) {
+    const int *cells = &tables.goTo[(size_t)gotoRows[row] * numNonTerminals];
+    for (int n = 0; n < numNonTerminals; n++) {
+      if (cells[n] >= 0) {
+        gotoEntries[row].push_back(make_pair(n, cells[n]));
+      }
+    }
+  }
+  packCombVector(gotoEntries, numNonTerminals, compressed.gotoBase,
+                 compressed.gotoNext, compressed.gotoCheck);
+
+  return compressed;
+}
+
+// Function to hash the productions of a grammar by symbol name. The hash
+// identifies the tables a cache file was built from.
+uint64_t hashGrammar(const Grammar &grammar) {
+  uint64_t hash = 14695981039346656037ULL;
+  auto mix = [&hash](const string &text) {
+    for (unsigned char c : text) {
+      hash = (hash ^ c) * 1099511628211ULL;
+    }
+    // Separator, so that names cannot run into each other
+    hash = (hash ^ 0xFF) * 1099511628211ULL;
+  };
+  mix(grammar.namedSymbols ? "named" : "characters");
+  for (const LexerRule &rule : grammar.lexerRules) {
+    mix(rule.terminal < 0 ? "%skip" : grammar.name(rule.terminal));
+    mix(rule.pattern);
+  }
+  for (int i = 0; i < grammar.numSymbols(); i++) {
+    mix(grammar.name(i));
+  }
+  for (size_t p = 0; p < grammar.lhs.size(); p++) {
+    mix(grammar.name(grammar.lhs[p]));
+    for (SymbolId symbol : grammar.rhs[p]) {
+      mix(grammar.name(symbol));
+    }
+    mix("\n");
+  }
+  return hash;
+}
+
+// Function to checksum the payload of a table cache
+uint64_t checksumBytes(const char *data, size_t size) {
+  uint64_t hash = 14695981039346656037ULL;
+  for (size_t i = 0; i < size; i++) {
+    hash = (hash ^ (unsigned char)data[i]) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+// Layout of a table cache file: this header followed by the int32 arrays
+// terminalIndex[256], action, goTo, productionLhs and productionLength.
+// The version changes whenever the layout or the table contents change.
+const char TABLE_CACHE_MAGIC[8] = {'S', 'L', 'R', 'T', 'B', 'L', '\0', '\0'};
+const uint32_t TABLE_CACHE_VERSION = 2;
+
+struct TableCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t headerSize;
+  uint64_t grammarHash;
+  uint32_t numStates;
+  uint32_t numTerminals;
+  uint32_t numNonTerminals;
+  uint32_t numProductions;
+  uint64_t payloadSize;
+  uint64_t payloadChecksum;
+};
+
+static_assert(sizeof(int) == sizeof(int32_t),
+              "table cache files store the tables as int32 arrays");
+
+// Function to write the tables to a cache file. The file is written under a
+// temporary name and renamed into place, so a concurrent reader never sees
+// a partial file.
+bool writeTableCache(const string &path, const ParseTables &tables,
+                     uint64_t grammarHash) {
+  vector<char> payload;
+  auto append = [&payload](const int *values, size_t count) {
+    const char *bytes = (const char *)values;
+    payload.insert(payload.end(), bytes, bytes + count * sizeof(int));
+  };
+  append(tables.terminalIndex, 256);
+  append(tables.action.data(), tables.action.size());
+  append(tables.goTo.data(), tables.goTo.size());
+  append(tables.productionLhs.data(), tables.productionLhs.size());
+  append(tables.productionLength.data(), tables.productionLength.size());
+
+  TableCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, TABLE_CACHE_MAGIC, sizeof(header.magic));
+  header.version = TABLE_CACHE_VERSION;
+  header.headerSize = sizeof(header);
+  header.grammarHash = grammarHash;
+  header.numStates = tables.numStates;
+  header.numTerminals = tables.terminals.size();
+  header.numNonTerminals = tables.nonTerminals.size();
+  header.numProductions = tables.productionLhs.size();
+  header.payloadSize = payload.size();
+  header.payloadChecksum = checksumBytes(payload.data(), payload.size());
+
+  string temporaryPath = path + ".tmp" + to_string(getpid());
+  FILE *file = fopen(temporaryPath.c_str(), "wb");
+  if (file == NULL) {
+    return false;
+  }
+  bool written = fwrite(&header, sizeof(header), 1, file) == 1 &&
+                 fwrite(payload.data(), 1, payload.size(), file) ==
+                     payload.size();
+  written = fclose(file) == 0 && written;
+  if (!written || rename(temporaryPath.c_str(), path.c_str()) != 0) {
+    remove(temporaryPath.c_str());
+    return false;
+  }
+  return true;
+}
+
+// Table cache file mapped into memory. The tables are used in place, so
+// loading costs one mmap and a checksum pass over the file.
+class TableCacheFile {
+public:
+  TableCacheFile() {}
+  TableCacheFile(const TableCacheFile &) = delete;
+  TableCacheFile &operator=(const TableCacheFile &) = delete;
+  ~TableCacheFile() { close(); }
+
+  // Function to map a cache file, returning false when it is missing,
+  // damaged, from another format version or built from another grammar
+  bool open(const string &path, uint64_t grammarHash) {
+    close();
+
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0 || (size_t)info.st_size < sizeof(TableCacheHeader)) {
+      ::close(fd);
+      return false;
+    }
+    size = info.st_size;
+    data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED) {
+      data = NULL;
+      return false;
+    }
+
+    if (!validate(grammarHash)) {
+      close();
+      return false;
+    }
+    return true;
+  }
+
+  void close() {
+    if (data != NULL) {
+      munmap(data, size);
+      data = NULL;
+    }
+  }
+
+  TableView view() const {
+    const TableCacheHeader *header = (const TableCacheHeader *)data;
+    const int *arrays = (const int *)((const char *)data + header->headerSize);
+
+    TableView view;
+    view.numStates = header->numStates;
+    view.numTerminals = header->numTerminals;
+    view.numNonTerminals = header->numNonTerminals;
+    view.terminalIndex = arrays;
+    view.action = view.terminalIndex + 256;
+    view.goTo = view.action + (size_t)view.numStates * view.numTerminals;
+    view.productionLhs =
+        view.goTo + (size_t)view.numStates * view.numNonTerminals;
+    view.productionLength = view.productionLhs + header->numProductions;
+    return view;
+  }
+
+private:
+  void *data = NULL;
+  size_t size = 0;
+
+  bool validate(uint64_t grammarHash) const {
+    const TableCacheHeader *header = (const TableCacheHeader *)data;
+    if (memcmp(header->magic, TABLE_CACHE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != TABLE_CACHE_VERSION ||
+        header->headerSize != sizeof(TableCacheHeader) ||
+        header->grammarHash != grammarHash) {
+      return false;
+    }
+
+    uint64_t expectedSize =
+        sizeof(int) * (256 +
+                       (uint64_t)header->numStates * header->numTerminals +
+                       (uint64_t)header->numStates * header->numNonTerminals +
+                       2 * (uint64_t)header->numProductions);
+    if (header->payloadSize != expectedSize ||
+        size != header->headerSize + header->payloadSize) {
+      return false;
+    }
+
+    return checksumBytes((const char *)data + header->headerSize,
+                         header->payloadSize) == header->payloadChecksum;
+  }
+};
+
+// Buffered writer that collects ACCEPT/ERROR lines and hands them to the
+// output stream in large blocks
+struct ResultWriter {
+  FILE *out;
+  char buffer[1 << 16];
+  size_t used = 0;
+
+  explicit ResultWriter(FILE *stream) : out(stream) {}
+  ~ResultWriter() { flush(); }
+
+  void write(bool accepted) {
+    static const char acceptLine[] = "ACCEPT\n";
+    static const char errorLine[] = "ERROR\n";
+    const char *text = accepted ? acceptLine : errorLine;
+    size_t length = accepted ? sizeof(acceptLine) - 1 : sizeof(errorLine) - 1;
+
+    if (used + length > sizeof(buffer)) {
+      flush();
+    }
+    memcpy(buffer + used, text, length);
+    used += length;
+  }
+
+  void flush() {
+    if (used > 0) {
+      fwrite(buffer, 1, used, out);
+      used = 0;
+    }
+  }
+};
+
+// Function to parse newline-delimited records read from a stream and write
+// one ACCEPT/ERROR line per record. Records are parsed in place inside a
+// single read buffer, which only grows when one record does not fit in it.
+// With lockstep, the records of every buffer are parsed together by a
+// LockstepParser.
+void parseBatch(FILE *in, FILE *out, const TableView &tables,
+                const Grammar &grammar, bool lockstep = false) {
+  vector<char> buffer(1 << 20);
+  RecordParser parser(tables, grammar);
+  LockstepParser lockstepParser(tables, grammar);
+  vector<pair<const char *, const char *> > records;
+  vector<char> results;
+  ResultWriter writer(out);
+
+  auto parseLine = [&](const char *begin, const char *end) {
+    if (lockstep) {
+      records.push_back(make_pair(begin, end));
+    } else {
+      writer.write(parser.parse(begin, end));
+    }
+  };
+  // Function to parse the records collected from the buffer before it
+  // changes under them
+  auto flushRecords = [&]() {
+    if (records.empty()) {
+      return;
+    }
+    lockstepParser.parse(records, results);
+    for (char accepted : results) {
+      writer.write(accepted);
+    }
+    records.clear();
+  };
+
+  size_t filled = 0;
+  while (true) {
+    size_t bytesRead = fread(buffer.data() + filled, 1,
+                             buffer.size() - filled, in);
+    filled += bytesRead;
+    bool endOfInput = bytesRead == 0;
+
+    const char *lineStart = buffer.data();
+    const char *bufferEnd = buffer.data() + filled;
+    const char *newline;
+    while ((newline = (const char *)memchr(lineStart, '\n',
+                                           bufferEnd - lineStart)) != NULL) {
+      const char *lineEnd = newline;
+      if (lineEnd > lineStart && lineEnd[-1] == '\r') {
+        lineEnd--;
+      }
+      parseLine(lineStart, lineEnd);
+      lineStart = newline + 1;
+    }
+
+    size_t remaining = bufferEnd - lineStart;
+    if (endOfInput) {
+      // A final record without a trailing newline
+      if (remaining > 0) {
+        const char *lineEnd = bufferEnd;
+        if (lineEnd[-1] == '\r') {
+          lineEnd--;
+        }
+        parseLine(lineStart, lineEnd);
+      }
+      flushRecords();
+      break;
+    }
+
+    flushRecords();
+
+    if (remaining == buffer.size()) {
+      // The current record is larger than the whole buffer
+      buffer.resize(buffer.size() * 2);
+    } else {
+      memmove(buffer.data(), lineStart, remaining);
+    }
+    filled = remaining;
+  }
+}
+
+// Pool of worker threads that runs an indexed loop with work stealing. The
+// task range is split evenly between the workers up front; a worker that
+// runs out steals the back half of another worker's remaining range. The
+// thread calling run() takes part as worker 0.
+class WorkStealingPool {
+public:
+  explicit WorkStealingPool(int numWorkers) : queues(max(numWorkers, 1)) {
+    for (size_t i = 1; i < queues.size(); i++) {
+      threads.emplace_back(&WorkStealingPool::workerLoop, this, i);
+    }
+  }
+
+  ~WorkStealingPool() {
+    {
+      lock_guard<mutex> guard(lock);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (thread &worker : threads) {
+      worker.join();
+    }
+  }
+
+  int size() const { return queues.size(); }
+
+  // Function to call task(worker, index) for every index in [0, count) and
+  // wait until all of them have finished
+  void run(size_t count, const function<void(int, size_t)> &task) {
+    size_t share = count / queues.size();
+    size_t extra = count % queues.size();
+    size_t next = 0;
+    for (size_t i = 0; i < queues.size(); i++) {
+      queues[i].begin = next;
+      next += share + (i < extra ? 1 : 0);
+      queues[i].end = next;
+    }
+
+    {
+      lock_guard<mutex> guard(lock);
+      currentTask = &task;
+      activeWorkers = queues.size();
+      generation++;
+    }
+    wake.notify_all();
+
+    drain(0);
+
+    unique_lock<mutex> guard(lock);
+    done.wait(guard, [this] { return activeWorkers == 0; });
+    currentTask = NULL;
+  }
+
+private:
+  struct TaskQueue {
+    mutex lock;
+    size_t begin = 0;
+    size_t end = 0;
+  };
+
+  vector<TaskQueue> queues;
+  vector<thread> threads;
+  mutex lock;
+  condition_variable wake;
+  condition_variable done;
+  const function<void(int, size_t)> *currentTask = NULL;
+  size_t generation = 0;
+  size_t activeWorkers = 0;
+  bool stopping = false;
+
+  void workerLoop(int worker) {
+    size_t seenGeneration = 0;
+    while (true) {
+      {
+        unique_lock<mutex> guard(lock);
+        wake.wait(guard, [&] {
+          return stopping || generation != seenGeneration;
+        });
+        if (stopping) {
+          return;
+        }
+        seenGeneration = generation;
+      }
+      drain(worker);
+    }
+  }
+
+  // Function to run tasks until neither this worker nor any victim has any
+  // left, then report this worker as finished
+  void drain(int worker) {
+    size_t index;
+    while (nextTask(worker, index)) {
+      (*currentTask)(worker, index);
+    }
+
+    lock_guard<mutex> guard(lock);
+    if (--activeWorkers == 0) {
+      done.notify_all();
+    }
+  }
+
+  bool nextTask(int worker, size_t &index) {
+    TaskQueue &own = queues[worker];
+    {
+      lock_guard<mutex> guard(own.lock);
+      if (own.begin < own.end) {
+        index = own.begin++;
+        return true;
+      }
+    }
+
+    // Only the owner ever refills its own queue, so the stolen range can be
+    // installed after the victim's lock has been released
+    for (size_t offset = 1; offset < queues.size(); offset++) {
+      TaskQueue &victim = queues[(worker + offset) % queues.size()];
+      size_t stolenBegin, stolenEnd;
+      {
+        lock_guard<mutex> guard(victim.lock);
+        size_t remaining = victim.end - victim.begin;
+        if (remaining == 0) {
+          continue;
+        }
+        stolenEnd = victim.end;
+        stolenBegin = victim.end - (remaining + 1) / 2;
+        victim.end = stolenBegin;
+      }
+
+      lock_guard<mutex> guard(own.lock);
+      own.begin = stolenBegin + 1;
+      own.end = stolenEnd;
+      index = stolenBegin;
+      return true;
+    }
+    return false;
+  }
+};
+
+// Index from the kernels of the states found so far to their numbers, safe
+// to use from several threads at once. It is split into shards by hash,
+// each with its own lock. A kernel found for the first time in the current
+// level of the construction has no number yet (-1); it keeps the smallest
+// discovery key it was found with, so numbering does not depend on which
+// thread got there first.
+class ConcurrentStateIndex {
+public:
+  struct Entry {
+    int state;
+    uint64_t discovery; // Source state << 32 | position among its gotos
+  };
+  typedef pair<const ItemSet, Entry> Slot;
+
+  ConcurrentStateIndex() : shards(NUM_SHARDS) {}
+
+  // Function to find kernel, inserting it unnumbered when it is new.
+  // kernel is moved from only when it was inserted.
+  Slot *findOrInsert(ItemSet &kernel, uint64_t discovery, bool &inserted) {
+    Shard &shard = shards[ItemSetHash()(kernel) % NUM_SHARDS];
+    lock_guard<mutex> guard(shard.lock);
+    auto result = shard.slots.try_emplace(move(kernel), Entry{-1, discovery});
+    inserted = result.second;
+    Entry &entry = result.first->second;
+    if (entry.state < 0) {
+      entry.discovery = min(entry.discovery, discovery);
+    }
+    return &*result.first;
+  }
+
+private:
+  static constexpr size_t NUM_SHARDS = 256;
+
+  struct Shard {
+    mutex lock;
+    unordered_map<ItemSet, Entry, ItemSetHash> slots;
+  };
+
+  vector<Shard> shards;
+};
+
+// Function to compute the canonical collection of LR(0) items like
+// computeCanonicalCollection, on the threads of pool. The collection grows
+// one level at a time: the goto kernels of every state of the last level
+// are computed and looked up in parallel, the new ones are numbered by
+// discovery key, which is the order the serial construction numbers them
+// in, and their closures are again computed in parallel. The tables come
+// out identical to the serial ones.
+vector<ItemSet> computeCanonicalCollectionParallel(const Grammar &grammar,
+                                                   ParseTables &tables,
+                                                   WorkStealingPool &pool,
+                                                   BuildTimings *timings = NULL,
+                                                   TableMethod method =
+                                                       TABLE_SLR) {
+  FirstFollowSets firstFollow;
+  computeFirstFollowSets(grammar, firstFollow, timings);
+
+  auto phaseStart = chrono::steady_clock::now();
+  vector<ItemSet> nonTerminalClosures = computeNonTerminalClosures(grammar);
+  if (timings != NULL) {
+    timings->closures = microsecondsSince(phaseStart);
+    phaseStart = chrono::steady_clock::now();
+  }
+
+  // Scratch space of every worker
+  struct Worker {
+    vector<char> expanded;
+    vector<char> added;
+    vector<ItemSet> gotoKernels;
+    vector<int> symbols;
+    vector<ConcurrentStateIndex::Slot *> inserted;
+  };
+  vector<Worker> workers(pool.size());
+  for (Worker &worker : workers) {
+    worker.expanded.assign(grammar.numNonTerminals(), false);
+    worker.added.assign(grammar.lhs.size(), false);
+    worker.gotoKernels.resize(grammar.numSymbols());
+  }
+
+  ConcurrentStateIndex stateIndex;
+  vector<ItemSet> canonicalCollection;
+  vector<vector<pair<int, int> > > transitions;
+  // Goto edges of the current level, with the index slot of each target
+  vector<vector<pair<int, ConcurrentStateIndex::Slot *> > > edges;
+
+  // Add the initial item to the canonical collection
+  ItemSet initialKernel(1, makeItem(0, 0));
+  canonicalCollection.push_back(computeClosure(initialKernel, grammar,
+                                               nonTerminalClosures,
+                                               workers[0].expanded,
+                                               workers[0].added));
+  bool inserted;
+  stateIndex.findOrInsert(initialKernel, 0, inserted)->second.state = 0;
+
+  // Levels of a few states are not worth waking the pool for
+  auto forEach = [&pool](size_t count, const function<void(int, size_t)> &task) {
+    if (count < 64) {
+      for (size_t i = 0; i < count; i++) {
+        task(0, i);
+      }
+    } else {
+      pool.run(count, task);
+    }
+  };
+
+  vector<ConcurrentStateIndex::Slot *> found;
+  size_t levelBegin = 0;
+  while (levelBegin < canonicalCollection.size()) {
+    size_t levelEnd = canonicalCollection.size();
+    transitions.resize(levelEnd);
+    edges.assign(levelEnd - levelBegin,
+                 vector<pair<int, ConcurrentStateIndex::Slot *> >());
+
+    forEach(levelEnd - levelBegin, [&](int w, size_t index) {
+      Worker &worker = workers[w];
+      size_t state = levelBegin + index;
+      computeGotoKernels(canonicalCollection[state], grammar,
+                         worker.gotoKernels, worker.symbols);
+      for (size_t position = 0; position < worker.symbols.size(); position++) {
+        int symbol = worker.symbols[position];
+        ItemSet &kernel = worker.gotoKernels[symbol];
+        bool isNew;
+        ConcurrentStateIndex::Slot *slot = stateIndex.findOrInsert(
+            kernel, (uint64_t)state << 32 | position, isNew);
+        if (isNew) {
+          worker.inserted.push_back(slot);
+        }
+        edges[index].push_back(make_pair(symbol, slot));
+        kernel.clear();
+      }
+    });
+
+    // Number the new states in the order the serial construction would
+    found.clear();
+    for (Worker &worker : workers) {
+      found.insert(found.end(), worker.inserted.begin(), worker.inserted.end());
+      worker.inserted.clear();
+    }
+    sort(found.begin(), found.end(), [](ConcurrentStateIndex::Slot *a,
+                                        ConcurrentStateIndex::Slot *b) {
+      return a->second.discovery < b->second.discovery;
+    });
+    for (size_t i = 0; i < found.size(); i++) {
+      found[i]->second.state = levelEnd + i;
+    }
+
+    for (size_t index = 0; index < edges.size(); index++) {
+      for (const pair<int, ConcurrentStateIndex::Slot *> &edge : edges[index]) {
+        transitions[levelBegin + index].push_back(
+            make_pair(edge.first, edge.second->second.state));
+      }
+    }
+
+    canonicalCollection.resize(levelEnd + found.size());
+    forEach(found.size(), [&](int w, size_t index) {
+      canonicalCollection[levelEnd + index] =
+          computeClosure(found[index]->first, grammar, nonTerminalClosures,
+                         workers[w].expanded, workers[w].added);
+    });
+    levelBegin = levelEnd;
+  }
+  transitions.resize(canonicalCollection.size());
+  if (timings != NULL) {
+    timings->collection = microsecondsSince(phaseStart);
+    phaseStart = chrono::steady_clock::now();
+  }
+
+  LalrLookaheads lookaheads;
+  if (method == TABLE_LALR) {
+    computeLalrLookaheads(grammar, firstFollow, canonicalCollection,
+                          transitions, lookaheads);
+    if (timings != NULL) {
+      timings->lookaheads = microsecondsSince(phaseStart);
+      phaseStart = chrono::steady_clock::now();
+    }
+  }
+
+  fillParseTables(grammar, firstFollow, canonicalCollection, transitions,
+                  tables, method == TABLE_LALR ? &lookaheads : NULL);
+  if (timings != NULL) {
+    timings->table = microsecondsSince(phaseStart);
+  }
+  return canonicalCollection;
+}
+
+// Function to parse newline-delimited records on several threads. Input is
+// read in large blocks; the records of a block are split into chunks that
+// the pool processes in any order, while the results are stored by record
+// index and written out in input order once the block is finished.
+void parseBatchParallel(FILE *in, FILE *out, const TableView &tables,
+                        const Grammar &grammar, int numThreads) {
+  const size_t chunkSize = 1024;
+
+  WorkStealingPool pool(numThreads);
+  vector<RecordParser> parsers(pool.size(), RecordParser(tables, grammar));
+
+  vector<char> buffer(1 << 25);
+  vector<size_t> lineStarts;
+  vector<unsigned char> results;
+  ResultWriter writer(out);
+
+  size_t filled = 0;
+  bool endOfInput = false;
+  while (!endOfInput) {
+    size_t bytesRead = fread(buffer.data() + filled, 1,
+                             buffer.size() - filled, in);
+    filled += bytesRead;
+    endOfInput = bytesRead == 0;
+
+    // Index the complete records of this block. At the end of the input an
+    // unterminated final record is complete as well.
+    lineStarts.clear();
+    const char *data = buffer.data();
+    size_t position = 0;
+    size_t blockEnd = 0;
+    lineStarts.push_back(0);
+    while (true) {
+      const char *newline =
+          (const char *)memchr(data + position, '\n', filled - position);
+      if (newline == NULL) {
+        break;
+      }
+      position = newline - data + 1;
+      blockEnd = position;
+      lineStarts.push_back(position);
+    }
+    if (endOfInput && blockEnd < filled) {
+      blockEnd = filled;
+      lineStarts.push_back(filled + 1);
+    }
+
+    size_t numRecords = lineStarts.size() - 1;
+    if (numRecords > 0) {
+      results.resize(numRecords);
+      pool.run((numRecords + chunkSize - 1) / chunkSize,
+               [&](int worker, size_t chunk) {
+                 size_t first = chunk * chunkSize;
+                 size_t last = min(first + chunkSize, numRecords);
+                 for (size_t record = first; record < last; record++) {
+                   const char *lineStart = data + lineStarts[record];
+                   const char *lineEnd = data + lineStarts[record + 1] - 1;
+                   if (lineEnd > lineStart && lineEnd[-1] == '\r') {
+                     lineEnd--;
+                   }
+                   results[record] =
+                       parsers[worker].parse(lineStart, lineEnd);
+                 }
+               });
+
+      for (size_t record = 0; record < numRecords; record++) {
+        writer.write(results[record]);
+      }
+    }
+
+    size_t remaining = filled - blockEnd;
+    if (remaining == buffer.size()) {
+      // The current record is larger than the whole buffer
+      buffer.resize(buffer.size() * 2);
+    } else {
+      memmove(buffer.data(), buffer.data() + blockEnd, remaining);
+    }
+    filled = remaining;
+  }
+}
+
+// Parser for one long sequence of terminals that splits it into chunks and
+// parses them on the threads of a pool. The first chunk is parsed from the
+// start state. The others are parsed speculatively, without the stack they
+// will start from. Its top is one of the states a shift of the terminal
+// before the chunk leads to, and a run starts with that set of candidates
+// for it. When a reduction pops below what the run has pushed, the next
+// state under it becomes the unknown one, with the states that have the
+// needed goto as candidates. States the run pushes that depend on which
+// candidate is the real one are kept per candidate, and the candidates are
+// only split into separate runs when they call for different actions; the
+// ones that call for an error are dropped. Runs move through the chunk in
+// lockstep, and two runs that reach the same states and candidates on the
+// same terminal parse the rest alike, so they go on as one run that keeps
+// what each assumed about the stack below as its bottoms. At most maxRuns
+// runs are alive at a time, with bottoms at up to maxBottoms depths; runs
+// end at the end of the chunk, at an error or at accept. A chunk gets
+// workPerTerminal units of work per terminal, counting table lookups and
+// settled states, and is given up once its runs have used them up, as
+// inputs like long runs of nested empty statements would otherwise keep
+// maxRuns runs with maxBottoms bottoms busy on every terminal.
+//
+// The chunks are then stitched left to right on the real stack: the first
+// run of a chunk with a bottom that holds on the real stack replaces the
+// states it popped off the stack with the ones it pushed, and a chunk
+// without one is parsed again from the real stack. Every table
+// entry a matching run read is the one the sequential parser would have
+// read, so the result is the same as parseTokens gives.
+class SpeculativeParser {
+public:
+  SpeculativeParser(const TableView &view, WorkStealingPool &pool,
+                    int maxRuns = 8)
+      : tables(view), pool(pool), maxRuns(max(1, maxRuns)) {
+    // Start states after every terminal: the targets of its shifts
+    startStates.resize(tables.numTerminals);
+    for (int t = 0; t < tables.numTerminals; t++) {
+      for (int state = 0; state < tables.numStates; state++) {
+        int action = tables.actionAt(state, t);
+        if (actionKind(action) == ACTION_SHIFT) {
+          startStates[t].push_back(actionTarget(action));
+        }
+      }
+      sort(startStates[t].begin(), startStates[t].end());
+      startStates[t].erase(unique(startStates[t].begin(), startStates[t].end()),
+                           startStates[t].end());
+    }
+
+    // The states with a goto on every non-terminal
+    gotoStates.resize(tables.numNonTerminals);
+    for (int n = 0; n < tables.numNonTerminals; n++) {
+      for (int state = 0; state < tables.numStates; state++) {
+        if (tables.gotoAt(state, n) >= 0) {
+          gotoStates[n].push_back(state);
+        }
+      }
+    }
+  }
+
+  // Function to parse count terminals followed by an implicit '$' in
+  // numChunks chunks
+  bool parse(const int *tokens, size_t count, size_t numChunks) {
+    numChunks = max((size_t)1, min(numChunks, count / 2));
+    vector<size_t> bounds(numChunks + 1);
+    for (size_t i = 0; i <= numChunks; i++) {
+      bounds[i] = count * i / numChunks;
+    }
+
+    vector<vector<Run> > runs(numChunks);
+    vector<int> stack;
+    ParseStatus status = PARSE_PENDING;
+    pool.run(numChunks, [&](int, size_t chunk) {
+      bool last = chunk + 1 == numChunks;
+      if (chunk == 0) {
+        stack.assign(1, 0);
+        status = advance(stack, tokens, bounds[0], bounds[1], last);
+      } else {
+        speculate(tokens, bounds[chunk], bounds[chunk + 1], last,
+                  runs[chunk]);
+      }
+    });
+
+    speculated = 0;
+    reparsed = 0;
+    for (size_t chunk = 1; chunk < numChunks && status == PARSE_PENDING;
+         chunk++) {
+      bool matched = false;
+      for (const Run &run : runs[chunk]) {
+        if (apply(run, stack)) {
+          matched = true;
+          status = run.status;
+          break;
+        }
+      }
+      if (matched) {
+        speculated++;
+      } else {
+        reparsed++;
+        status = advance(stack, tokens, bounds[chunk], bounds[chunk + 1],
+                         chunk + 1 == numChunks);
+      }
+    }
+    return status == PARSE_ACCEPTED;
+  }
+
+  // Chunks of the last parse taken from a speculative run, and reparsed
+  size_t speculatedChunks() const { return speculated; }
+  size_t reparsedChunks() const { return reparsed; }
+
+private:
+  // The candidates of a depth a run popped past: the state there is one of
+  // states and one of below holds further down, where a null one always
+  // holds. Runs split off one run share the ones it had.
+  struct Settled {
+    size_t depth;
+    vector<int> states;
+    vector<shared_ptr<const Settled> > below;
+  };
+
+  // Where a run sits on the real stack: popped states are removed from it,
+  // and one of settled holds
+  struct Bottom {
+    size_t popped = 0;
+    vector<shared_ptr<const Settled> > settled;
+  };
+
+  // Part of the states of runs split off one another: the states from
+  // depth start up, over those of below, with the hash of the stack up to
+  // each of them
+  struct Segment {
+    shared_ptr<const Segment> below;
+    size_t start;
+    vector<int> states;
+    vector<uint64_t> hashes;
+  };
+
+  // The states a run pushed. Runs split off one run share the states it
+  // had in segments and push onto their own top. Every state has a rolling
+  // hash of the stack up to it, worked out when runs are compared, so two
+  // stacks are compared by depth and hash and then only down to the
+  // segments they share.
+  struct SharedStack {
+    size_t size() const { return frozenSize + top.size(); }
+    bool empty() const { return size() == 0; }
+
+    int back() const {
+      return !top.empty() ? top.back()
+                          : frozen->states[frozenSize - 1 - frozen->start];
+    }
+
+    uint64_t hash() const {
+      uint64_t value;
+      if (!hashes.empty()) {
+        value = hashes.back();
+      } else {
+        value = frozenSize > 0
+                    ? frozen->hashes[frozenSize - 1 - frozen->start]
+                    : 0;
+      }
+      while (hashes.size() < top.size()) {
+        value = value * 0x100000001b3ULL + (uint32_t)top[hashes.size()] + 1;
+        hashes.push_back(value);
+      }
+      return value;
+    }
+
+    void push_back(int state) { top.push_back(state); }
+
+    // Function to pop states down to size, dropping the segments above it
+    void resize(size_t size) {
+      if (size >= frozenSize) {
+        top.resize(size - frozenSize);
+        hashes.resize(min(hashes.size(), top.size()));
+        return;
+      }
+      top.clear();
+      hashes.clear();
+      frozenSize = size;
+      while (frozen && frozen->start >= frozenSize) {
+        frozen = frozen->below;
+      }
+    }
+
+    void clear() { resize(0); }
+
+    // Function to move the top into a segment, so that copies share it
+    void share() {
+      if (top.empty()) {
+        return;
+      }
+      hash();
+      shared_ptr<Segment> segment = make_shared<Segment>();
+      segment->below = move(frozen);
+      segment->start = frozenSize;
+      segment->states.swap(top);
+      segment->hashes.swap(hashes);
+      frozenSize += segment->states.size();
+      frozen = move(segment);
+    }
+
+    // Function to give the state at depth i from the bottom, moving
+    // segment down to the one holding it
+    int at(size_t i, const Segment *&segment) const {
+      if (i >= frozenSize) {
+        return top[i - frozenSize];
+      }
+      while (segment->start > i) {
+        segment = segment->below.get();
+      }
+      return segment->states[i - segment->start];
+    }
+
+    bool operator==(const SharedStack &other) const {
+      if (size() != other.size() || hash() != other.hash()) {
+        return false;
+      }
+      const Segment *mine = frozen.get();
+      const Segment *theirs = other.frozen.get();
+      for (size_t i = size(); i-- > 0;) {
+        int state = at(i, mine);
+        int otherState = other.at(i, theirs);
+        if (i < frozenSize && i < other.frozenSize && mine == theirs) {
+          return true;
+        }
+        if (state != otherState) {
+          return false;
+        }
+      }
+      return true;
+    }
+
+    // Function to copy the states out, from the bottom up
+    void copyTo(vector<int> &states) const {
+      states.resize(size());
+      const Segment *segment = frozen.get();
+      for (size_t i = size(); i-- > 0;) {
+        states[i] = at(i, segment);
+      }
+    }
+
+    shared_ptr<const Segment> frozen;
+    size_t frozenSize = 0;
+    vector<int> top;
+    mutable vector<uint64_t> hashes; // Of the bottom of top, so far
+  };
+
+  // A speculative run. The state under the states it pushed is one of the
+  // candidates, if there are any. Entries of stack are states, or -1 - f
+  // for the state values[f][i] when candidates[i] is the real one.
+  struct Run {
+    SharedStack stack;
+    vector<int> candidates; // Sorted
+    vector<vector<int> > values;
+    vector<Bottom> bottoms;
+    size_t position = 0;
+    size_t deeper = 0; // Pops past the unknown state on this terminal
+    ParseStatus status = PARSE_PENDING;
+    bool done = false;
+    bool waiting = false;
+
+    // Function to keep the candidates whose index is in kept
+    void keep(const vector<int> &kept) {
+      for (size_t i = 0; i < kept.size(); i++) {
+        candidates[i] = candidates[kept[i]];
+        for (vector<int> &value : values) {
+          value[i] = value[kept[i]];
+        }
+      }
+      candidates.resize(kept.size());
+      for (vector<int> &value : values) {
+        value.resize(kept.size());
+      }
+    }
+
+    // Function to give the state on top when candidate i is the real one
+    int top(size_t i) const {
+      if (stack.empty()) {
+        return candidates[i];
+      }
+      return stack.back() >= 0 ? stack.back() : values[-1 - stack.back()][i];
+    }
+  };
+
+  TableView tables;
+  WorkStealingPool &pool;
+  int maxRuns;
+  size_t maxBottoms = 64;
+  size_t workPerTerminal = 8;
+  vector<vector<int> > startStates;
+  vector<vector<int> > gotoStates;
+  size_t speculated = 0;
+  size_t reparsed = 0;
+
+  // Function to parse tokens [begin, end) on a real stack, stopping after
+  // the last shift unless the chunk is the last one
+  ParseStatus advance(vector<int> &stack, const int *tokens, size_t begin,
+                      size_t end, bool last) const {
+    const int endMarker = tables.numTerminals - 1;
+    size_t position = begin;
+    while (true) {
+      if (position == end && !last) {
+        return PARSE_PENDING;
+      }
+      int symbol = position < end ? tokens[position] : endMarker;
+      if (symbol < 0) {
+        return PARSE_FAILED;
+      }
+      int action = tables.actionAt(stack.back(), symbol);
+      if (actionKind(action) == ACTION_SHIFT) {
+        stack.push_back(actionTarget(action));
+        position++;
+      } else if (actionKind(action) == ACTION_REDUCE) {
+        int production = actionTarget(action);
+        stack.resize(stack.size() - tables.productionLength[production]);
+        int nextState =
+            tables.gotoAt(stack.back(), tables.productionLhs[production]);
+        if (nextState < 0) {
+          return PARSE_FAILED;
+        }
+        stack.push_back(nextState);
+      } else {
+        return actionKind(action) == ACTION_ACCEPT ? PARSE_ACCEPTED
+                                                   : PARSE_FAILED;
+      }
+    }
+  }
+
+  // Function to check whether one of settled holds on the real stack,
+  // remembering the shared ones already checked
+  bool holds(const vector<shared_ptr<const Settled> > &settled,
+             const vector<int> &stack,
+             unordered_map<const Settled *, bool> &checked) const {
+    for (const shared_ptr<const Settled> &depth : settled) {
+      if (!depth) {
+        return true;
+      }
+      auto found = checked.find(depth.get());
+      if (found == checked.end()) {
+        size_t size = stack.size();
+        bool result = depth->depth < size &&
+                      binary_search(depth->states.begin(), depth->states.end(),
+                                    stack[size - 1 - depth->depth]) &&
+                      holds(depth->below, stack, checked);
+        found = checked.insert(make_pair(depth.get(), result)).first;
+      }
+      if (found->second) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  // Function to apply a run to the real stack when the real states match
+  // one of its bottoms, returning false and leaving the stack alone when
+  // they match none
+  bool apply(const Run &run, vector<int> &stack) const {
+    size_t size = stack.size();
+    const vector<int> &candidates = run.candidates;
+    unordered_map<const Settled *, bool> checked;
+    for (const Bottom &bottom : run.bottoms) {
+      if (bottom.popped >= size) {
+        continue;
+      }
+      bool holds = this->holds(bottom.settled, stack, checked);
+      size_t candidate = 0;
+      if (holds && !candidates.empty()) {
+        int state = stack[size - 1 - bottom.popped];
+        auto it = lower_bound(candidates.begin(), candidates.end(), state);
+        holds = it != candidates.end() && *it == state;
+        candidate = it - candidates.begin();
+      }
+      if (!holds) {
+        continue;
+      }
+
+      stack.resize(size - bottom.popped);
+      vector<int> pushed;
+      run.stack.copyTo(pushed);
+      for (int state : pushed) {
+        stack.push_back(state >= 0 ? state
+                                   : run.values[-1 - state][candidate]);
+      }
+      return true;
+    }
+    return false;
+  }
+
+  // Function to collect the runs of chunk [begin, end), begin > 0
+  void speculate(const int *tokens, size_t begin, size_t end, bool last,
+                 vector<Run> &finished) const {
+    int previous = tokens[begin - 1];
+    if (previous < 0 || startStates[previous].empty()) {
+      return;
+    }
+    vector<Run> live(1);
+    live[0].bottoms.resize(1);
+    live[0].bottoms[0].settled.assign(1, nullptr);
+    live[0].candidates = startStates[previous];
+    live[0].position = begin;
+
+    // Every pass steps the runs furthest behind; when all of them wait at
+    // a goto, the ones with the same goto are merged
+    vector<Run> added;
+    size_t work = 0;
+    size_t budget = workPerTerminal * (end - begin + 1);
+    while (!live.empty()) {
+      if (work > budget) {
+        // Parsing the chunk again on the real stack is cheaper
+        finished.clear();
+        return;
+      }
+      size_t position = end + 1;
+      for (const Run &run : live) {
+        position = min(position, run.position);
+      }
+      int room = maxRuns - (int)live.size();
+      bool stepped = false;
+      for (size_t r = 0; r < live.size(); r++) {
+        if (live[r].position == position && !live[r].waiting) {
+          step(live[r], tokens, end, last, live.size() > 1, added, room,
+               work);
+          stepped = true;
+        }
+      }
+      if (!stepped) {
+        merge(live, position, work);
+      }
+
+      size_t kept = 0;
+      for (size_t r = 0; r < live.size(); r++) {
+        if (live[r].done) {
+          if (!live[r].bottoms.empty()) {
+            finished.push_back(move(live[r]));
+          }
+        } else if (kept != r) {
+          live[kept++] = move(live[r]);
+        } else {
+          kept++;
+        }
+      }
+      live.resize(kept);
+      for (Run &run : added) {
+        live.push_back(move(run));
+      }
+      added.clear();
+    }
+  }
+
+  // Function to merge the runs waiting at position that have the same
+  // states and candidates, and let all of them go on
+  void merge(vector<Run> &live, size_t position, size_t &work) const {
+    for (size_t r = 0; r < live.size(); r++) {
+      Run &run = live[r];
+      if (!run.waiting || run.position != position) {
+        continue;
+      }
+      for (size_t other = r + 1; other < live.size(); other++) {
+        Run &same = live[other];
+        work++;
+        if (same.waiting && same.position == position &&
+            same.stack == run.stack && same.candidates == run.candidates &&
+            same.values == run.values) {
+          run.bottoms.insert(run.bottoms.end(), same.bottoms.begin(),
+                             same.bottoms.end());
+          same.bottoms.clear();
+          same.done = true;
+          same.waiting = false;
+        }
+      }
+      for (const Bottom &bottom : run.bottoms) {
+        work += bottom.settled.size();
+      }
+      mergeBottoms(run.bottoms);
+      run.waiting = false;
+    }
+  }
+
+  // Function to merge the bottoms at the same depth, keeping at most
+  // maxBottoms of the shallowest
+  void mergeBottoms(vector<Bottom> &bottoms) const {
+    sort(bottoms.begin(), bottoms.end(),
+         [](const Bottom &a, const Bottom &b) { return a.popped < b.popped; });
+    size_t kept = 0;
+    for (size_t b = 0; b < bottoms.size(); b++) {
+      if (kept > 0 && bottoms[kept - 1].popped == bottoms[b].popped) {
+        vector<shared_ptr<const Settled> > &settled = bottoms[kept - 1].settled;
+        settled.insert(settled.end(), bottoms[b].settled.begin(),
+                       bottoms[b].settled.end());
+        sort(settled.begin(), settled.end());
+        settled.erase(unique(settled.begin(), settled.end()), settled.end());
+        if (!settled[0]) {
+          settled.resize(1);
+        }
+      } else if (kept < maxBottoms) {
+        if (kept != b) {
+          bottoms[kept] = move(bottoms[b]);
+        }
+        kept++;
+      }
+    }
+    bottoms.resize(kept);
+  }
+
+  // Function to move a run on. Alone, it goes on until it is done or
+  // splits; in lockstep with other runs it stops after a shift, and waits
+  // after pushing a goto off its unknown state. New runs go to added while
+  // there is room for them. The lookups and settled states are added to
+  // work.
+  void step(Run &run, const int *tokens, size_t end, bool last,
+            bool lockstep, vector<Run> &added, int &room,
+            size_t &work) const {
+    const int endMarker = tables.numTerminals - 1;
+    vector<int> outcomes;
+    vector<int> kept;
+    while (true) {
+      work++;
+      if (run.position == end && !last) {
+        run.done = true;
+        return;
+      }
+      int symbol = run.position < end ? tokens[run.position] : endMarker;
+      if (symbol < 0) {
+        fail(run);
+        return;
+      }
+
+      // The action of every candidate, splitting the run when they differ
+      int action;
+      if (!run.stack.empty() && run.stack.back() >= 0) {
+        action = tables.actionAt(run.stack.back(), symbol);
+      } else {
+        outcomes.clear();
+        for (size_t i = 0; i < run.candidates.size(); i++) {
+          outcomes.push_back(tables.actionAt(run.top(i), symbol));
+        }
+        work += run.candidates.size();
+        if (!split(run, outcomes, added, room, work)) {
+          fail(run);
+          return;
+        }
+        action = outcomes[0];
+      }
+      if (actionKind(action) == ACTION_SHIFT) {
+        run.stack.push_back(actionTarget(action));
+        run.position++;
+        run.deeper = 0;
+        if (lockstep || !added.empty()) {
+          return;
+        }
+        continue;
+      }
+      if (actionKind(action) != ACTION_REDUCE) {
+        if (actionKind(action) == ACTION_ACCEPT) {
+          run.status = PARSE_ACCEPTED;
+          run.done = true;
+        } else {
+          fail(run);
+        }
+        return;
+      }
+
+      int production = actionTarget(action);
+      int nonTerminal = tables.productionLhs[production];
+      size_t length = tables.productionLength[production];
+      size_t fromRun = min(length, run.stack.size());
+      run.stack.resize(run.stack.size() - fromRun);
+      if (run.stack.empty()) {
+        run.values.clear();
+      }
+      if (fromRun < length) {
+        // Deeper than the unknown state: what is known about it is
+        // settled and the state under it becomes the unknown one. Chains
+        // of reductions through unknown states can go on without end, as
+        // in a statement that may be the body of any number of enclosing
+        // ones, so a run is dropped after maxBottoms of them.
+        if (++run.deeper > maxBottoms) {
+          run.bottoms.clear();
+          run.done = true;
+          return;
+        }
+        // Allocating them costs several lookups
+        work += 4 * run.bottoms.size();
+        for (Bottom &bottom : run.bottoms) {
+          if (!run.candidates.empty()) {
+            shared_ptr<Settled> depth = make_shared<Settled>();
+            depth->depth = bottom.popped;
+            depth->states = run.candidates;
+            depth->below = move(bottom.settled);
+            bottom.settled.assign(1, depth);
+          }
+          bottom.popped += length - fromRun;
+        }
+        run.candidates.clear();
+      }
+
+      if (!run.stack.empty() && run.stack.back() >= 0) {
+        int nextState = tables.gotoAt(run.stack.back(), nonTerminal);
+        if (nextState < 0) {
+          fail(run);
+          return;
+        }
+        run.stack.push_back(nextState);
+        continue;
+      }
+      bool offUnknown = run.stack.empty();
+      if (run.candidates.empty()) {
+        run.candidates = gotoStates[nonTerminal];
+      }
+
+      // The goto of every candidate, dropping those without one
+      work += run.candidates.size();
+      outcomes.clear();
+      kept.clear();
+      for (size_t i = 0; i < run.candidates.size(); i++) {
+        int nextState = tables.gotoAt(run.top(i), nonTerminal);
+        if (nextState >= 0) {
+          kept.push_back(i);
+          outcomes.push_back(nextState);
+        }
+      }
+      if (kept.empty()) {
+        fail(run);
+        return;
+      }
+      if (kept.size() < run.candidates.size()) {
+        run.keep(kept);
+      }
+      if (count(outcomes.begin(), outcomes.end(), outcomes[0]) ==
+          (ptrdiff_t)outcomes.size()) {
+        run.stack.push_back(outcomes[0]);
+      } else {
+        run.values.push_back(outcomes);
+        run.stack.push_back(-(int)run.values.size());
+      }
+      if (offUnknown && (lockstep || !added.empty())) {
+        run.waiting = true;
+        return;
+      }
+    }
+  }
+
+  // Function to end a run at an error, dropping the states it pushed
+  void fail(Run &run) const {
+    run.status = PARSE_FAILED;
+    run.done = true;
+    run.stack.clear();
+    run.values.clear();
+  }
+
+  // Function to split a run by the actions its candidates call for. The
+  // candidates with an error are dropped, the run keeps those with the
+  // first of the other actions, and each further action goes to a new run
+  // while there is room. outcomes ends up holding the action of the run,
+  // and the copied bottoms are added to work. Returns false when every
+  // candidate errs.
+  bool split(Run &run, vector<int> &outcomes, vector<Run> &added, int &room,
+             size_t &work) const {
+    vector<int> actions;
+    for (int action : outcomes) {
+      if (action != ACTION_ERROR &&
+          find(actions.begin(), actions.end(), action) == actions.end()) {
+        actions.push_back(action);
+      }
+    }
+    if (actions.empty()) {
+      return false;
+    }
+    vector<int> kept;
+    for (size_t a = actions.size(); a-- > 0;) {
+      if (a > 0 && room == 0) {
+        continue;
+      }
+      kept.clear();
+      for (size_t i = 0; i < outcomes.size(); i++) {
+        if (outcomes[i] == actions[a]) {
+          kept.push_back(i);
+        }
+      }
+      if (a > 0) {
+        // The new run repeats the lookup, which then agrees, and shares
+        // the states of this one
+        run.stack.share();
+        for (const Bottom &bottom : run.bottoms) {
+          work += bottom.settled.size();
+        }
+        Run branch = run;
+        branch.keep(kept);
+        added.push_back(move(branch));
+        room--;
+      } else if (kept.size() < outcomes.size()) {
+        run.keep(kept);
+      }
+    }
+    outcomes.assign(1, actions[0]);
+    return true;
+  }
+};
+
+// Function to read a grammar in either format. A grammar whose first line
+// looks like S->AA (one upper-case letter, no spaces) is a single-character
+// grammar, anything else is read as a grammar with named symbols.
+bool readGrammar(istream &in, Grammar &grammar, string &error) {
+  string text((istreambuf_iterator<char>(in)), istreambuf_iterator<char>());
+  istringstream lines(text);
+
+  string firstLine;
+  while (getline(lines, firstLine) && firstLine.find_first_not_of(" \t\r") ==
+                                          string::npos) {
+  }
+  bool singleCharacter =
+      firstLine.size() >= 3 && isupper(firstLine[0]) && firstLine[1] == '-' &&
+      firstLine[2] == '>' && firstLine.find_first_of(" \t") == string::npos;
+
+  istringstream source(text);
+  if (!singleCharacter) {
+    return readNamedGrammar(source, grammar, error);
+  }
+
+  vector<char> nonTerminals;
+  vector<char> terminals;
+  vector<vector<string> > productions;
+  readProductions(source, nonTerminals, terminals, productions);
+  if (productions.empty()) {
+    error = "no productions";
+    return false;
+  }
+  compileGrammar(grammar, nonTerminals, terminals, productions);
+  return true;
+}
+
+// Function to load the grammar for a command-line mode: the default grammar
+// when no file is given, else the grammar in the file
+bool loadGrammar(const string &grammarFile, Grammar &grammar) {
+  try {
+    if (grammarFile.empty()) {
+      vector<char> nonTerminals;
+      vector<char> terminals;
+      vector<vector<string> > productions;
+      getQuestionProductions(nonTerminals, terminals, productions);
+      compileGrammar(grammar, nonTerminals, terminals, productions);
+      return true;
+    }
+
+    ifstream file(grammarFile);
+    if (!file) {
+      cerr << "Cannot open grammar file " << grammarFile << endl;
+      return false;
+    }
+    string error;
+    if (!readGrammar(file, grammar, error)) {
+      cerr << "Grammar file " << grammarFile << ": " << error << endl;
+      return false;
+    }
+    return true;
+  } catch (string e) {
+    cerr << "Grammar file " << grammarFile << ": " << e << endl;
+    return false;
+  }
+}
+
+// Function to read the state visits and transitions out of a profile as
+// written by ParseProfile::writeJson, on its own or inside the output of
+// --bench --profile --json. Only the objects {"state": N, "count": C} and
+// {"from": A, "to": B, "count": C} are looked at, so the rest of the JSON
+// does not need to be parsed.
+void readStateProfile(const string &text, vector<uint64_t> &visits,
+                      unordered_map<uint64_t, uint64_t> &transitions) {
+  visits.clear();
+  transitions.clear();
+  // Function to find the number after "key": in an object, else -1
+  auto field = [](const string &object, const char *key) -> long long {
+    size_t at = object.find("\"" + string(key) + "\":");
+    if (at == string::npos) {
+      return -1;
+    }
+    return strtoll(object.c_str() + at + strlen(key) + 3, NULL, 10);
+  };
+  for (size_t open = text.find('{'); open != string::npos;
+       open = text.find('{', open + 1)) {
+    size_t close = text.find_first_of("{}", open + 1);
+    if (close == string::npos || text[close] != '}') {
+      continue;
+    }
+    string object = text.substr(open, close - open + 1);
+    long long count = field(object, "count");
+    long long state = field(object, "state");
+    long long from = field(object, "from");
+    long long to = field(object, "to");
+    if (count < 0) {
+      continue;
+    }
+    if (state >= 0 && from < 0) {
+      if ((size_t)state >= visits.size()) {
+        visits.resize(state + 1, 0);
+      }
+      visits[state] += count;
+    } else if (from >= 0 && to >= 0 && state < 0) {
+      transitions[(uint64_t)from << 32 | to] += count;
+    }
+  }
+}
+
+// Function to read the text of a state profile file
+bool loadStateProfile(const string &profileFile, string &profileText) {
+  ifstream file(profileFile);
+  if (!file) {
+    cerr << "Cannot open state profile " << profileFile << endl;
+    return false;
+  }
+  stringstream text;
+  text << file.rdbuf();
+  profileText = text.str();
+  return true;
+}
+
+// Function to renumber the states of finished tables from the text of a
+// state profile, for the modes that emit or cache tables. The profile has
+// to come from tables of the same grammar, before any renumbering.
+bool applyStateProfile(const string &profileFile, const string &profileText,
+                       ParseTables &tables) {
+  vector<uint64_t> visits;
+  unordered_map<uint64_t, uint64_t> transitions;
+  readStateProfile(profileText, visits, transitions);
+  bool matches = (int)visits.size() <= tables.numStates;
+  for (const auto &transition : transitions) {
+    matches = matches &&
+              (int)(transition.first >> 32) < tables.numStates &&
+              (int)(transition.first & 0xffffffff) < tables.numStates;
+  }
+  if (!matches || visits.empty()) {
+    cerr << "State profile " << profileFile
+         << " does not match the tables of the grammar" << endl;
+    return false;
+  }
+  renumberStates(tables, profileStateOrder(tables.numStates, visits,
+                                           transitions));
+  return true;
+}
+
+// Function to quote a string as a C++ string literal
+string cppStringLiteral(const string &text) {
+  string literal = "\"";
+  for (unsigned char c : text) {
+    if (c == '"' || c == '\\') {
+      literal += '\\';
+      literal += c;
+    } else if (c < 32 || c >= 127) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\%03o", c);
+      literal += escaped;
+    } else {
+      literal += c;
+    }
+  }
+  return literal + "\"";
+}
+
+// Function to emit an int array as an inline constexpr definition
+void emitIntArray(ostream &out, const string &name, const string &size,
+                  const int *values, size_t count) {
+  out << "inline constexpr int32_t " << name << "[" << size << "] = {";
+  for (size_t i = 0; i < count; i++) {
+    out << (i % 16 == 0 ? "\n    " : " ") << values[i]
+        << (i + 1 < count ? "," : "");
+  }
+  out << "\n};\n\n";
+}
+
+// Function to emit the body of the direct-coded parser: one case per state
+// with a switch over the lookahead, terminals with the same action sharing
+// a case, and one block per production doing its reduce
+void emitDirectParser(ostream &out, const ParseTables &tables) {
+  int numTerminals = tables.terminals.size();
+  vector<char> reduced(tables.productionLhs.size(), false);
+
+  out << "// Direct-coded parser: every state is a case of the outer switch, so\n"
+         "// no ACTION table is read at all. nextSymbol returns the terminal id of\n"
+         "// the next input symbol, END_MARKER at the end and -1 for a symbol\n"
+         "// outside the grammar.\n"
+         "template <typename NextSymbol>\n"
+         "inline ParseResult parseDirectWith(NextSymbol nextSymbol, int32_t *stack,\n"
+         "                                   size_t capacity) {\n"
+         "  int symbol = nextSymbol();\n"
+         "  size_t top = 0;\n"
+         "  int32_t state = 0;\n"
+         "  stack[0] = 0;\n\n"
+         "  for (;;) {\n"
+         "    switch (state) {\n";
+
+  for (int state = 0; state < tables.numStates; state++) {
+    // Group the terminals by the action they lead to
+    vector<pair<int, vector<int> > > groups;
+    for (int terminal = 0; terminal < numTerminals; terminal++) {
+      int action = tables.actionAt(state, terminal);
+      if (actionKind(action) == ACTION_ERROR) {
+        continue;
+      }
+      size_t g = 0;
+      while (g < groups.size() && groups[g].first != action) {
+        g++;
+      }
+      if (g == groups.size()) {
+        groups.push_back(make_pair(action, vector<int>()));
+      }
+      groups[g].second.push_back(terminal);
+    }
+
+    out << "    case " << state << ":\n"
+        << "      switch (symbol) {\n";
+    for (const pair<int, vector<int> > &group : groups) {
+      out << "     ";
+      for (int terminal : group.second) {
+        out << " case " << terminal << ":";
+      }
+      out << "\n";
+      switch (actionKind(group.first)) {
+      case ACTION_SHIFT:
+        out << "        state = " << actionTarget(group.first) << ";\n"
+            << "        goto shift;\n";
+        break;
+      case ACTION_REDUCE:
+        out << "        goto reduce" << actionTarget(group.first) << ";\n";
+        reduced[actionTarget(group.first)] = true;
+        break;
+      default:
+        out << "        return PARSE_ACCEPT;\n";
+        break;
+      }
+    }
+    out << "      default:\n"
+        << "        return PARSE_REJECT;\n"
+        << "      }\n";
+  }
+
+  out << "    default:\n"
+         "      return PARSE_REJECT;\n"
+         "    }\n\n"
+         "  shift:\n"
+         "    if (++top == capacity) {\n"
+         "      return PARSE_STACK_OVERFLOW;\n"
+         "    }\n"
+         "    stack[top] = state;\n"
+         "    symbol = nextSymbol();\n"
+         "    continue;\n\n";
+
+  // Only productions some state reduces get a block, so that no label is
+  // left unused
+  for (size_t production = 1; production < tables.productionLhs.size();
+       production++) {
+    if (!reduced[production]) {
+      continue;
+    }
+    out << "  reduce" << production << ":\n"
+        << "    top -= " << tables.productionLength[production] << ";\n"
+        << "    state = GOTO[stack[top] * NUM_NON_TERMINALS + "
+        << tables.productionLhs[production] << "];\n"
+        << "    goto pushGoto;\n\n";
+  }
+
+  out << "  pushGoto:\n"
+         "    if (state < 0) {\n"
+         "      return PARSE_REJECT;\n"
+         "    }\n"
+         "    if (++top == capacity) {\n"
+         "      return PARSE_STACK_OVERFLOW;\n"
+         "    }\n"
+         "    stack[top] = state;\n"
+         "  }\n"
+         "}\n\n"
+         "// Direct-coded parser over the characters of a single-character grammar\n"
+         "inline ParseResult parseDirect(const char *begin, const char *end,\n"
+         "                               int32_t *stack, size_t capacity) {\n"
+         "  return parseDirectWith(\n"
+         "      [&begin, end]() {\n"
+         "        return begin < end ? TERMINAL_INDEX[(unsigned char)*begin++]\n"
+         "                           : END_MARKER;\n"
+         "      },\n"
+         "      stack, capacity);\n"
+         "}\n\n"
+         "// Direct-coded parser over a sequence of terminal ids\n"
+         "inline ParseResult parseDirectTokens(const int32_t *tokens, size_t count,\n"
+         "                                     int32_t *stack, size_t capacity) {\n"
+         "  size_t position = 0;\n"
+         "  return parseDirectWith(\n"
+         "      [&position, tokens, count]() {\n"
+         "        return position < count ? tokens[position++] : END_MARKER;\n"
+         "      },\n"
+         "      stack, capacity);\n"
+         "}\n\n";
+}
+
+// Function to emit a standalone C++17 header with the tables as constexpr
+// arrays, a table-driven parser template specialized on those arrays and,
+// on request, a direct-coded parser. The emitted code allocates nothing:
+// the caller provides the state stack.
+void emitParserHeader(ostream &out, const ParseTables &tables,
+                      const Grammar &grammar, const string &nameSpace,
+                      bool direct) {
+  string guard = nameSpace;
+  transform(guard.begin(), guard.end(), guard.begin(), ::toupper);
+  guard += "_H";
+
+  out << "// Parser generated by SLRParser --generate. Do not edit.\n"
+         "#ifndef " << guard << "\n"
+         "#define " << guard << "\n\n"
+         "#include <cstddef>\n"
+         "#include <cstdint>\n\n"
+         "namespace " << nameSpace << " {\n\n"
+         "enum ParseResult {\n"
+         "  PARSE_REJECT = 0,\n"
+         "  PARSE_ACCEPT = 1,\n"
+         "  PARSE_STACK_OVERFLOW = 2\n"
+         "};\n\n"
+         "// Actions are packed with the kind in the low two bits and the target\n"
+         "// state or production above them\n"
+         "enum ActionKind {\n"
+         "  ACTION_ERROR = 0,\n"
+         "  ACTION_SHIFT = 1,\n"
+         "  ACTION_REDUCE = 2,\n"
+         "  ACTION_ACCEPT = 3\n"
+         "};\n\n"
+         "inline constexpr int NUM_STATES = " << tables.numStates << ";\n"
+         "inline constexpr int NUM_TERMINALS = " << tables.terminals.size() << ";\n"
+         "inline constexpr int NUM_NON_TERMINALS = "
+      << tables.nonTerminals.size() << ";\n"
+         "inline constexpr int NUM_PRODUCTIONS = "
+      << tables.productionLhs.size() << ";\n"
+         "inline constexpr int END_MARKER = NUM_TERMINALS - 1;\n\n";
+
+  // Terminal ids are the ACTION columns; token streams are written in them
+  out << "inline constexpr const char *TERMINAL_NAMES[NUM_TERMINALS] = {";
+  for (size_t i = 0; i < tables.terminals.size(); i++) {
+    out << "\n    " << cppStringLiteral(tables.terminals[i])
+        << (i + 1 < tables.terminals.size() ? "," : "");
+  }
+  out << "\n};\n\n";
+
+  emitIntArray(out, "TERMINAL_INDEX", "256", tables.terminalIndex, 256);
+  emitIntArray(out, "ACTION", "NUM_STATES * NUM_TERMINALS",
+               tables.action.data(), tables.action.size());
+  emitIntArray(out, "GOTO", "NUM_STATES * NUM_NON_TERMINALS",
+               tables.goTo.data(), tables.goTo.size());
+  emitIntArray(out, "PRODUCTION_LHS", "NUM_PRODUCTIONS",
+               tables.productionLhs.data(), tables.productionLhs.size());
+  emitIntArray(out, "PRODUCTION_LENGTH", "NUM_PRODUCTIONS",
+               tables.productionLength.data(), tables.productionLength.size());
+
+  // Named symbols are separated by spaces, characters are not
+  string separator = grammar.namedSymbols ? " " : "";
+  out << "inline constexpr const char *PRODUCTION_TEXT[NUM_PRODUCTIONS] = {";
+  for (size_t p = 0; p < grammar.lhs.size(); p++) {
+    string text = grammar.name(grammar.lhs[p]) + separator + "->";
+    for (SymbolId symbol : grammar.rhs[p]) {
+      text += separator + grammar.name(symbol);
+    }
+    out << "\n    " << cppStringLiteral(text)
+        << (p + 1 < grammar.lhs.size() ? "," : "");
+  }
+  out << "\n};\n\n";
+
+  out << "// Table-driven parser specialized on a set of tables. nextSymbol\n"
+         "// returns the terminal id of the next input symbol, the '$' end marker\n"
+         "// at the end and -1 for a symbol outside the grammar.\n"
+         "template <int NumTerminals, int NumNonTerminals,\n"
+         "          const int32_t *Action, const int32_t *Goto,\n"
+         "          const int32_t *ProductionLhs, const int32_t *ProductionLength,\n"
+         "          const int32_t *TerminalIndex>\n"
+         "struct TableDriver {\n"
+         "  template <typename NextSymbol>\n"
+         "  static ParseResult run(NextSymbol nextSymbol, int32_t *stack,\n"
+         "                         size_t capacity) {\n"
+         "    int symbol = nextSymbol();\n"
+         "    size_t top = 0;\n"
+         "    stack[0] = 0;\n\n"
+         "    while (symbol >= 0) {\n"
+         "      int32_t action = Action[stack[top] * NumTerminals + symbol];\n"
+         "      switch (action & 3) {\n"
+         "      case ACTION_SHIFT:\n"
+         "        if (++top == capacity) {\n"
+         "          return PARSE_STACK_OVERFLOW;\n"
+         "        }\n"
+         "        stack[top] = action >> 2;\n"
+         "        symbol = nextSymbol();\n"
+         "        break;\n"
+         "      case ACTION_REDUCE: {\n"
+         "        int production = action >> 2;\n"
+         "        top -= ProductionLength[production];\n"
+         "        int32_t state =\n"
+         "            Goto[stack[top] * NumNonTerminals + ProductionLhs[production]];\n"
+         "        if (state < 0) {\n"
+         "          return PARSE_REJECT;\n"
+         "        }\n"
+         "        if (++top == capacity) {\n"
+         "          return PARSE_STACK_OVERFLOW;\n"
+         "        }\n"
+         "        stack[top] = state;\n"
+         "        break;\n"
+         "      }\n"
+         "      case ACTION_ACCEPT:\n"
+         "        return PARSE_ACCEPT;\n"
+         "      default:\n"
+         "        return PARSE_REJECT;\n"
+         "      }\n"
+         "    }\n"
+         "    return PARSE_REJECT;\n"
+         "  }\n\n"
+         "  // Parse the characters of a single-character grammar\n"
+         "  static ParseResult parse(const char *begin, const char *end,\n"
+         "                           int32_t *stack, size_t capacity) {\n"
+         "    return run(\n"
+         "        [&begin, end]() {\n"
+         "          return begin < end ? TerminalIndex[(unsigned char)*begin++]\n"
+         "                             : NumTerminals - 1;\n"
+         "        },\n"
+         "        stack, capacity);\n"
+         "  }\n\n"
+         "  // Parse a sequence of terminal ids\n"
+         "  static ParseResult parseTokens(const int32_t *tokens, size_t count,\n"
+         "                                 int32_t *stack, size_t capacity) {\n"
+         "    size_t position = 0;\n"
+         "    return run(\n"
+         "        [&position, tokens, count]() {\n"
+         "          return position < count ? tokens[position++] : NumTerminals - 1;\n"
+         "        },\n"
+         "        stack, capacity);\n"
+         "  }\n"
+         "};\n\n"
+         "typedef TableDriver<NUM_TERMINALS, NUM_NON_TERMINALS, ACTION, GOTO,\n"
+         "                    PRODUCTION_LHS, PRODUCTION_LENGTH, TERMINAL_INDEX>\n"
+         "    TableParser;\n\n";
+
+  if (direct) {
+    emitDirectParser(out, tables);
+  }
+
+  out << "} // namespace " << nameSpace << "\n\n"
+         "#endif\n";
+}
+
+// Function to emit a benchmark program that times the runtime parser against
+// the generated parsers on a file of newline-delimited inputs. Records are
+// turned into terminal ids up front so that every parser sees the same token
+// stream. It is built next to SLRParser.cpp:
+//   g++ -std=c++17 -O2 -pthread -I<dir of SLRParser.cpp> bench.cpp
+void emitParserBenchmark(ostream &out, const string &headerName,
+                         const Grammar &grammar, const string &nameSpace,
+                         bool direct) {
+  ostringstream grammarText;
+  writeGrammar(grammarText, grammar);
+  istringstream grammarLines(grammarText.str());
+
+  out << "// Benchmark generated by SLRParser --generate. Do not edit.\n"
+         "// Usage: bench INPUT_FILE [REPEAT]\n"
+         "#define SLR_PARSER_NO_MAIN\n"
+         "#include \"SLRParser.cpp\"\n"
+         "#include " << cppStringLiteral(headerName) << "\n\n"
+         "#include <chrono>\n"
+         "#include <sstream>\n\n"
+         "static const char GRAMMAR[] =";
+  string line;
+  while (getline(grammarLines, line)) {
+    out << "\n    " << cppStringLiteral(line + "\n");
+  }
+  out << ";\n\n"
+         "template <typename Parse>\n"
+         "static double timeParser(size_t numRecords, int repeat,\n"
+         "                         vector<char> &results, Parse parse) {\n"
+         "  double best = 1e300;\n"
+         "  for (int r = 0; r < repeat; r++) {\n"
+         "    auto start = chrono::steady_clock::now();\n"
+         "    for (size_t i = 0; i < numRecords; i++) {\n"
+         "      results[i] = parse(i);\n"
+         "    }\n"
+         "    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;\n"
+         "    best = min(best, elapsed.count());\n"
+         "  }\n"
+         "  return best;\n"
+         "}\n\n"
+         "int main(int argc, char *argv[]) {\n"
+         "  if (argc < 2) {\n"
+         "    cerr << \"Usage: \" << argv[0] << \" INPUT_FILE [REPEAT]\" << endl;\n"
+         "    return 1;\n"
+         "  }\n"
+         "  int repeat = argc > 2 ? atoi(argv[2]) : 5;\n\n"
+         "  Grammar grammar;\n"
+         "  ParseTables tables;\n"
+         "  string error;\n"
+         "  istringstream grammarText(GRAMMAR);\n"
+         "  if (!readGrammar(grammarText, grammar, error)) {\n"
+         "    cerr << error << endl;\n"
+         "    return 1;\n"
+         "  }\n"
+         "  computeCanonicalCollection(grammar, tables, false);\n"
+         "  TableView view = viewTables(tables);\n\n"
+         "  // The tables rebuilt from the grammar text may number the terminals\n"
+         "  // differently from the header, so ids are mapped across by name\n"
+         "  vector<int32_t> generatedId(tables.terminals.size(), -1);\n"
+         "  for (size_t t = 0; t < tables.terminals.size(); t++) {\n"
+         "    for (int g = 0; g < " << nameSpace << "::NUM_TERMINALS; g++) {\n"
+         "      if (tables.terminals[t] == " << nameSpace << "::TERMINAL_NAMES[g]) {\n"
+         "        generatedId[t] = g;\n"
+         "      }\n"
+         "    }\n"
+         "  }\n\n"
+         "  ifstream input(argv[1]);\n"
+         "  vector<string> records;\n"
+         "  vector<vector<int> > tokens;\n"
+         "  vector<vector<int32_t> > tokens32;\n"
+         "  size_t totalBytes = 0;\n"
+         "  string line;\n"
+         "  while (getline(input, line)) {\n"
+         "    vector<int> recordTokens;\n"
+         "    if (grammar.namedSymbols) {\n"
+         "      tokenizeInput(line.data(), line.data() + line.size(), grammar,\n"
+         "                    recordTokens);\n"
+         "    } else {\n"
+         "      for (unsigned char c : line) {\n"
+         "        recordTokens.push_back(tables.terminalIndex[c]);\n"
+         "      }\n"
+         "    }\n"
+         "    records.push_back(line);\n"
+         "    tokens.push_back(recordTokens);\n"
+         "    tokens32.push_back(vector<int32_t>());\n"
+         "    for (int token : recordTokens) {\n"
+         "      tokens32.back().push_back(token < 0 ? -1 : generatedId[token]);\n"
+         "    }\n"
+         "    totalBytes += line.size();\n"
+         "  }\n"
+         "  size_t numRecords = records.size();\n\n"
+         "  vector<int> stateStack;\n"
+         "  vector<int32_t> stack(1 << 16);\n"
+         "  vector<char> expected(numRecords);\n"
+         "  vector<char> results(numRecords);\n"
+         "  auto report = [&](const char *name, double seconds) {\n"
+         "    cout << name << seconds * 1e9 / numRecords << \" ns/record, \"\n"
+         "         << totalBytes / seconds / 1e6 << \" MB/s\"\n"
+         "         << (results == expected ? \"\" : \" (RESULTS DIFFER)\") << endl;\n"
+         "  };\n\n"
+         "  double seconds = timeParser(numRecords, repeat, expected, [&](size_t i) {\n"
+         "    return parseTokens(tokens[i].data(), tokens[i].size(), view,\n"
+         "                       stateStack);\n"
+         "  });\n"
+         "  results = expected;\n"
+         "  report(\"parseTokens:        \", seconds);\n\n"
+         "  if (!grammar.namedSymbols) {\n"
+         "    seconds = timeParser(numRecords, repeat, results, [&](size_t i) {\n"
+         "      return parseString(records[i], tables);\n"
+         "    });\n"
+         "    report(\"parseString:        \", seconds);\n\n"
+         "    seconds = timeParser(numRecords, repeat, results, [&](size_t i) {\n"
+         "      return " << nameSpace << "::TableParser::parse(\n"
+         "                 records[i].data(), records[i].data() + records[i].size(),\n"
+         "                 stack.data(), stack.size()) == " << nameSpace << "::PARSE_ACCEPT;\n"
+         "    });\n"
+         "    report(\"TableParser:        \", seconds);\n"
+         "  }\n\n"
+         "  seconds = timeParser(numRecords, repeat, results, [&](size_t i) {\n"
+         "    return " << nameSpace << "::TableParser::parseTokens(\n"
+         "               tokens32[i].data(), tokens32[i].size(), stack.data(),\n"
+         "               stack.size()) == " << nameSpace << "::PARSE_ACCEPT;\n"
+         "  });\n"
+         "  report(\"TableParser tokens:  \", seconds);\n";
+  if (direct) {
+    out << "\n"
+           "  if (!grammar.namedSymbols) {\n"
+           "    seconds = timeParser(numRecords, repeat, results, [&](size_t i) {\n"
+           "      return " << nameSpace << "::parseDirect(\n"
+           "                 records[i].data(), records[i].data() + records[i].size(),\n"
+           "                 stack.data(), stack.size()) == " << nameSpace << "::PARSE_ACCEPT;\n"
+           "    });\n"
+           "    report(\"parseDirect:        \", seconds);\n"
+           "  }\n\n"
+           "  seconds = timeParser(numRecords, repeat, results, [&](size_t i) {\n"
+           "    return " << nameSpace << "::parseDirectTokens(\n"
+           "               tokens32[i].data(), tokens32[i].size(), stack.data(),\n"
+           "               stack.size()) == " << nameSpace << "::PARSE_ACCEPT;\n"
+           "  });\n"
+           "  report(\"parseDirect tokens:  \", seconds);\n";
+  }
+  out << "  return 0;\n"
+         "}\n";
+}
+
+// Function to write the text of a synthetic named grammar for benchmarks:
+//   expr N  expressions with N binary operators of increasing precedence
+//   wide N  a list of items with N alternatives each
+//   deep N  N nested non-terminals, each either bracketing itself or
+//           passing through to the next, so chains of unit reductions
+//           are up to N long
+// Throws a string for an unknown kind.
+string syntheticGrammar(const string &kind, int size) {
+  ostringstream out;
+  size = max(1, size);
+  if (kind == "expr") {
+    for (int level = 0; level < size; level++) {
+      out << "e" << level << " -> e" << level << " op" << level << " e"
+          << level + 1 << " | e" << level + 1 << "\n";
+    }
+    out << "e" << size << " -> ( e0 ) | id | num\n";
+  } else if (kind == "wide") {
+    out << "list -> list item | item\n";
+    out << "item -> ( list )";
+    for (int i = 0; i < size; i++) {
+      out << " | t" << i;
+    }
+    out << "\n";
+  } else if (kind == "deep") {
+    for (int level = 0; level < size; level++) {
+      out << "n" << level << " -> l" << level << " n" << level << " r"
+          << level << " | n" << level + 1 << "\n";
+    }
+    out << "n" << size << " -> x | x n" << size << " | ( n0 )\n";
+  } else {
+    throw string("unknown synthetic grammar " + kind);
+  }
+  return out.str();
+}
+
+// Generator of random sentences of a grammar. Every non-terminal has a
+// shortest production, whose choice never cycles, and the minimum number
+// of terminals it derives. A sentence is derived leftmost from the start
+// symbol by picking among the productions that still fit the requested
+// length and falling back to the shortest ones once none does.
+class SentenceGenerator {
+public:
+  // Throws a string when the start symbol derives no terminal string
+  SentenceGenerator(const Grammar &grammar) : grammar(grammar) {
+    int numNonTerminals = grammar.numNonTerminals();
+    int numProductions = grammar.lhs.size();
+    productionsOf.resize(numNonTerminals);
+    for (int p = 0; p < numProductions; p++) {
+      productionsOf[grammar.lhs[p] - grammar.numTerminals].push_back(p);
+    }
+
+    // Minimum (length, height) of every non-terminal, lowered until it is
+    // stable. The height breaks ties between equally short productions, so
+    // the shortest production of A only uses non-terminals lower than A.
+    minLength.assign(numNonTerminals, UNREACHABLE);
+    vector<size_t> height(numNonTerminals, UNREACHABLE);
+    shortest.assign(numNonTerminals, -1);
+    productionLength.assign(numProductions, UNREACHABLE);
+    bool changed = true;
+    while (changed) {
+      changed = false;
+      for (int p = 0; p < numProductions; p++) {
+        size_t length = 0;
+        size_t productionHeight = 1;
+        for (SymbolId symbol : grammar.rhs[p]) {
+          if (grammar.isTerminal(symbol)) {
+            length++;
+            continue;
+          }
+          int nonTerminal = symbol - grammar.numTerminals;
+          if (minLength[nonTerminal] == UNREACHABLE) {
+            length = UNREACHABLE;
+            break;
+          }
+          length += minLength[nonTerminal];
+          productionHeight = max(productionHeight, height[nonTerminal] + 1);
+        }
+        if (length == UNREACHABLE) {
+          continue;
+        }
+        productionLength[p] = length;
+        int lhs = grammar.lhs[p] - grammar.numTerminals;
+        if (make_pair(length, productionHeight) <
+            make_pair(minLength[lhs], height[lhs])) {
+          minLength[lhs] = length;
+          height[lhs] = productionHeight;
+          shortest[lhs] = p;
+          changed = true;
+        }
+      }
+    }
+    if (minLength[grammar.lhs[0] - grammar.numTerminals] == UNREACHABLE) {
+      throw string("the start symbol derives no sentence");
+    }
+  }
+
+  // Function to derive a sentence of about length terminals into sentence.
+  // Short derivations are retried a few times, keeping the longest.
+  void generate(size_t length, mt19937 &random, vector<int> &sentence) {
+    sentence.clear();
+    for (int attempt = 0; attempt < 8 && sentence.size() * 2 < length;
+         attempt++) {
+      derive(length, random, candidate);
+      if (candidate.size() > sentence.size()) {
+        sentence.swap(candidate);
+      }
+    }
+  }
+
+  // Function to make a valid sentence near-valid by deleting, inserting or
+  // replacing one random terminal
+  void mutate(mt19937 &random, vector<int> &sentence) const {
+    int numTerminals = grammar.numTerminals - 1; // Not '$'
+    size_t at = random() % (sentence.size() + 1);
+    switch (sentence.empty() ? 1 : random() % 3) {
+    case 0:
+      sentence.erase(sentence.begin() + min(at, sentence.size() - 1));
+      break;
+    case 1:
+      sentence.insert(sentence.begin() + at, random() % numTerminals);
+      break;
+    default:
+      sentence[min(at, sentence.size() - 1)] = random() % numTerminals;
+      break;
+    }
+  }
+
+private:
+  static constexpr size_t UNREACHABLE = SIZE_MAX;
+
+  // Function to derive one sentence, aiming at length terminals
+  void derive(size_t length, mt19937 &random, vector<int> &sentence) {
+    sentence.clear();
+    pending.assign(1, grammar.lhs[0]);
+    size_t pendingLength = minLength[grammar.lhs[0] - grammar.numTerminals];
+    // Zero-length cycles could expand forever, so after enough expansions
+    // only shortest productions are taken
+    size_t expansionsLeft = 8 * (length + 16);
+
+    while (!pending.empty()) {
+      int symbol = pending.back();
+      pending.pop_back();
+      if (grammar.isTerminal(symbol)) {
+        sentence.push_back(symbol);
+        pendingLength--;
+        continue;
+      }
+
+      int nonTerminal = symbol - grammar.numTerminals;
+      pendingLength -= minLength[nonTerminal];
+      fitting.clear();
+      growing.clear();
+      if (expansionsLeft > 0) {
+        expansionsLeft--;
+        for (int p : productionsOf[nonTerminal]) {
+          if (productionLength[p] != UNREACHABLE &&
+              sentence.size() + pendingLength + productionLength[p] <= length) {
+            fitting.push_back(p);
+            if (productionLength[p] > minLength[nonTerminal]) {
+              growing.push_back(p);
+            }
+          }
+        }
+      }
+
+      // A production that makes the sentence longer is preferred with the
+      // probability of the fraction of the length still unused
+      size_t unused = length - min(length, sentence.size() + pendingLength);
+      int production = shortest[nonTerminal];
+      if (!growing.empty() && random() % length < unused) {
+        production = growing[random() % growing.size()];
+      } else if (!fitting.empty()) {
+        production = fitting[random() % fitting.size()];
+      }
+      pendingLength += productionLength[production];
+      const vector<SymbolId> &rhs = grammar.rhs[production];
+      pending.insert(pending.end(), rhs.rbegin(), rhs.rend());
+    }
+  }
+
+  const Grammar &grammar;
+  vector<vector<int> > productionsOf; // Productions of every non-terminal
+  vector<size_t> minLength;           // Per non-terminal
+  vector<size_t> productionLength;    // Minimum length of every production
+  vector<int> shortest;               // Shortest production per non-terminal
+  vector<int> pending;                // Symbols still to derive, last first
+  vector<int> fitting;                // Productions that fit the length
+  vector<int> growing;                // Those of them longer than shortest
+  vector<int> candidate;
+};
+
+// Protocol of the parse daemon over a Unix domain socket. Every message is
+// a frame of a 32-bit request type or answer status, a 32-bit payload
+// length and the payload, with integers in host byte order since both ends
+// run on the same machine. Requests:
+//   DAEMON_GRAMMAR  uint32 flags and the grammar text. The tables are
+//                   built, or found in the cache, and the answer is the
+//                   uint64 key to parse with.
+//   DAEMON_PARSE    uint64 key, uint32 count and count records, each a
+//                   uint32 length followed by the bytes. The answer has
+//                   one byte per record, 1 when it was accepted.
+//   DAEMON_STATS    no payload. The answer is the cache statistics as text.
+// An answer with another status than DAEMON_OK carries a message. Requests
+// may be sent without waiting for the answers, which come back in order.
+enum DaemonRequest {
+  DAEMON_GRAMMAR = 1,
+  DAEMON_PARSE = 2,
+  DAEMON_STATS = 3
+};
+
+enum DaemonStatus {
+  DAEMON_OK = 0,
+  DAEMON_UNKNOWN_GRAMMAR = 1, // Never loaded, or evicted since
+  DAEMON_BAD_GRAMMAR = 2,
+  DAEMON_BAD_REQUEST = 3
+};
+
+const uint32_t DAEMON_FLAG_LALR = 1;        // Build LALR(1) tables
+const uint32_t DAEMON_MAX_PAYLOAD = 1 << 30; // Larger frames are refused
+
+// Grammar and tables of one cache entry. The view points into tables, so
+// an entry is never moved once built.
+struct DaemonTables {
+  string text;
+  uint32_t flags = 0;
+  Grammar grammar;
+  ParseTables tables;
+  TableView view;
+  size_t bytes = 0; // Estimated memory use
+};
+
+// Tables built by the daemon, keyed by a hash of the grammar text and the
+// build flags. A text whose key is taken by another cached text gets the
+// next free key, so a key names one text for as long as it is cached. The
+// least recently used entries are dropped once the estimated memory use of
+// all of them exceeds the cap, but the most recent one is always kept, so
+// a grammar larger than the cap still works. Entries are shared: one
+// dropped while a connection parses with it lives until the connection
+// lets it go.
+class TableLru {
+public:
+  explicit TableLru(size_t capacity) : capacity(capacity) {}
+
+  // Function to find the tables of a grammar text, building and caching
+  // them when they are missing. Throws a string when the text is not a
+  // grammar.
+  shared_ptr<const DaemonTables> load(const string &text, uint32_t flags,
+                                      uint64_t &key) {
+    uint64_t hash = checksumBytes(text.data(), text.size()) ^
+                    ((uint64_t)flags * 0x9e3779b97f4a7c15ull);
+    {
+      lock_guard<mutex> guard(lock);
+      key = hash;
+      shared_ptr<const DaemonTables> found = lookup(text, flags, key);
+      if (found != NULL) {
+        hits++;
+        return found;
+      }
+      misses++;
+    }
+
+    // Built without the lock, so other connections keep parsing
+    shared_ptr<DaemonTables> entry = make_shared<DaemonTables>();
+    entry->text = text;
+    entry->flags = flags;
+    istringstream in(text);
+    string error;
+    if (!readGrammar(in, entry->grammar, error)) {
+      throw error;
+    }
+    computeCanonicalCollection(entry->grammar, entry->tables, false, NULL,
+                               flags & DAEMON_FLAG_LALR ? TABLE_LALR
+                                                        : TABLE_SLR);
+    if (!entry->tables.conflicts.empty()) {
+      throw describeConflicts(entry->tables);
+    }
+    entry->view = viewTables(entry->tables);
+    const ParseTables &tables = entry->tables;
+    const LexerDfa &lexer = entry->grammar.lexer;
+    entry->bytes = sizeof(DaemonTables) + 16 * text.size() +
+                   sizeof(int) * (tables.action.size() + tables.goTo.size() +
+                                  tables.gotoChain.size() +
+                                  tables.unitChains.size()) +
+                   sizeof(int32_t) * (lexer.next.size() + lexer.accept.size());
+
+    lock_guard<mutex> guard(lock);
+    key = hash;
+    shared_ptr<const DaemonTables> found = lookup(text, flags, key);
+    if (found != NULL) {
+      // Built by another connection meanwhile
+      return found;
+    }
+    order.push_front(make_pair(key, entry));
+    index[key] = order.begin();
+    bytes += entry->bytes;
+    while (bytes > capacity && order.size() > 1) {
+      bytes -= order.back().second->bytes;
+      index.erase(order.back().first);
+      order.pop_back();
+      evictions++;
+    }
+    return entry;
+  }
+
+  // Function to find the tables of a key, NULL when they are not cached
+  shared_ptr<const DaemonTables> find(uint64_t key) {
+    lock_guard<mutex> guard(lock);
+    auto it = index.find(key);
+    if (it == index.end()) {
+      return NULL;
+    }
+    order.splice(order.begin(), order, it->second);
+    return it->second->second;
+  }
+
+  string stats() {
+    lock_guard<mutex> guard(lock);
+    ostringstream out;
+    out << "entries " << order.size() << "\nbytes " << bytes << "\ncapacity "
+        << capacity << "\nhits " << hits << "\nmisses " << misses
+        << "\nevictions " << evictions << "\n";
+    return out.str();
+  }
+
+private:
+  typedef list<pair<uint64_t, shared_ptr<const DaemonTables> > > EntryList;
+
+  // Function to find the entry of a text from its hash in key, making it
+  // the most recent. Keys taken by other texts are skipped, and key ends
+  // at the entry or at the first free key. Called with the lock held.
+  shared_ptr<const DaemonTables> lookup(const string &text, uint32_t flags,
+                                        uint64_t &key) {
+    for (auto it = index.find(key); it != index.end(); it = index.find(key)) {
+      const DaemonTables &entry = *it->second->second;
+      if (entry.text == text && entry.flags == flags) {
+        order.splice(order.begin(), order, it->second);
+        return it->second->second;
+      }
+      key++;
+    }
+    return NULL;
+  }
+
+  mutex lock;
+  EntryList order; // Most recently used first
+  unordered_map<uint64_t, EntryList::iterator> index;
+  size_t capacity;
+  size_t bytes = 0;
+  size_t hits = 0;
+  size_t misses = 0;
+  size_t evictions = 0;
+};
+
+// Buffered reading from and writing to a socket. Answers are collected and
+// sent when the reader runs out of buffered requests, so a pipelined run
+// of requests is answered with one write.
+class FrameStream {
+public:
+  explicit FrameStream(int fd) : fd(fd), input(1 << 16) {}
+
+  // Function to read exactly size bytes, flushing the pending output
+  // before blocking. Returns false at the end of the stream.
+  bool read(void *data, size_t size) {
+    char *target = (char *)data;
+    while (size > 0) {
+      if (start == end) {
+        if (!flush()) {
+          return false;
+        }
+        ssize_t count = ::read(fd, input.data(), input.size());
+        if (count < 0 && errno == EINTR) {
+          continue;
+        }
+        if (count <= 0) {
+          return false;
+        }
+        start = 0;
+        end = count;
+      }
+      size_t count = min(size, end - start);
+      memcpy(target, input.data() + start, count);
+      start += count;
+      target += count;
+      size -= count;
+    }
+    return true;
+  }
+
+  void write(const void *data, size_t size) {
+    const char *bytes = (const char *)data;
+    output.insert(output.end(), bytes, bytes + size);
+  }
+
+  bool writeFrame(uint32_t type, const void *payload, size_t size) {
+    uint32_t header[2] = {type, (uint32_t)size};
+    write(header, sizeof(header));
+    write(payload, size);
+    return output.size() < (1 << 20) || flush();
+  }
+
+  bool readFrame(uint32_t &type, vector<char> &payload) {
+    uint32_t header[2];
+    if (!read(header, sizeof(header)) || header[1] > DAEMON_MAX_PAYLOAD) {
+      return false;
+    }
+    // Grown as the bytes arrive, so a header alone cannot make the
+    // daemon set aside a large buffer
+    type = header[0];
+    payload.clear();
+    while (payload.size() < header[1]) {
+      size_t have = payload.size();
+      size_t piece = min((size_t)header[1] - have, input.size());
+      payload.resize(have + piece);
+      if (!read(payload.data() + have, piece)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  bool flush() {
+    size_t sent = 0;
+    while (sent < output.size()) {
+      ssize_t count = send(fd, output.data() + sent, output.size() - sent,
+                           MSG_NOSIGNAL);
+      if (count < 0 && errno == EINTR) {
+        continue;
+      }
+      if (count <= 0) {
+        return false;
+      }
+      sent += count;
+    }
+    output.clear();
+    return true;
+  }
+
+private:
+  int fd;
+  vector<char> input;
+  size_t start = 0;
+  size_t end = 0;
+  vector<char> output;
+};
+
+// Function to answer the requests of one daemon connection until the
+// client closes it or sends a malformed frame
+void answerDaemonRequests(FrameStream &stream, TableLru &cache) {
+  ParseContext context;
+  vector<char> payload;
+  vector<char> results;
+  shared_ptr<const DaemonTables> current;
+  uint64_t currentKey = 0;
+
+  auto fail = [&stream](uint32_t status, const string &message) {
+    return stream.writeFrame(status, message.data(), message.size());
+  };
+
+  uint32_t type;
+  while (stream.readFrame(type, payload)) {
+    bool sent;
+    if (type == DAEMON_GRAMMAR && payload.size() >= sizeof(uint32_t)) {
+      uint32_t flags;
+      memcpy(&flags, payload.data(), sizeof(flags));
+      string text(payload.begin() + sizeof(flags), payload.end());
+      try {
+        current = cache.load(text, flags, currentKey);
+        sent = stream.writeFrame(DAEMON_OK, &currentKey, sizeof(currentKey));
+      } catch (string e) {
+        sent = fail(DAEMON_BAD_GRAMMAR, e);
+      } catch (const exception &e) {
+        sent = fail(DAEMON_BAD_GRAMMAR, e.what());
+      }
+    } else if (type == DAEMON_PARSE &&
+               payload.size() >= sizeof(uint64_t) + sizeof(uint32_t)) {
+      uint64_t key;
+      uint32_t count;
+      memcpy(&key, payload.data(), sizeof(key));
+      memcpy(&count, payload.data() + sizeof(key), sizeof(count));
+      // Looked up every time to keep the entry recent; a connection keeps
+      // parsing with the entry it loaded for its key, even when that entry
+      // was dropped under it and the key now names another text
+      shared_ptr<const DaemonTables> found = cache.find(key);
+      if (found != NULL && (current == NULL || key != currentKey)) {
+        current = found;
+        currentKey = key;
+      }
+      if (current == NULL || key != currentKey) {
+        sent = fail(DAEMON_UNKNOWN_GRAMMAR, "unknown grammar key");
+      } else {
+        const char *position = payload.data() + sizeof(key) + sizeof(count);
+        const char *end = payload.data() + payload.size();
+        // Every record takes at least its length, so a larger count is a
+        // lie and is refused before any memory is set aside for it
+        if (count > (size_t)(end - position) / sizeof(uint32_t)) {
+          if (!fail(DAEMON_BAD_REQUEST, "truncated records")) {
+            break;
+          }
+          continue;
+        }
+        results.resize(count);
+        uint32_t i = 0;
+        for (; i < count; i++) {
+          uint32_t length;
+          if (end - position < (ptrdiff_t)sizeof(length)) {
+            break;
+          }
+          memcpy(&length, position, sizeof(length));
+          position += sizeof(length);
+          if ((size_t)(end - position) < length) {
+            break;
+          }
+          results[i] = parseInput(position, position + length, current->view,
+                                  current->grammar, context);
+          position += length;
+        }
+        sent = i == count && position == end
+                   ? stream.writeFrame(DAEMON_OK, results.data(), count)
+                   : fail(DAEMON_BAD_REQUEST, "truncated records");
+      }
+    } else if (type == DAEMON_STATS) {
+      string text = cache.stats();
+      sent = stream.writeFrame(DAEMON_OK, text.data(), text.size());
+    } else {
+      sent = fail(DAEMON_BAD_REQUEST, "unknown request");
+    }
+    if (!sent) {
+      break;
+    }
+  }
+}
+
+// Function to serve one daemon connection on its own thread. An exception
+// drops only this connection, not the daemon. The socket is left for the
+// caller to close, which may shut it down meanwhile to stop the thread.
+void serveDaemonConnection(int fd, TableLru &cache) {
+  FrameStream stream(fd);
+  try {
+    answerDaemonRequests(stream, cache);
+  } catch (string e) {
+    cerr << "Daemon connection dropped: " << e << endl;
+  } catch (const exception &e) {
+    cerr << "Daemon connection dropped: " << e.what() << endl;
+  }
+  stream.flush();
+}
+
+// Function to connect to a daemon socket, returning -1 on failure
+int connectDaemon(const string &socketPath) {
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socketPath.size() >= sizeof(address.sun_path)) {
+    return -1;
+  }
+  memcpy(address.sun_path, socketPath.data(), socketPath.size());
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0) {
+    return -1;
+  }
+  if (connect(fd, (sockaddr *)&address, sizeof(address)) != 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+// Function to run the conflict report mode:
+//   SLRParser --conflicts [--grammar FILE] [--lalr] [--json]
+// It builds the SLR(1) tables, or the LALR(1) ones with --lalr, and lists
+// every conflict with the items that compete in it. The exit status is 0
+// when there are none, 2 when there are and 1 on errors.
+int runConflicts(int argc, char *argv[]) {
+  Grammar grammar;
+  ParseTables tables;
+  string grammarFile;
+  TableMethod method = TABLE_SLR;
+  bool json = false;
+
+  for (int i = 2; i < argc; i++) {
+    string option = argv[i];
+    if (option == "--grammar" && i + 1 < argc) {
+      grammarFile = argv[++i];
+    } else if (option == "--lalr") {
+      method = TABLE_LALR;
+    } else if (option == "--json") {
+      json = true;
+    } else {
+      cerr << "Unknown conflicts option: " << option << endl;
+      return 1;
+    }
+  }
+
+  if (!loadGrammar(grammarFile, grammar)) {
+    return 1;
+  }
+  vector<ItemSet> canonicalCollection =
+      computeCanonicalCollection(grammar, tables, false, NULL, method);
+  vector<TableConflict> conflicts =
+      collectConflicts(grammar, canonicalCollection, tables);
+
+  writeConflictReport(cout, grammar, conflicts, json);
+  if (!json) {
+    cout << conflicts.size() << " conflict" << (conflicts.size() == 1 ? "" : "s")
+         << " in the " << (method == TABLE_LALR ? "LALR(1)" : "SLR(1)")
+         << " tables of " << tables.numStates << " states" << endl;
+  }
+  return conflicts.empty() ? 0 : 2;
+}
+
+// Function to run the table statistics mode:
+//   SLRParser --table-stats [--grammar FILE]
+// It compresses the tables, checks every compressed lookup against the
+// dense table and reports the compression ratio and the lookup latency of
+// both forms.
+int runTableStats(int argc, char *argv[]) {
+  Grammar grammar;
+  ParseTables tables;
+  string grammarFile;
+
+  for (int i = 2; i < argc; i++) {
+    string option = argv[i];
+    if (option == "--grammar" && i + 1 < argc) {
+      grammarFile = argv[++i];
+    } else {
+      cerr << "Unknown table-stats option: " << option << endl;
+      return 1;
+    }
+  }
+
+  if (!loadGrammar(grammarFile, grammar)) {
+    return 1;
+  }
+  computeCanonicalCollection(grammar, tables, false);
+  CompressedTables compressed = compressTables(tables);
+
+  int numTerminals = tables.terminals.size();
+  int numNonTerminals = tables.nonTerminals.size();
+  size_t mismatches = 0;
+  for (int state = 0; state < tables.numStates; state++) {
+    for (int t = 0; t < numTerminals; t++) {
+      mismatches += compressed.actionAt(state, t) != tables.actionAt(state, t);
+    }
+    for (int n = 0; n < numNonTerminals; n++) {
+      mismatches += compressed.gotoAt(state, n) != tables.gotoAt(state, n);
+    }
+  }
+
+  size_t defaults = 0;
+  for (int action : compressed.defaultAction) {
+    defaults += actionKind(action) == ACTION_REDUCE;
+  }
+  size_t denseBytes = sizeof(int) * (tables.action.size() + tables.goTo.size());
+
+  // Lookup latency over the same random cells for both forms
+  const size_t numLookups = 1 << 22;
+  mt19937 random(12345);
+  vector<pair<int, int> > cells(numLookups);
+  for (pair<int, int> &cell : cells) {
+    cell.first = random() % tables.numStates;
+    cell.second = random() % numTerminals;
+  }
+  auto timeLookups = [&cells](auto lookup) {
+    auto start = chrono::steady_clock::now();
+    unsigned checksum = 0;
+    for (const pair<int, int> &cell : cells) {
+      checksum += lookup(cell.first, cell.second);
+    }
+    chrono::duration<double, nano> elapsed = chrono::steady_clock::now() - start;
+    // Keep the loop from being optimized away
+    if (checksum == 0x9e3779b9u) {
+      cerr << "";
+    }
+    return elapsed.count() / cells.size();
+  };
+  double denseLatency = timeLookups(
+      [&tables](int state, int t) { return tables.actionAt(state, t); });
+  double compressedLatency = timeLookups(
+      [&compressed](int state, int t) { return compressed.actionAt(state, t); });
+
+  cout << "States:                " << tables.numStates << endl;
+  cout << "Terminals:             " << numTerminals << endl;
+  cout << "Non-terminals:         " << numNonTerminals << endl;
+  cout << "Distinct ACTION rows:  " << compressed.defaultAction.size() << endl;
+  cout << "Distinct GOTO rows:    " << compressed.gotoBase.size() << endl;
+  cout << "Default reductions:    " << defaults << endl;
+  cout << "ACTION comb slots:     "
+       << compressed.actionNext.size() - numTerminals << endl;
+  cout << "GOTO comb slots:       "
+       << compressed.gotoNext.size() - numNonTerminals << endl;
+  cout << "Dense size:            " << denseBytes << " bytes" << endl;
+  cout << "Compressed size:       " << compressed.byteSize() << " bytes"
+       << endl;
+  cout << "Compression ratio:     " << fixed << setprecision(2)
+       << (double)denseBytes / compressed.byteSize() << endl;
+  cout << "Dense lookup:          " << denseLatency << " ns" << endl;
+  cout << "Compressed lookup:     " << compressedLatency << " ns" << endl;
+  cout << "Mismatched lookups:    " << mismatches << endl;
+
+  return mismatches == 0 ? 0 : 1;
+}
+
+// Function to run the lexer statistics mode:
+//   SLRParser --lexer-stats --grammar FILE [--input FILE] [--repeat N]
+// It reports the sizes of the lexer automata, tokenizes every input line
+// with and without the vectorized run skipping, checks that both give the
+// same tokens and prints the throughput of the fast one.
+int runLexerStats(int argc, char *argv[]) {
+  Grammar grammar;
+  string grammarFile;
+  string inputFile;
+  int repeat = 3;
+
+  for (int i = 2; i < argc; i++) {
+    string option = argv[i];
+    if (option == "--grammar" && i + 1 < argc) {
+      grammarFile = argv[++i];
+    } else if (option == "--input" && i + 1 < argc) {
+      inputFile = argv[++i];
+    } else if (option == "--repeat" && i + 1 < argc) {
+      repeat = max(1, atoi(argv[++i]));
+    } else {
+      cerr << "Unknown lexer-stats option: " << option << endl;
+      return 1;
+    }
+  }
+
+  if (!loadGrammar(grammarFile, grammar)) {
+    return 1;
+  }
+  if (!grammar.hasLexer()) {
+    cerr << "The grammar has no %token or %skip rules" << endl;
+    return 1;
+  }
+
+  // The whole input is kept in memory so that only the lexer is timed
+  string text;
+  if (inputFile.empty()) {
+    text.assign(istreambuf_iterator<char>(cin), istreambuf_iterator<char>());
+  } else {
+    ifstream input(inputFile, ios::binary);
+    if (!input) {
+      cerr << "Cannot open input file " << inputFile << endl;
+      return 1;
+    }
+    text.assign(istreambuf_iterator<char>(input), istreambuf_iterator<char>());
+  }
+  vector<pair<const char *, const char *> > records;
+  const char *position = text.data();
+  const char *textEnd = text.data() + text.size();
+  while (position < textEnd) {
+    const char *lineEnd = (const char *)memchr(position, '\n', textEnd - position);
+    if (lineEnd == NULL) {
+      lineEnd = textEnd;
+    }
+    records.push_back(make_pair(position, lineEnd));
+    position = lineEnd + 1;
+  }
+
+  LexerDfa scalarLexer = grammar.lexer;
+  for (LexerRun &run : scalarLexer.runs) {
+    run.numRanges = 0;
+  }
+
+  size_t numTokens = 0;
+  size_t errors = 0;
+  size_t mismatches = 0;
+  vector<int> tokens;
+  vector<int> scalarTokens;
+  for (const pair<const char *, const char *> &record : records) {
+    errors += !grammar.lexer.tokenize(record.first, record.second, tokens);
+    scalarLexer.tokenize(record.first, record.second, scalarTokens);
+    mismatches += tokens != scalarTokens;
+    numTokens += tokens.size();
+  }
+
+  auto timeLexer = [&](const LexerDfa &lexer) {
+    double best = 1e300;
+    for (int r = 0; r < repeat; r++) {
+      auto start = chrono::steady_clock::now();
+      for (const pair<const char *, const char *> &record : records) {
+        lexer.tokenize(record.first, record.second, tokens);
+      }
+      chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+      best = min(best, elapsed.count());
+    }
+    return text.size() / best / 1e6;
+  };
+  double scalarSpeed = timeLexer(scalarLexer);
+  double speed = timeLexer(grammar.lexer);
+
+  int runStates = 0;
+  for (const LexerRun &run : grammar.lexer.runs) {
+    runStates += run.numRanges > 0;
+  }
+
+  cout << "Lexer rules:           " << grammar.lexerRules.size() << endl;
+  cout << "NFA states:            " << grammar.lexer.nfaStates << endl;
+  cout << "DFA states:            " << grammar.lexer.subsetStates << endl;
+  cout << "Minimized DFA states:  " << grammar.lexer.numStates << endl;
+  cout << "Byte classes:          " << grammar.lexer.numClasses << endl;
+  cout << "States with runs:      " << runStates << endl;
+  cout << "Input bytes:           " << text.size() << endl;
+  cout << "Tokens:                " << numTokens << endl;
+  cout << "Records with errors:   " << errors << endl;
+  cout << "Byte-at-a-time:        " << fixed << setprecision(1) << scalarSpeed
+       << " MB/s" << endl;
+  cout << "With run skipping:     " << speed << " MB/s" << endl;
+  cout << "Mismatched records:    " << mismatches << endl;
+
+  return mismatches == 0 ? 0 : 1;
+}
+
+// Function to run the code generation mode:
+//   SLRParser --generate [--grammar FILE] [--output FILE] [--namespace NAME]
+//                        [--direct] [--benchmark FILE]
+//                        [--state-profile FILE] [--lalr]
+// The header goes to stdout unless an output file is given. --direct adds
+// the direct-coded parser and --benchmark writes a benchmark program for
+// the header, which then has to be written to a file as well.
+// --state-profile emits the tables with their states renumbered from a
+// profile, see applyStateProfile. --lalr emits LALR(1) tables.
+int runGenerate(int argc, char *argv[]) {
+  Grammar grammar;
+  ParseTables tables;
+  string grammarFile;
+  string outputFile;
+  string benchmarkFile;
+  string profileFile;
+  string nameSpace = "slr_generated";
+  bool direct = false;
+  TableMethod method = TABLE_SLR;
+
+  for (int i = 2; i < argc; i++) {
+    string option = argv[i];
+    if (option == "--grammar" && i + 1 < argc) {
+      grammarFile = argv[++i];
+    } else if (option == "--output" && i + 1 < argc) {
+      outputFile = argv[++i];
+    } else if (option == "--namespace" && i + 1 < argc) {
+      nameSpace = argv[++i];
+    } else if (option == "--benchmark" && i + 1 < argc) {
+      benchmarkFile = argv[++i];
+    } else if (option == "--state-profile" && i + 1 < argc) {
+      profileFile = argv[++i];
+    } else if (option == "--direct") {
+      direct = true;
+    } else if (option == "--lalr") {
+      method = TABLE_LALR;
+    } else {
+      cerr << "Unknown generate option: " << option << endl;
+      return 1;
+    }
+  }
+  if (!benchmarkFile.empty() && outputFile.empty()) {
+    cerr << "--benchmark needs the header to be written with --output" << endl;
+    return 1;
+  }
+
+  if (!loadGrammar(grammarFile, grammar)) {
+    return 1;
+  }
+  computeCanonicalCollection(grammar, tables, false, NULL, method);
+  string profileText;
+  if (!profileFile.empty() &&
+      (!loadStateProfile(profileFile, profileText) ||
+       !applyStateProfile(profileFile, profileText, tables))) {
+    return 1;
+  }
+  if (!tables.conflicts.empty()) {
+    cerr << "Cannot generate a parser: " << describeConflicts(tables) << endl;
+    return 1;
+  }
+
+  if (outputFile.empty()) {
+    emitParserHeader(cout, tables, grammar, nameSpace, direct);
+  } else {
+    ofstream header(outputFile);
+    emitParserHeader(header, tables, grammar, nameSpace, direct);
+    if (!header) {
+      cerr << "Cannot write " << outputFile << endl;
+      return 1;
+    }
+  }
+
+  if (!benchmarkFile.empty()) {
+    // The benchmark includes the header by its file name
+    string headerName = outputFile.substr(outputFile.find_last_of('/') + 1);
+    ofstream benchmark(benchmarkFile);
+    emitParserBenchmark(benchmark, headerName, grammar, nameSpace, direct);
+    if (!benchmark) {
+      cerr << "Cannot write " << benchmarkFile << endl;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Function to run the non-interactive batch mode:
+//   SLRParser --batch [--grammar FILE] [--input FILE] [--threads N]
+//                     [--cache FILE] [--unit-bypass]
+//                     [--state-profile FILE] [--lockstep] [--glr]
+//                     [--lalr]
+// The grammar defaults to the one from getQuestionProductions and the input
+// defaults to stdin. The table is built once and every input line is parsed,
+// on N threads sharing the table when N is greater than one, in which case
+// the table is also built on N threads. --unit-bypass
+// runs eliminateUnitReductions over the table, and --state-profile
+// renumbers its states from a profile with applyStateProfile. --lockstep
+// parses the records of every read buffer together in a LockstepParser on
+// a single thread. --glr parses with a GlrParser, which follows every
+// action of the cells with conflicts, on a single thread and without a
+// cache; tables with conflicts are always parsed with one, and refused
+// with --threads, --lockstep or --cache. --lalr builds LALR(1) tables
+// instead of SLR(1) ones. With a cache
+// file, tables built for the same grammar text are mapped from it instead
+// of being rebuilt, and the file is (re)written whenever it does not match.
+int runBatch(int argc, char *argv[]) {
+  Grammar grammar;
+  ParseTables tables;
+  string grammarFile;
+  string inputFile;
+  string cacheFile;
+  string profileFile;
+  int numThreads = 1;
+  bool unitBypass = false;
+  bool lockstep = false;
+  bool glr = false;
+  TableMethod method = TABLE_SLR;
+
+  for (int i = 2; i < argc; i++) {
+    string option = argv[i];
+    if (option == "--grammar" && i + 1 < argc) {
+      grammarFile = argv[++i];
+    } else if (option == "--input" && i + 1 < argc) {
+      inputFile = argv[++i];
+    } else if (option == "--cache" && i + 1 < argc) {
+      cacheFile = argv[++i];
+    } else if (option == "--state-profile" && i + 1 < argc) {
+      profileFile = argv[++i];
+    } else if (option == "--threads" && i + 1 < argc) {
+      numThreads = atoi(argv[++i]);
+      if (numThreads <= 0) {
+        numThreads = max(1u, thread::hardware_concurrency());
+      }
+    } else if (option == "--unit-bypass") {
+      unitBypass = true;
+    } else if (option == "--lockstep") {
+      lockstep = true;
+    } else if (option == "--glr") {
+      glr = true;
+    } else if (option == "--lalr") {
+      method = TABLE_LALR;
+    } else {
+      cerr << "Unknown batch option: " << option << endl;
+      return 1;
+    }
+  }
+  if (glr && (!cacheFile.empty() || lockstep || numThreads > 1)) {
+    // Conflicts are not kept in cache files or by the other parsers
+    cerr << "--glr cannot be combined with --cache, --lockstep or --threads"
+         << endl;
+    return 1;
+  }
+
+  if (!loadGrammar(grammarFile, grammar)) {
+    return 1;
+  }
+
+  // LALR(1) tables and tables with unit reductions bypassed or renumbered
+  // from a profile are cached under their own key
+  uint64_t grammarHash = hashGrammar(grammar) ^ (unitBypass ? 1 : 0);
+  if (method == TABLE_LALR) {
+    grammarHash ^= 0x9e3779b97f4a7c15ull;
+  }
+  string profileText;
+  if (!profileFile.empty()) {
+    if (!loadStateProfile(profileFile, profileText)) {
+      return 1;
+    }
+    grammarHash ^= checksumBytes(profileText.data(), profileText.size()) << 1;
+  }
+  TableCacheFile cache;
+  TableView view;
+  if (!cacheFile.empty() && cache.open(cacheFile, grammarHash)) {
+    view = cache.view();
+  } else {
+    if (numThreads > 1) {
+      WorkStealingPool pool(numThreads);
+      computeCanonicalCollectionParallel(grammar, tables, pool, NULL, method);
+    } else {
+      computeCanonicalCollection(grammar, tables, false, NULL, method);
+    }
+    if (unitBypass) {
+      eliminateUnitReductions(tables);
+    }
+    if (!profileFile.empty() &&
+        !applyStateProfile(profileFile, profileText, tables)) {
+      return 1;
+    }
+    if (!tables.conflicts.empty()) {
+      if (!cacheFile.empty() || lockstep || numThreads > 1) {
+        cerr << "Cannot use --cache, --lockstep or --threads: "
+             << describeConflicts(tables) << endl;
+        return 1;
+      }
+      glr = true;
+    }
+    if (!cacheFile.empty() && !writeTableCache(cacheFile, tables, grammarHash)) {
+      cerr << "Cannot write table cache " << cacheFile << endl;
+    }
+    view = viewTables(tables);
+  }
+
+  FILE *in = stdin;
+  if (!inputFile.empty()) {
+    in = fopen(inputFile.c_str(), "rb");
+    if (in == NULL) {
+      cerr << "Cannot open input file " << inputFile << endl;
+      return 1;
+    }
+  }
+
+  if (glr) {
+    GlrParser parser(tables, grammar, false);
+    ResultWriter writer(stdout);
+    char *buffer = NULL;
+    size_t capacity = 0;
+    ssize_t length;
+    while ((length = getline(&buffer, &capacity, in)) > 0) {
+      if (buffer[length - 1] == '\n') {
+        length--;
+      }
+      if (length > 0 && buffer[length - 1] == '\r') {
+        length--;
+      }
+      writer.write(parser.parse(buffer, buffer + length));
+    }
+    free(buffer);
+  } else if (numThreads > 1 && !lockstep) {
+    parseBatchParallel(in, stdout, view, grammar, numThreads);
+  } else {
+    parseBatch(in, stdout, view, grammar, lockstep);
+  }
+
+  if (in != stdin) {
+    fclose(in);
+  }
+  return 0;
+}
+
+// Function to run the tree mode:
+//   SLRParser --tree [--grammar FILE] [--input FILE] [--unit-bypass]
+//                    [--glr] [--lalr]
+// Every input line is parsed into a tree, which is printed as nested lists
+// with the text of its leaves, or ERROR when the line is rejected. Trees
+// are the same with unit reductions bypassed. --glr parses with a
+// GlrParser and prints the forest of every derivation, as happens for all
+// tables with conflicts. --lalr parses with LALR(1) tables.
+int runTree(int argc, char *argv[]) {
+  Grammar grammar;
+  ParseTables tables;
+  string grammarFile;
+  string inputFile;
+  bool unitBypass = false;
+  bool glr = false;
+  TableMethod method = TABLE_SLR;
+
+  for (int i = 2; i < argc; i++) {
+    string option = argv[i];
+    if (option == "--grammar" && i + 1 < argc) {
+      grammarFile = argv[++i];
+    } else if (option == "--input" && i + 1 < argc) {
+      inputFile = argv[++i];
+    } else if (option == "--unit-bypass") {
+      unitBypass = true;
+    } else if (option == "--glr") {
+      glr = true;
+    } else if (option == "--lalr") {
+      method = TABLE_LALR;
+    } else {
+      cerr << "Unknown tree option: " << option << endl;
+      return 1;
+    }
+  }
+  if (glr && unitBypass) {
+    // Bypassed unit reductions would be missing from the forest
+    cerr << "--glr cannot be combined with --unit-bypass" << endl;
+    return 1;
+  }
+
+  if (!loadGrammar(grammarFile, grammar)) {
+    return 1;
+  }
+  computeCanonicalCollection(grammar, tables, false, NULL, method);
+  if (!tables.conflicts.empty()) {
+    if (unitBypass) {
+      cerr << "Cannot use --unit-bypass: " << describeConflicts(tables)
+           << endl;
+      return 1;
+    }
+    glr = true;
+  }
+  if (unitBypass) {
+    eliminateUnitReductions(tables);
+  }
+
+  ifstream file;
+  if (!inputFile.empty()) {
+    file.open(inputFile);
+    if (!file) {
+      cerr << "Cannot open input file " << inputFile << endl;
+      return 1;
+    }
+  }
+  istream &in = inputFile.empty() ? cin : file;
+
+  TreeParser parser(viewTables(tables), grammar);
+  GlrParser glrParser(tables, grammar, true);
+  string line;
+  while (getline(in, line)) {
+    if (!line.empty() && line.back() == '\r') {
+      line.pop_back();
+    }
+    if (glr) {
+      if (!glrParser.parse(line.data(), line.data() + line.size())) {
+        cout << "ERROR";
+      } else {
+        glrParser.writeForest(cout, glrParser.rootNode(), line.data());
+      }
+      cout << "\n";
+      continue;
+    }
+    const ParseNode *root = parser.parse(line.data(), line.data() + line.size());
+    if (root == NULL) {
+      cout << "ERROR";
+    } else {
+      parser.writeTree(cout, root);
+    }
+    cout << "\n";
+  }
+  return 0;
+}
+
+// Function to run the incremental mode:
+//   SLRParser --incremental [--grammar FILE] --input FILE [--edits N]
+//                           [--seed N]
+// The input file is one document (a trailing newline is dropped). It is
+// parsed once and then changed by N random edits, each replacing a few
+// bytes with a few bytes copied from elsewhere in the document, every
+// other one undoing the previous edit. After every edit the incremental
+// result is checked against a full parse, and the mean time of both is
+// printed.
+int runIncremental(int argc, char *argv[]) {
+  Grammar grammar;
+  ParseTables tables;
+  string grammarFile;
+  string inputFile;
+  int numEdits = 1000;
+  unsigned seed = 1;
+
+  for (int i = 2; i < argc; i++) {
+    string option = argv[i];
+    if (option == "--grammar" && i + 1 < argc) {
+      grammarFile = argv[++i];
+    } else if (option == "--input" && i + 1 < argc) {
+      inputFile = argv[++i];
+    } else if (option == "--edits" && i + 1 < argc) {
+      numEdits = max(1, atoi(argv[++i]));
+    } else if (option == "--seed" && i + 1 < argc) {
+      seed = atoi(argv[++i]);
+    } else {
+      cerr << "Unknown incremental option: " << option << endl;
+      return 1;
+    }
+  }
+
+  ifstream input(inputFile, ios::binary);
+  if (inputFile.empty() || !input) {
+    cerr << "Cannot open input file " << inputFile << endl;
+    return 1;
+  }
+  string text((istreambuf_iterator<char>(input)), istreambuf_iterator<char>());
+  if (!text.empty() && text.back() == '\n') {
+    text.pop_back();
+  }
+
+  if (!loadGrammar(grammarFile, grammar)) {
+    return 1;
+  }
+  computeCanonicalCollection(grammar, tables, false);
+  TableView view = viewTables(tables);
+
+  IncrementalParser parser(view, grammar);
+  RecordParser reference(view, grammar);
+  parser.parse(text);
+
+  mt19937 random(seed);
+  size_t mismatches = 0;
+  size_t accepted = 0;
+  size_t reparsed = 0;
+  double incrementalSeconds = 0;
+  double fullSeconds = 0;
+  size_t undoStart = 0;
+  size_t undoLength = 0;
+  string undoText;
+
+  for (int e = 0; e < numEdits; e++) {
+    size_t start;
+    size_t removed;
+    string inserted;
+    if (e % 2 == 1) {
+      start = undoStart;
+      removed = undoLength;
+      inserted = undoText;
+    } else {
+      const string &current = parser.text();
+      start = random() % (current.size() + 1);
+      removed = min<size_t>(random() % 8, current.size() - start);
+      size_t from = random() % (current.size() + 1);
+      inserted = current.substr(from, random() % 8);
+      undoStart = start;
+      undoLength = inserted.size();
+      undoText = current.substr(start, removed);
+    }
+
+    auto begin = chrono::steady_clock::now();
+    bool result = parser.edit(start, removed, inserted);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - begin;
+    incrementalSeconds += elapsed.count();
+    reparsed += parser.lastReparsed();
+
+    const string &current = parser.text();
+    begin = chrono::steady_clock::now();
+    bool expected = reference.parse(current.data(),
+                                    current.data() + current.size());
+    elapsed = chrono::steady_clock::now() - begin;
+    fullSeconds += elapsed.count();
+
+    mismatches += result != expected;
+    accepted += result;
+  }
+
+  cout << "Document bytes:        " << text.size() << endl;
+  cout << "Lexemes:               " << parser.numLexemes() << endl;
+  cout << "Edits:                 " << numEdits << endl;
+  cout << "Accepted after edit:   " << accepted << endl;
+  cout << "Mean lexemes reparsed: " << fixed << setprecision(1)
+       << (double)reparsed / numEdits << endl;
+  cout << "Incremental reparse:   " << incrementalSeconds * 1e6 / numEdits
+       << " us" << endl;
+  cout << "Full parse:            " << fullSeconds * 1e6 / numEdits << " us"
+       << endl;
+  cout << "Mismatched results:    " << mismatches << endl;
+
+  return mismatches == 0 ? 0 : 1;
+}
+
+// Function to run the grammar session mode:
+//   SLRParser --grammar-session [--grammar FILE] [--edits N] [--seed N]
+// It applies random edits to the grammar through a GrammarSession: every
+// other edit removes a random production or adds a random new one, some
+// with new symbols, and the edit after it undoes that. After every edit
+// the tables are compared with a full rebuild, and the mean times of both
+// are printed.
+int runGrammarSession(int argc, char *argv[]) {
+  Grammar grammar;
+  string grammarFile;
+  int numEdits = 200;
+  unsigned seed = 1;
+
+  for (int i = 2; i < argc; i++) {
+    string option = argv[i];
+    if (option == "--grammar" && i + 1 < argc) {
+      grammarFile = argv[++i];
+    } else if (option == "--edits" && i + 1 < argc) {
+      numEdits = max(1, atoi(argv[++i]));
+    } else if (option == "--seed" && i + 1 < argc) {
+      seed = atoi(argv[++i]);
+    } else {
+      cerr << "Unknown grammar-session option: " << option << endl;
+      return 1;
+    }
+  }
+
+  if (!loadGrammar(grammarFile, grammar)) {
+    return 1;
+  }
+  GrammarSession session(grammar);
+  mt19937 random(seed);
+  NamedProduction removedProduction;
+  int addedProduction = -1;
+  size_t mismatches = 0;
+  size_t closures = 0;
+  size_t rows = 0;
+  size_t newNames = 0;
+  double sessionSeconds = 0;
+  double fullSeconds = 0;
+
+  for (int e = 0; e < numEdits; e++) {
+    const vector<NamedProduction> &productions = session.productions();
+    const Grammar &current = session.grammar();
+
+    // Names a new production can use: the symbols of the grammar but '$'
+    // and the augmented start symbol, and now and then a new one
+    vector<string> terminals;
+    vector<string> nonTerminals;
+    for (int i = 0; i < current.numSymbols(); i++) {
+      const string &name = current.name(i);
+      if (name == "$" || name == productions[0].lhs) {
+        continue;
+      }
+      (current.isTerminal(i) ? terminals : nonTerminals).push_back(name);
+    }
+    auto newName = [&](bool nonTerminal) {
+      if (current.namedSymbols) {
+        return string(nonTerminal ? "n" : "t") + to_string(newNames++);
+      }
+      for (char c = nonTerminal ? 'A' : 'a'; c <= (nonTerminal ? 'Z' : 'z');
+           c++) {
+        if (current.symbols.find(string(1, c)) < 0) {
+          return string(1, c);
+        }
+      }
+      return string();
+    };
+
+    auto begin = chrono::steady_clock::now();
+    if (e % 2 == 1) {
+      // Undo the previous edit
+      if (addedProduction >= 0) {
+        session.removeProduction(addedProduction);
+      } else {
+        session.addProduction(removedProduction.lhs, removedProduction.rhs);
+      }
+    } else if (random() % 2 == 0 && productions.size() > 2) {
+      int production = 1 + random() % (productions.size() - 1);
+      removedProduction = productions[production];
+      addedProduction = -1;
+      begin = chrono::steady_clock::now();
+      session.removeProduction(production);
+    } else {
+      string lhs = nonTerminals[random() % nonTerminals.size()];
+      if (random() % 8 == 0 && !newName(true).empty()) {
+        lhs = newName(true);
+      }
+      vector<string> rhs;
+      for (int length = random() % 4; length > 0; length--) {
+        bool nonTerminal = random() % 2 == 0;
+        const vector<string> &names = nonTerminal ? nonTerminals : terminals;
+        string name = names.empty() ? string() : names[random() % names.size()];
+        if (name.empty() || random() % 16 == 0) {
+          name = newName(false);
+        }
+        if (!name.empty()) {
+          rhs.push_back(name);
+        }
+      }
+      begin = chrono::steady_clock::now();
+      addedProduction = session.addProduction(lhs, rhs);
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - begin;
+    sessionSeconds += elapsed.count();
+    closures += session.lastClosures();
+    rows += session.lastRows();
+
+    Grammar rebuilt;
+    ParseTables expected;
+    begin = chrono::steady_clock::now();
+    session.buildFromScratch(rebuilt, expected);
+    elapsed = chrono::steady_clock::now() - begin;
+    fullSeconds += elapsed.count();
+
+    mismatches += !equivalentTables(session.tables(), expected);
+  }
+
+  cout << "Productions:           " << session.productions().size() << endl;
+  cout << "Table rows:            " << session.tables().numStates << endl;
+  cout << "Edits:                 " << numEdits << endl;
+  cout << "Mean closures:         " << fixed << setprecision(1)
+       << (double)closures / numEdits << endl;
+  cout << "Mean rows written:     " << (double)rows / numEdits << endl;
+  cout << setprecision(3);
+  cout << "Session edit:          " << sessionSeconds * 1e3 / numEdits
+       << " ms" << endl;
+  cout << "Full rebuild:          " << fullSeconds * 1e3 / numEdits << " ms"
+       << endl;
+  cout << "Mismatched tables:     " << mismatches << endl;
+
+  return mismatches == 0 ? 0 : 1;
+}
+
+// Set by the signal handler of the daemon to stop accepting connections
+static volatile sig_atomic_t daemonStopping = 0;
+
+void stopDaemon(int) { daemonStopping = 1; }
+
+// Function to run the parse daemon:
+//   SLRParser --daemon --socket PATH [--cache-mb N]
+// It listens on a Unix domain socket and answers the requests described at
+// DaemonRequest, one thread per connection, with the tables of every
+// grammar kept in a TableLru of at most N megabytes (256 by default).
+// SIGINT and SIGTERM remove the socket, cut the open connections and stop
+// it once their threads are done.
+int runDaemon(int argc, char *argv[]) {
+  string socketPath;
+  size_t capacity = (size_t)256 << 20;
+
+  for (int i = 2; i < argc; i++) {
+    string option = argv[i];
+    if (option == "--socket" && i + 1 < argc) {
+      socketPath = argv[++i];
+    } else if (option == "--cache-mb" && i + 1 < argc) {
+      capacity = (size_t)max(1, atoi(argv[++i])) << 20;
+    } else {
+      cerr << "Unknown daemon option: " << option << endl;
+      return 1;
+    }
+  }
+
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socketPath.empty() || socketPath.size() >= sizeof(address.sun_path)) {
+    cerr << "The daemon needs a --socket path of at most "
+         << sizeof(address.sun_path) - 1 << " bytes" << endl;
+    return 1;
+  }
+  memcpy(address.sun_path, socketPath.data(), socketPath.size());
+
+  // A socket left behind by a daemon that is gone is replaced
+  struct stat info;
+  if (stat(socketPath.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+    int fd = connectDaemon(socketPath);
+    if (fd >= 0) {
+      close(fd);
+      cerr << "A daemon is already listening on " << socketPath << endl;
+      return 1;
+    }
+    unlink(socketPath.c_str());
+  }
+
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listener < 0 ||
+      bind(listener, (sockaddr *)&address, sizeof(address)) != 0 ||
+      listen(listener, 128) != 0) {
+    cerr << "Cannot listen on " << socketPath << ": " << strerror(errno)
+         << endl;
+    return 1;
+  }
+
+  // SIGINT and SIGTERM are blocked here, before any connection thread
+  // inherits the mask, and only let through while waiting for the next
+  // connection, so they always land on this thread and end the wait
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = stopDaemon;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+  signal(SIGPIPE, SIG_IGN);
+  sigset_t stopSignals;
+  sigset_t waitMask;
+  sigemptyset(&stopSignals);
+  sigaddset(&stopSignals, SIGINT);
+  sigaddset(&stopSignals, SIGTERM);
+  pthread_sigmask(SIG_BLOCK, &stopSignals, &waitMask);
+  sigdelset(&waitMask, SIGINT);
+  sigdelset(&waitMask, SIGTERM);
+  // A connection given up between the wait and accept must not block it
+  fcntl(listener, F_SETFL, fcntl(listener, F_GETFL) | O_NONBLOCK);
+
+  // Open connections and their threads. A socket is closed only once its
+  // thread is joined, so shutting it down never hits a reused descriptor.
+  struct Connection {
+    int fd = -1;
+    thread worker;
+    atomic<bool> done{false};
+  };
+  list<Connection> connections;
+
+  TableLru cache(capacity);
+  while (!daemonStopping) {
+    fd_set ready;
+    FD_ZERO(&ready);
+    FD_SET(listener, &ready);
+    if (pselect(listener + 1, &ready, NULL, NULL, NULL, &waitMask) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      cerr << "pselect: " << strerror(errno) << endl;
+      break;
+    }
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR || errno == ECONNABORTED || errno == EAGAIN ||
+          errno == EWOULDBLOCK) {
+        continue;
+      }
+      cerr << "accept: " << strerror(errno) << endl;
+      break;
+    }
+    fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_NONBLOCK);
+
+    for (auto it = connections.begin(); it != connections.end();) {
+      if (it->done) {
+        it->worker.join();
+        close(it->fd);
+        it = connections.erase(it);
+      } else {
+        ++it;
+      }
+    }
+    connections.emplace_back();
+    Connection &connection = connections.back();
+    connection.fd = fd;
+    connection.worker = thread([&cache, &connection]() {
+      serveDaemonConnection(connection.fd, cache);
+      connection.done = true;
+    });
+  }
+
+  // The connections still open are cut, and their threads are done with
+  // the cache before it goes
+  for (Connection &connection : connections) {
+    shutdown(connection.fd, SHUT_RDWR);
+  }
+  for (Connection &connection : connections) {
+    connection.worker.join();
+    close(connection.fd);
+  }
+  close(listener);
+  unlink(socketPath.c_str());
+  return 0;
+}
+
+// Function to run the daemon client:
+//   SLRParser --client --socket PATH [--grammar FILE] [--input FILE]
+//                      [--batch N] [--pipeline N] [--lalr]
+//                      [--bench] [--repeat N]
+// It sends the grammar to the daemon, then the input lines in requests of
+// N records (64 by default) with up to --pipeline requests in flight (4 by
+// default), and prints ACCEPT or ERROR for every line like --batch does.
+// With --bench it prints nothing per line but sends the input repeat times
+// and reports the grammar load time, the round trip time of the requests
+// and the records parsed per second.
+int runClient(int argc, char *argv[]) {
+  Grammar grammar;
+  string socketPath;
+  string grammarFile;
+  string inputFile;
+  int batchSize = 64;
+  int pipeline = 4;
+  uint32_t flags = 0;
+  bool bench = false;
+  int repeat = 5;
+
+  for (int i = 2; i < argc; i++) {
+    string option = argv[i];
+    if (option == "--socket" && i + 1 < argc) {
+      socketPath = argv[++i];
+    } else if (option == "--grammar" && i + 1 < argc) {
+      grammarFile = argv[++i];
+    } else if (option == "--input" && i + 1 < argc) {
+      inputFile = argv[++i];
+    } else if (option == "--batch" && i + 1 < argc) {
+      batchSize = max(1, atoi(argv[++i]));
+    } else if (option == "--pipeline" && i + 1 < argc) {
+      pipeline = max(1, atoi(argv[++i]));
+    } else if (option == "--lalr") {
+      flags |= DAEMON_FLAG_LALR;
+    } else if (option == "--bench") {
+      bench = true;
+    } else if (option == "--repeat" && i + 1 < argc) {
+      repeat = max(1, atoi(argv[++i]));
+    } else {
+      cerr << "Unknown client option: " << option << endl;
+      return 1;
+    }
+  }
+
+  // The grammar is sent as writeGrammar prints it, so differently
+  // formatted copies of a grammar share their tables in the daemon
+  if (!loadGrammar(grammarFile, grammar)) {
+    return 1;
+  }
+  ostringstream grammarText;
+  writeGrammar(grammarText, grammar);
+
+  vector<string> lines;
+  {
+    ifstream file;
+    if (!inputFile.empty()) {
+      file.open(inputFile);
+      if (!file) {
+        cerr << "Cannot open input file " << inputFile << endl;
+        return 1;
+      }
+    }
+    istream &in = inputFile.empty() ? cin : file;
+    string line;
+    while (getline(in, line)) {
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
+      }
+      lines.push_back(line);
+    }
+  }
+
+  int fd = connectDaemon(socketPath);
+  if (fd < 0) {
+    cerr << "Cannot connect to " << socketPath << endl;
+    return 1;
+  }
+  FrameStream stream(fd);
+  vector<char> answer;
+  uint32_t status;
+
+  // Function to read the answer to a request, reporting errors
+  auto readAnswer = [&]() {
+    if (!stream.readFrame(status, answer)) {
+      cerr << "The daemon closed the connection" << endl;
+      return false;
+    }
+    if (status != DAEMON_OK) {
+      cerr << "Daemon error " << status << ": "
+           << string(answer.begin(), answer.end()) << endl;
+      return false;
+    }
+    return true;
+  };
+
+  // The first load may build the tables, the second one finds them
+  uint64_t key = 0;
+  double loadMicroseconds[2];
+  for (int i = 0; i < 2; i++) {
+    auto start = chrono::steady_clock::now();
+    string text = grammarText.str();
+    vector<char> payload(sizeof(flags));
+    memcpy(payload.data(), &flags, sizeof(flags));
+    payload.insert(payload.end(), text.begin(), text.end());
+    stream.writeFrame(DAEMON_GRAMMAR, payload.data(), payload.size());
+    if (!readAnswer() || answer.size() != sizeof(key)) {
+      close(fd);
+      return 1;
+    }
+    memcpy(&key, answer.data(), sizeof(key));
+    loadMicroseconds[i] = microsecondsSince(start);
+  }
+
+  // Requests of batchSize lines each, built once
+  vector<vector<char> > requests;
+  for (size_t first = 0; first < lines.size(); first += batchSize) {
+    uint32_t count = min(lines.size() - first, (size_t)batchSize);
+    vector<char> request(sizeof(key) + sizeof(count));
+    memcpy(request.data(), &key, sizeof(key));
+    memcpy(request.data() + sizeof(key), &count, sizeof(count));
+    for (size_t i = first; i < first + count; i++) {
+      uint32_t length = lines[i].size();
+      const char *bytes = (const char *)&length;
+      request.insert(request.end(), bytes, bytes + sizeof(length));
+      request.insert(request.end(), lines[i].begin(), lines[i].end());
+    }
+    requests.push_back(request);
+  }
+
+  ResultWriter writer(stdout);
+  vector<double> roundTrips;
+  deque<chrono::steady_clock::time_point> sentAt;
+  size_t accepted = 0;
+  double totalSeconds = 0;
+  for (int r = 0; r < (bench ? repeat : 1); r++) {
+    auto start = chrono::steady_clock::now();
+    size_t next = 0;
+    for (size_t done = 0; done < requests.size(); done++) {
+      while (next < requests.size() && next < done + pipeline) {
+        stream.writeFrame(DAEMON_PARSE, requests[next].data(),
+                          requests[next].size());
+        sentAt.push_back(chrono::steady_clock::now());
+        next++;
+      }
+      if (!readAnswer()) {
+        close(fd);
+        return 1;
+      }
+      roundTrips.push_back(microsecondsSince(sentAt.front()));
+      sentAt.pop_front();
+      for (char result : answer) {
+        accepted += result;
+        if (!bench) {
+          writer.write(result);
+        }
+      }
+    }
+    totalSeconds += microsecondsSince(start) / 1e6;
+  }
+  writer.flush();
+
+  if (bench) {
+    stream.writeFrame(DAEMON_STATS, NULL, 0);
+    if (!readAnswer()) {
+      close(fd);
+      return 1;
+    }
+    sort(roundTrips.begin(), roundTrips.end());
+    auto percentile = [&roundTrips](double p) {
+      return roundTrips.empty()
+                 ? 0.0
+                 : roundTrips[min(roundTrips.size() - 1,
+                                  (size_t)(p * roundTrips.size()))];
+    };
+    size_t records = lines.size() * repeat;
+    cout << fixed << setprecision(1);
+    cout << "First grammar load:    " << loadMicroseconds[0] << " us" << endl;
+    cout << "Cached grammar load:   " << loadMicroseconds[1] << " us" << endl;
+    cout << "Requests:              " << roundTrips.size() << " of up to "
+         << batchSize << " records, " << pipeline << " in flight" << endl;
+    cout << "Round trip p50:        " << percentile(0.5) << " us" << endl;
+    cout << "Round trip p99:        " << percentile(0.99) << " us" << endl;
+    cout << "Records:               " << records << ", " << accepted
+         << " accepted" << endl;
+    cout << "Throughput:            " << setprecision(2)
+         << records / totalSeconds / 1e6 << " M records/s" << endl;
+    cout << "Daemon cache:" << endl << string(answer.begin(), answer.end());
+  }
+  close(fd);
+  return 0;
+}
 
-      } else if (item.lhs == 'D' && item.rhs == productions[0][1] + ".") {
-        // Accept action
-        parsingTable[make_pair(i, '$')] = "Accept";
-      }
+// Function to run the streaming mode:
+//   SLRParser --stream [--grammar FILE] [--input FILE] [--chunk BYTES]
+// The whole input, newlines included, is parsed as one string. It is read
+// and fed to a PushParser one chunk at a time, so it is never held in
+// memory, and reading stops as soon as the result is known.
+int runStream(int argc, char *argv[]) {
+  Grammar grammar;
+  ParseTables tables;
+  string grammarFile;
+  string inputFile;
+  size_t chunkSize = 1 << 16;
+
+  for (int i = 2; i < argc; i++) {
+    string option = argv[i];
+    if (option == "--grammar" && i + 1 < argc) {
+      grammarFile = argv[++i];
+    } else if (option == "--input" && i + 1 < argc) {
+      inputFile = argv[++i];
+    } else if (option == "--chunk" && i + 1 < argc) {
+      chunkSize = max(1, atoi(argv[++i]));
+    } else {
+      cerr << "Unknown stream option: " << option << endl;
+      return 1;
     }
   }
-  return canonicalCollection;
-}
 
-void printParsingTable(map<pair<int, char>, string> &parsingTable,
-                       map<pair<int, char>, int> gotoTable,
-                       vector<vector<string> > &productions,
-                       vector<char> &terminals, vector<char> &nonTerminals,
-                       vector<set<LR0Item> > &canonicalCollection) {
-  cout << "Parsing Table:" << endl;
-  cout << "+----------";
-  for (char symbol : terminals) {
-    cout << "----------";
+  if (!loadGrammar(grammarFile, grammar)) {
+    return 1;
+  }
+  computeCanonicalCollection(grammar, tables, false);
+  if (!tables.conflicts.empty()) {
+    cerr << "Cannot stream: " << describeConflicts(tables) << endl;
+    return 1;
   }
-    cout << "------";
 
-  cout << "----------+" << endl;
+  FILE *in = stdin;
+  if (!inputFile.empty()) {
+    in = fopen(inputFile.c_str(), "rb");
+    if (in == NULL) {
+      cerr << "Cannot open input file " << inputFile << endl;
+      return 1;
+    }
+  }
 
-  cout << "| " << setw(8) << "State"
-       << " |";
-  for (char symbol : terminals) {
-    cout << " " << setw(8) << symbol << " |";
+  PushParser parser(viewTables(tables), grammar);
+  vector<char> chunk(chunkSize);
+  size_t bytesRead = 0;
+  size_t length;
+  while (parser.status() == PARSE_PENDING &&
+         (length = fread(chunk.data(), 1, chunk.size(), in)) > 0) {
+    bytesRead += length;
+    parser.feed(chunk.data(), length);
   }
-  cout << " " << setw(8) << "$"
-       << " |" << endl;
+  ParseStatus status = parser.finish();
 
-  cout << "|----------";
-  for (char symbol : terminals) {
-    cout << "----------";
+  if (in != stdin) {
+    fclose(in);
   }
-    cout << "------";
+  cout << (status == PARSE_ACCEPTED ? "ACCEPT" : "ERROR") << endl;
+  cerr << bytesRead << " bytes read" << endl;
+  return 0;
+}
 
-  cout << "----------|" << endl;
+// Function to run the parallel parse mode:
+//   SLRParser --parallel-parse [--grammar FILE] [--input FILE] [--threads N]
+//                              [--chunks N] [--runs N] [--check]
+// The whole input, newlines included, is one string as in the streaming
+// mode. It is split into terminals, on every thread for single-character
+// grammars, and parsed by a SpeculativeParser in N chunks (four per thread
+// by default), each with at most --runs speculative runs at a time. ACCEPT
+// or ERROR goes to stdout and the chunk statistics to stderr. --check
+// parses the input sequentially as well, which has to give the same result.
+int runParallelParse(int argc, char *argv[]) {
+  Grammar grammar;
+  ParseTables tables;
+  string grammarFile;
+  string inputFile;
+  int numThreads = max(1u, thread::hardware_concurrency());
+  size_t numChunks = 0;
+  int maxRuns = 8;
+  bool check = false;
+
+  for (int i = 2; i < argc; i++) {
+    string option = argv[i];
+    if (option == "--grammar" && i + 1 < argc) {
+      grammarFile = argv[++i];
+    } else if (option == "--input" && i + 1 < argc) {
+      inputFile = argv[++i];
+    } else if (option == "--threads" && i + 1 < argc) {
+      numThreads = atoi(argv[++i]);
+      if (numThreads <= 0) {
+        numThreads = max(1u, thread::hardware_concurrency());
+      }
+    } else if (option == "--chunks" && i + 1 < argc) {
+      numChunks = max(1, atoi(argv[++i]));
+    } else if (option == "--runs" && i + 1 < argc) {
+      maxRuns = max(1, atoi(argv[++i]));
+    } else if (option == "--check") {
+      check = true;
+    } else {
+      cerr << "Unknown parallel-parse option: " << option << endl;
+      return 1;
+    }
+  }
+  if (numChunks == 0) {
+    numChunks = 4 * numThreads;
+  }
 
-  for (size_t i = 0; i < canonicalCollection.size(); i++) {
-    cout << "| " << setw(8) << i << " |";
-    for (char symbol : terminals) {
-      if (parsingTable.find(make_pair(i, symbol)) != parsingTable.end()) {
-        cout << " " << setw(8) << parsingTable[make_pair(i, symbol)] << " |";
-      } else {
-        cout << "          |";
+  if (!loadGrammar(grammarFile, grammar)) {
+    return 1;
+  }
+  computeCanonicalCollection(grammar, tables, false);
+  if (!tables.conflicts.empty()) {
+    cerr << "Cannot parse in parallel: " << describeConflicts(tables) << endl;
+    return 1;
+  }
+  TableView view = viewTables(tables);
+
+  // A file is mapped, stdin is read into memory
+  vector<char> buffer;
+  const char *text = NULL;
+  size_t size = 0;
+  void *mapping = MAP_FAILED;
+  if (!inputFile.empty()) {
+    int fd = open(inputFile.c_str(), O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info) != 0) {
+      if (fd >= 0) {
+        close(fd);
       }
+      cerr << "Cannot open input file " << inputFile << endl;
+      return 1;
     }
-    if (parsingTable.find(make_pair(i, '$')) != parsingTable.end()) {
-      cout << " " << setw(8) << parsingTable[make_pair(i, '$')] << " |";
-    } else {
-      cout << "          |";
+    size = info.st_size;
+    if (size > 0) {
+      mapping = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
     }
-    cout << endl;
+    close(fd);
+    if (size > 0 && mapping == MAP_FAILED) {
+      cerr << "Cannot map input file " << inputFile << endl;
+      return 1;
+    }
+    text = (const char *)mapping;
+  } else {
+    char block[1 << 16];
+    size_t length;
+    while ((length = fread(block, 1, sizeof(block), stdin)) > 0) {
+      buffer.insert(buffer.end(), block, block + length);
+    }
+    text = buffer.data();
+    size = buffer.size();
   }
 
-  cout << "+----------";
-  for (char symbol : terminals) {
-    cout << "----------";
+  WorkStealingPool pool(numThreads);
+  auto start = chrono::steady_clock::now();
+  vector<int> tokens;
+  if (grammar.namedSymbols) {
+    tokenizeInput(text, text + size, grammar, tokens);
+  } else {
+    tokens.resize(size);
+    const size_t block = 1 << 20;
+    pool.run((size + block - 1) / block, [&](int, size_t index) {
+      size_t end = min(size, (index + 1) * block);
+      for (size_t i = index * block; i < end; i++) {
+        tokens[i] = view.terminalIndex[(unsigned char)text[i]];
+      }
+    });
+  }
+  double tokenizeSeconds = microsecondsSince(start) / 1e6;
+
+  SpeculativeParser parser(view, pool, maxRuns);
+  start = chrono::steady_clock::now();
+  bool accepted = parser.parse(tokens.data(), tokens.size(), numChunks);
+  double parseSeconds = microsecondsSince(start) / 1e6;
+
+  bool identical = true;
+  double sequentialSeconds = 0;
+  if (check) {
+    vector<int> stateStack;
+    start = chrono::steady_clock::now();
+    identical =
+        parseTokens(tokens.data(), tokens.size(), view, stateStack) == accepted;
+    sequentialSeconds = microsecondsSince(start) / 1e6;
+  }
+  if (mapping != MAP_FAILED) {
+    munmap(mapping, size);
   }
-    cout << "------";
 
-  cout << "----------+" << endl;
+  cout << (accepted ? "ACCEPT" : "ERROR") << endl;
+  cerr << fixed << setprecision(3);
+  cerr << "Tokens:                " << tokens.size() << endl;
+  cerr << "Chunks:                " << parser.speculatedChunks() << " of "
+       << parser.speculatedChunks() + parser.reparsedChunks()
+       << " stitched from speculative runs" << endl;
+  cerr << "Tokenize:              " << tokenizeSeconds * 1e3 << " ms" << endl;
+  cerr << "Parallel parse:        " << parseSeconds * 1e3 << " ms on "
+       << numThreads << " threads" << endl;
+  if (check) {
+    cerr << "Sequential parse:      " << sequentialSeconds * 1e3 << " ms"
+         << endl;
+    cerr << "Identical result:      " << (identical ? "yes" : "NO") << endl;
+  }
+  return identical ? 0 : 1;
+}
 
-  // Display the goto table
-  cout << "Goto Table:" << endl;
-  cout << "+----------";
-  for (char symbol : nonTerminals) {
-    cout << "----------";
+// Function to run the benchmark mode:
+//   SLRParser --bench [--grammar FILE | --synthetic expr|wide|deep]
+//                     [--size N] [--sentences N] [--length N]
+//                     [--invalid PERCENT] [--seed N] [--repeat N]
+//                     [--profile] [--json] [--unit-bypass] [--threads N]
+//                     [--reorder] [--lockstep] [--glr] [--lalr]
+// It builds the tables repeat times and reports the fastest time of every
+// construction phase, then derives random sentences from the grammar,
+// mutates the given percentage of them into near-valid ones and reports
+// the best parse throughput over repeat passes. With --profile one more
+// pass runs with a ParseProfile, whose counters are summarized, or written
+// out in full with --json. --unit-bypass measures the tables after
+// eliminateUnitReductions. With --threads N the collection is also built
+// by computeCanonicalCollectionParallel, which has to give identical tables.
+// --reorder renumbers the states from the profile of a second set of
+// sentences and times the same sentences again on the renumbered tables,
+// which have to give the same results. --lockstep also times the
+// LockstepParser, which has to agree with the scalar parser. --glr times
+// the GlrParser and reports how much of the input it read with more than
+// one stack; on tables without conflicts it has to agree with the
+// deterministic parser. --lalr builds and measures LALR(1) tables and
+// reports how many conflicts the lookaheads removed from the SLR(1) ones.
+int runBench(int argc, char *argv[]) {
+  Grammar grammar;
+  ParseTables tables;
+  string grammarFile;
+  string synthetic;
+  int size = 8;
+  int numSentences = 1000;
+  int length = 100;
+  int invalidPercent = 0;
+  unsigned seed = 1;
+  int repeat = 5;
+  bool profile = false;
+  bool json = false;
+  bool unitBypass = false;
+  bool reorder = false;
+  bool lockstep = false;
+  bool glr = false;
+  TableMethod method = TABLE_SLR;
+  int numThreads = 1;
+
+  for (int i = 2; i < argc; i++) {
+    string option = argv[i];
+    if (option == "--grammar" && i + 1 < argc) {
+      grammarFile = argv[++i];
+    } else if (option == "--synthetic" && i + 1 < argc) {
+      synthetic = argv[++i];
+    } else if (option == "--size" && i + 1 < argc) {
+      size = atoi(argv[++i]);
+    } else if (option == "--sentences" && i + 1 < argc) {
+      numSentences = max(1, atoi(argv[++i]));
+    } else if (option == "--length" && i + 1 < argc) {
+      length = max(1, atoi(argv[++i]));
+    } else if (option == "--invalid" && i + 1 < argc) {
+      invalidPercent = atoi(argv[++i]);
+    } else if (option == "--seed" && i + 1 < argc) {
+      seed = atoi(argv[++i]);
+    } else if (option == "--repeat" && i + 1 < argc) {
+      repeat = max(1, atoi(argv[++i]));
+    } else if (option == "--profile") {
+      profile = true;
+    } else if (option == "--json") {
+      json = true;
+    } else if (option == "--unit-bypass") {
+      unitBypass = true;
+    } else if (option == "--reorder") {
+      reorder = true;
+    } else if (option == "--lockstep") {
+      lockstep = true;
+    } else if (option == "--glr") {
+      glr = true;
+    } else if (option == "--lalr") {
+      method = TABLE_LALR;
+    } else if (option == "--threads" && i + 1 < argc) {
+      numThreads = atoi(argv[++i]);
+      if (numThreads <= 0) {
+        numThreads = max(1u, thread::hardware_concurrency());
+      }
+    } else {
+      cerr << "Unknown bench option: " << option << endl;
+      return 1;
+    }
   }
 
-  cout << "----+" << endl;
+  string grammarName = grammarFile.empty() ? "default" : grammarFile;
+  if (!synthetic.empty()) {
+    grammarName = synthetic + " " + to_string(size);
+    try {
+      istringstream text(syntheticGrammar(synthetic, size));
+      string error;
+      if (!readGrammar(text, grammar, error)) {
+        cerr << "Synthetic grammar: " << error << endl;
+        return 1;
+      }
+    } catch (string e) {
+      cerr << "Synthetic grammar: " << e << endl;
+      return 1;
+    }
+  } else if (!loadGrammar(grammarFile, grammar)) {
+    return 1;
+  }
 
-  cout << "| " << setw(8) << "State"
-       << " |";
-  for (char symbol : nonTerminals) {
-    cout << " " << setw(8) << symbol << " |";
+  BuildTimings best;
+  for (int r = 0; r < repeat; r++) {
+    BuildTimings timings;
+    computeCanonicalCollection(grammar, tables, false, &timings, method);
+    if (r == 0 || timings.total() < best.total()) {
+      best = timings;
+    }
   }
-  cout << endl;
 
-  cout << "|----------";
-  for (char symbol : nonTerminals) {
-    cout << "----------";
+  // Conflicts of the SLR(1) tables of the grammar, for comparison
+  size_t slrConflicts = tables.conflicts.size();
+  if (method == TABLE_LALR) {
+    ParseTables slrTables;
+    computeCanonicalCollection(grammar, slrTables, false);
+    slrConflicts = slrTables.conflicts.size();
   }
 
-  cout << "----|" << endl;
+  // The parallel build is timed the same way and has to produce the same
+  // collection and tables
+  BuildTimings bestParallel;
+  bool identical = true;
+  if (numThreads > 1) {
+    vector<ItemSet> serialCollection =
+        computeCanonicalCollection(grammar, tables, false, NULL, method);
+    WorkStealingPool pool(numThreads);
+    for (int r = 0; r < repeat; r++) {
+      BuildTimings timings;
+      ParseTables parallelTables;
+      vector<ItemSet> collection = computeCanonicalCollectionParallel(
+          grammar, parallelTables, pool, &timings, method);
+      if (r == 0 || timings.total() < bestParallel.total()) {
+        bestParallel = timings;
+      }
+      identical = identical && collection == serialCollection &&
+                  parallelTables.action == tables.action &&
+                  parallelTables.goTo == tables.goTo;
+    }
+  }
+  size_t bypassed = unitBypass ? eliminateUnitReductions(tables) : 0;
+  TableView view = viewTables(tables);
+
+  // Sentences as terminal ids, and as text for single-character grammars,
+  // which are parsed character by character like parseString does
+  auto generateSentences = [&](unsigned sentenceSeed,
+                               vector<vector<int> > &sentences,
+                               vector<string> &texts) {
+    size_t numTokens = 0;
+    SentenceGenerator generator(grammar);
+    mt19937 random(sentenceSeed);
+    for (vector<int> &sentence : sentences) {
+      generator.generate(length, random, sentence);
+      if ((int)(random() % 100) < invalidPercent) {
+        generator.mutate(random, sentence);
+      }
+      numTokens += sentence.size() + 1; // With the '$' at the end
+      if (!grammar.namedSymbols) {
+        string text;
+        for (int terminal : sentence) {
+          text += grammar.name(terminal);
+        }
+        texts.push_back(text);
+      }
+    }
+    return numTokens;
+  };
+  vector<vector<int> > sentences(numSentences);
+  vector<string> texts;
+  size_t numTokens = 0;
+  try {
+    numTokens = generateSentences(seed, sentences, texts);
+  } catch (string e) {
+    cerr << "Cannot generate sentences: " << e << endl;
+    return 1;
+  }
 
-  for (size_t i = 0; i < canonicalCollection.size(); i++) {
-    cout << "| " << setw(8) << i << " |";
-    for (char symbol : nonTerminals) {
-      if (gotoTable.find(make_pair(i, symbol)) != gotoTable.end()) {
-        cout << " " << setw(8) << gotoTable[make_pair(i, symbol)] << " |";
+  vector<int> stateStack;
+  vector<char> results(sentences.size());
+  auto parseSet = [&](const TableView &tables,
+                      const vector<vector<int> > &sentences,
+                      const vector<string> &texts, auto &probe) {
+    size_t accepted = 0;
+    for (size_t i = 0; i < sentences.size(); i++) {
+      if (grammar.namedSymbols) {
+        results[i] = parseTokens(sentences[i].data(), sentences[i].size(),
+                                 tables, stateStack, probe);
       } else {
-        cout << "          |";
+        results[i] = parseRecord(texts[i].data(),
+                                 texts[i].data() + texts[i].size(), tables,
+                                 stateStack, probe);
       }
+      accepted += results[i];
+    }
+    return accepted;
+  };
+  auto parseAll = [&](auto &probe) {
+    return parseSet(view, sentences, texts, probe);
+  };
+
+  size_t accepted = 0;
+  double parseSeconds = 0;
+  for (int r = 0; r < repeat; r++) {
+    NoProbe probe;
+    auto start = chrono::steady_clock::now();
+    accepted = parseAll(probe);
+    double seconds = microsecondsSince(start) / 1e6;
+    if (r == 0 || seconds < parseSeconds) {
+      parseSeconds = seconds;
     }
-    cout << endl;
   }
 
-  cout << "+----------";
-  for (char symbol : nonTerminals) {
-    cout << "----------";
+  // The lockstep parser runs over the same sentences and has to agree with
+  // the scalar one on every sentence
+  double lockstepSeconds = 0;
+  bool lockstepIdentical = true;
+  if (lockstep) {
+    LockstepParser parser(view, grammar);
+    vector<pair<const int *, const int *> > tokenRecords;
+    vector<pair<const char *, const char *> > textRecords;
+    for (size_t i = 0; i < sentences.size(); i++) {
+      if (grammar.namedSymbols) {
+        tokenRecords.push_back(make_pair(
+            sentences[i].data(), sentences[i].data() + sentences[i].size()));
+      } else {
+        textRecords.push_back(make_pair(texts[i].data(),
+                                        texts[i].data() + texts[i].size()));
+      }
+    }
+    vector<char> lockstepResults;
+    for (int r = 0; r < repeat; r++) {
+      auto start = chrono::steady_clock::now();
+      if (grammar.namedSymbols) {
+        parser.parseTokens(tokenRecords, lockstepResults);
+      } else {
+        parser.parse(textRecords, lockstepResults);
+      }
+      double seconds = microsecondsSince(start) / 1e6;
+      if (r == 0 || seconds < lockstepSeconds) {
+        lockstepSeconds = seconds;
+      }
+      lockstepIdentical = lockstepIdentical && lockstepResults == results;
+    }
   }
 
-  cout << "----+" << endl;
-}
-
-bool parseString(string &input, map<pair<int, char>, string> &parsingTable,
-                 vector<vector<string> > &productions,
-                 map<pair<int, char>, int> gotoTable) {
-  stack<int> stateStack;
-  stateStack.push(0);
-  stack<char> symbolStack;
-  symbolStack.push('$');
-  
-
-  size_t currentPosition = 0;
-  char currentSymbol = input[currentPosition];
-
-  while (true) {
-    int currentState = stateStack.top();
-
-    // Check if there's a valid action in the parsing table
-    if (parsingTable.find(make_pair(currentState, currentSymbol)) !=
-        parsingTable.end()) {
-      string action = parsingTable[make_pair(currentState, currentSymbol)];
-
-      if (action.substr(0, 5) == "Shift") {
-        // Shift action
-        int nextState = stoi(action.substr(6));
-        stateStack.push(nextState);
-        symbolStack.push(currentSymbol);
-
-        // Move to the next symbol
-        currentPosition++;
-        currentSymbol = input[currentPosition];
-      } else if (action.substr(0, 6) == "Reduce") {
-        // Reduce action
-        int productionIndex = stoi(action.substr(7));
-
-        vector<string> production = productions[productionIndex];
-
-        // Pop the symbols from the stack based on the RHS of the production
-        for (size_t i = 0; i < production[1].length(); i++) {
-          stateStack.pop();
-          symbolStack.pop();
-        }
-
-        // Get the non-terminal on the LHS of the production
-        char nonTerminal = production[0][0];
-
-        // Check if there's a valid action in the goto table
-        if (gotoTable.find(make_pair(stateStack.top(), nonTerminal)) !=
-            gotoTable.end()) {
-          // Get the next state from the goto table
-          int nextState = gotoTable[make_pair(stateStack.top(), nonTerminal)];
-
-          // Push the non-terminal and the next state onto the stacks
-          stateStack.push(nextState);
-          symbolStack.push(nonTerminal);
+  // The GLR parser runs over the same sentences. Without conflicts it has
+  // to agree with the deterministic parser on every sentence.
+  double glrSeconds = 0;
+  size_t glrAccepted = 0;
+  size_t glrTerminals = 0;
+  bool glrIdentical = true;
+  if (glr) {
+    GlrParser parser(tables, grammar, false);
+    vector<char> glrResults(sentences.size());
+    for (int r = 0; r < repeat; r++) {
+      glrTerminals = 0;
+      auto start = chrono::steady_clock::now();
+      for (size_t i = 0; i < sentences.size(); i++) {
+        if (grammar.namedSymbols) {
+          glrResults[i] =
+              parser.parseTokens(sentences[i].data(), sentences[i].size());
         } else {
-          // Invalid goto action
-          return false;
+          glrResults[i] = parser.parse(texts[i].data(),
+                                       texts[i].data() + texts[i].size());
         }
-      } else if (action == "Accept") {
-        // Accept action
-        return true;
-      } else {
-        // Invalid action
-        return false;
+        glrTerminals += parser.generalizedTerminals();
+      }
+      double seconds = microsecondsSince(start) / 1e6;
+      if (r == 0 || seconds < glrSeconds) {
+        glrSeconds = seconds;
       }
-    } else {
-      // No valid action in the parsing table
-      return false;
     }
+    glrAccepted = count(glrResults.begin(), glrResults.end(), 1);
+    glrIdentical = !tables.conflicts.empty() || glrResults == results;
   }
-}
 
-// Function to display the canonical collection of LR(0) items
-void displayCanonicalCollection(
-    const vector<set<LR0Item> > &canonicalCollection) {
-  for (size_t i = 0; i < canonicalCollection.size(); i++) {
-    cout << "I" << i << ":" << endl;
-    for (const LR0Item &item : canonicalCollection[i]) {
-      cout << item.lhs << " -> " << item.rhs << endl;
+  ParseProfile counters;
+  double profiledSeconds = 0;
+  if (profile) {
+    counters.init(view, grammar.lhs.size());
+    auto start = chrono::steady_clock::now();
+    parseAll(counters);
+    profiledSeconds = microsecondsSince(start) / 1e6;
+  }
+
+  // The states are renumbered from the profile of a second set of
+  // sentences, so the tables are not tuned to the very sentences timed
+  double reorderedSeconds = 0;
+  double distanceBefore = 0, distanceAfter = 0;
+  bool sameResults = true;
+  if (reorder) {
+    vector<char> expected = results;
+    vector<vector<int> > training(numSentences);
+    vector<string> trainingTexts;
+    generateSentences(seed + 1, training, trainingTexts);
+    ParseProfile trainingProfile;
+    trainingProfile.init(view, grammar.lhs.size());
+    parseSet(view, training, trainingTexts, trainingProfile);
+
+    vector<int> order =
+        profileStateOrder(tables.numStates, trainingProfile.stateVisits,
+                          trainingProfile.stateTransitions);
+    ParseTables reordered = tables;
+    renumberStates(reordered, order);
+    TableView reorderedView = viewTables(reordered);
+
+    // Distances are measured on the timed sentences
+    ParseProfile evaluation;
+    evaluation.init(view, grammar.lhs.size());
+    parseAll(evaluation);
+    vector<int> identity(tables.numStates), number(tables.numStates);
+    for (int i = 0; i < tables.numStates; i++) {
+      identity[i] = i;
+      number[order[i]] = i;
+    }
+    distanceBefore =
+        meanTransitionDistance(evaluation.stateTransitions, identity);
+    distanceAfter = meanTransitionDistance(evaluation.stateTransitions, number);
+
+    for (int r = 0; r < repeat; r++) {
+      NoProbe probe;
+      auto start = chrono::steady_clock::now();
+      parseSet(reorderedView, sentences, texts, probe);
+      double seconds = microsecondsSince(start) / 1e6;
+      if (r == 0 || seconds < reorderedSeconds) {
+        reorderedSeconds = seconds;
+      }
+      sameResults = sameResults && results == expected;
     }
-    cout << endl;
   }
-}
 
-int getProductions(vector<char> &nonTerminals, vector<char> &terminals, vector<vector<string> > &productions){
-  cout << "Please enter your grammar in the form \n\tS->AA\n\tA->aA\n\tA->b\n" << endl;
-  nonTerminals.push_back('D');
+  double nsPerToken = parseSeconds * 1e9 / numTokens;
+  double tokensPerSecond = numTokens / parseSeconds;
+
+  if (json) {
+    cout << "{\n"
+         << "\"grammar\": " << jsonString(grammarName) << ",\n"
+         << "\"productions\": " << grammar.lhs.size() << ",\n"
+         << "\"terminals\": " << grammar.numTerminals << ",\n"
+         << "\"nonTerminals\": " << grammar.numNonTerminals() << ",\n"
+         << "\"states\": " << tables.numStates << ",\n"
+         << "\"bypassedUnitGotos\": " << bypassed << ",\n"
+         << "\"seed\": " << seed << ",\n"
+         << "\"repeat\": " << repeat << ",\n"
+         << "\"buildMicroseconds\": {\"first\": " << best.first
+         << ", \"follow\": " << best.follow
+         << ", \"closures\": " << best.closures
+         << ", \"collection\": " << best.collection
+         << ", \"lookaheads\": " << best.lookaheads
+         << ", \"table\": " << best.table << ", \"total\": " << best.total()
+         << "},\n";
+    if (method == TABLE_LALR) {
+      cout << "\"slrConflicts\": " << slrConflicts << ",\n"
+           << "\"lalrConflicts\": " << tables.conflicts.size() << ",\n";
+    }
+    if (numThreads > 1) {
+      cout << "\"threads\": " << numThreads << ",\n"
+           << "\"parallelCollectionMicroseconds\": " << bestParallel.collection
+           << ",\n"
+           << "\"parallelIdentical\": " << (identical ? "true" : "false")
+           << ",\n";
+    }
+    cout << "\"sentences\": " << numSentences << ",\n"
+         << "\"tokens\": " << numTokens << ",\n"
+         << "\"accepted\": " << accepted << ",\n"
+         << "\"parseSeconds\": " << parseSeconds << ",\n"
+         << "\"tokensPerSecond\": " << tokensPerSecond << ",\n"
+         << "\"nsPerToken\": " << nsPerToken;
+    if (profile) {
+      cout << ",\n\"profiledNsPerToken\": "
+           << profiledSeconds * 1e9 / numTokens << ",\n\"profile\": ";
+      counters.writeJson(cout, grammar);
+    }
+    if (lockstep) {
+      cout << ",\n\"lockstepNsPerToken\": "
+           << lockstepSeconds * 1e9 / numTokens << ",\n"
+           << "\"lockstepIdentical\": "
+           << (lockstepIdentical ? "true" : "false");
+    }
+    if (glr) {
+      cout << ",\n\"conflicts\": " << tables.conflicts.size() << ",\n"
+           << "\"glrNsPerToken\": " << glrSeconds * 1e9 / numTokens << ",\n"
+           << "\"glrAccepted\": " << glrAccepted << ",\n"
+           << "\"glrTokens\": " << glrTerminals << ",\n"
+           << "\"glrIdentical\": " << (glrIdentical ? "true" : "false");
+    }
+    if (reorder) {
+      cout << ",\n\"reorderedNsPerToken\": "
+           << reorderedSeconds * 1e9 / numTokens << ",\n"
+           << "\"meanRowJumpBefore\": " << distanceBefore << ",\n"
+           << "\"meanRowJumpAfter\": " << distanceAfter << ",\n"
+           << "\"reorderedIdentical\": " << (sameResults ? "true" : "false");
+    }
+    cout << "\n}" << endl;
+    return identical && sameResults && lockstepIdentical && glrIdentical
+               ? 0
+               : 1;
+  }
 
-  bool first = true;
+  cout << "Grammar:               " << grammarName << endl;
+  cout << "Productions:           " << grammar.lhs.size() << endl;
+  cout << "States:                " << tables.numStates << endl;
+  if (unitBypass) {
+    cout << "Bypassed unit gotos:   " << bypassed << endl;
+  }
+  cout << fixed << setprecision(1);
+  cout << "FIRST:                 " << best.first << " us" << endl;
+  cout << "FOLLOW:                " << best.follow << " us" << endl;
+  cout << "Closures:              " << best.closures << " us" << endl;
+  cout << "Collection:            " << best.collection << " us" << endl;
+  if (method == TABLE_LALR) {
+    cout << "Lookaheads:            " << best.lookaheads << " us" << endl;
+  }
+  cout << "Table:                 " << best.table << " us" << endl;
+  if (method == TABLE_LALR) {
+    cout << "SLR(1) conflicts:      " << slrConflicts << endl;
+    cout << "LALR(1) conflicts:     " << tables.conflicts.size() << endl;
+  }
+  if (numThreads > 1) {
+    cout << "Parallel collection:   " << bestParallel.collection << " us on "
+         << numThreads << " threads" << endl;
+    cout << "Identical tables:      " << (identical ? "yes" : "NO") << endl;
+  }
+  cout << "Sentences:             " << numSentences << endl;
+  cout << "Tokens:                " << numTokens << endl;
+  cout << "Accepted:              " << accepted << endl;
+  cout << setprecision(2);
+  cout << "Parse:                 " << nsPerToken << " ns/token, "
+       << tokensPerSecond / 1e6 << " M tokens/s" << endl;
+  if (profile) {
+    int hottest = max_element(counters.stateVisits.begin(),
+                              counters.stateVisits.end()) -
+                  counters.stateVisits.begin();
+    cout << "Profiled parse:        " << profiledSeconds * 1e9 / numTokens
+         << " ns/token" << endl;
+    cout << "Shifts:                " << counters.shifts() << endl;
+    cout << "Reductions:            " << counters.reductions() << endl;
+    cout << "Gotos:                 " << counters.gotos() << endl;
+    cout << "Hottest state:         " << hottest << " ("
+         << counters.stateVisits[hottest] << " visits)" << endl;
+    cout << "Max stack depth:       " << counters.maxDepth << endl;
+    cout << "Errors:                " << counters.errors << endl;
+  }
+  if (lockstep) {
+    cout << "Lockstep parse:        " << lockstepSeconds * 1e9 / numTokens
+         << " ns/token, " << numTokens / lockstepSeconds / 1e6
+         << " M tokens/s on " << LockstepParser::LANES << " lanes" << endl;
+    cout << "Lockstep identical:    " << (lockstepIdentical ? "yes" : "NO")
+         << endl;
+  }
+  if (glr) {
+    cout << "Conflict cells:        " << tables.conflicts.size() << endl;
+    cout << "GLR parse:             " << glrSeconds * 1e9 / numTokens
+         << " ns/token, " << glrAccepted << " accepted, "
+         << glrTerminals * 100.0 / numTokens
+         << "% of tokens read with several stacks" << endl;
+    if (tables.conflicts.empty()) {
+      cout << "GLR identical:         " << (glrIdentical ? "yes" : "NO")
+           << endl;
+    }
+  }
+  if (reorder) {
+    cout << "Reordered parse:       " << reorderedSeconds * 1e9 / numTokens
+         << " ns/token, " << numTokens / reorderedSeconds / 1e6
+         << " M tokens/s" << endl;
+    cout << "Mean row jump:         " << distanceBefore << " rows before, "
+         << distanceAfter << " rows after" << endl;
+    cout << "Identical results:     " << (sameResults ? "yes" : "NO") << endl;
+  }
+  return identical && sameResults && lockstepIdentical && glrIdentical ? 0
+                                                                       : 1;
+}
 
-  string line;
-  cin.ignore();
+#ifndef SLR_PARSER_NO_MAIN
+#ifdef SLR_PARSER_ALLOC_CHECK
+// Number of heap allocations made by the program, counted by the
+// replacements of the global operator new below for --alloc-check. They
+// put an atomic add on every allocation, so only builds with
+// -DSLR_PARSER_ALLOC_CHECK have them, and programs that include this file
+// with SLR_PARSER_NO_MAIN keep their own allocator. They are kept out of
+// line, or the compiler sees malloc paired with delete once they are
+// inlined into the containers and warns about it.
+static atomic<size_t> allocationCount(0);
+
+__attribute__((noinline)) void *operator new(size_t size) {
+  allocationCount.fetch_add(1, memory_order_relaxed);
+  void *block = malloc(size == 0 ? 1 : size);
+  if (block == NULL) {
+    throw bad_alloc();
+  }
+  return block;
+}
 
-  while (getline(std::cin, line))
-  {
-      vector<string> production;
-      vector<string> productionZero;
-      if (line.empty()) {
-          break;
-      }
-      if(isupper(line[0]) && line[1] == '-' && line[2] == '>'){
-        auto it = find(nonTerminals.begin(),
-                 nonTerminals.end(), line[0]);
+void *operator new[](size_t size) { return operator new(size); }
 
-        if (it == nonTerminals.end()) {
-          nonTerminals.push_back(line[0]);
-        }
+__attribute__((noinline)) void operator delete(void *block) noexcept {
+  free(block);
+}
+__attribute__((noinline)) void operator delete[](void *block) noexcept {
+  free(block);
+}
+__attribute__((noinline)) void operator delete(void *block, size_t) noexcept {
+  free(block);
+}
+__attribute__((noinline)) void operator delete[](void *block,
+                                                 size_t) noexcept {
+  free(block);
+}
 
-        if(first){
-          productionZero.push_back("D");
-          productionZero.push_back(string(1,line[0]));
-          productions.push_back(productionZero);
-          first = false;
-        }
+// Function to run the allocation check mode:
+//   SLRParser --alloc-check [--grammar FILE] [--input FILE] [--repeat N]
+//                           [--seed N]
+// Every input line, or 1000 sentences derived from the grammar when no
+// input is given, is parsed once in a ParseContext so that its stacks grow
+// to their final size. The lines are then parsed repeat more times, with
+// parseString too for single-character grammars, and the heap allocations
+// of those passes are counted. The check fails unless there are none.
+int runAllocCheck(int argc, char *argv[]) {
+  Grammar grammar;
+  ParseTables tables;
+  string grammarFile;
+  string inputFile;
+  int repeat = 3;
+  unsigned seed = 1;
+
+  for (int i = 2; i < argc; i++) {
+    string option = argv[i];
+    if (option == "--grammar" && i + 1 < argc) {
+      grammarFile = argv[++i];
+    } else if (option == "--input" && i + 1 < argc) {
+      inputFile = argv[++i];
+    } else if (option == "--repeat" && i + 1 < argc) {
+      repeat = max(1, atoi(argv[++i]));
+    } else if (option == "--seed" && i + 1 < argc) {
+      seed = atoi(argv[++i]);
+    } else {
+      cerr << "Unknown alloc-check option: " << option << endl;
+      return 1;
+    }
+  }
 
-        production.push_back(string(1,line[0]));
+  if (!loadGrammar(grammarFile, grammar)) {
+    return 1;
+  }
+  computeCanonicalCollection(grammar, tables, false);
+  TableView view = viewTables(tables);
+
+  vector<string> lines;
+  if (!inputFile.empty()) {
+    ifstream in(inputFile);
+    if (!in) {
+      cerr << "Cannot open input file " << inputFile << endl;
+      return 1;
+    }
+    string line;
+    while (getline(in, line)) {
+      if (!line.empty() && line.back() == '\r') {
+        line.pop_back();
       }
-
-      for(int i = 3; i < line.length(); i++){
-        if(!isupper(line[i])){
-          auto it = find(terminals.begin(),
-                 terminals.end(), line[i]);
-          if (it == terminals.end()) {
-            terminals.push_back(line[i]);
+      lines.push_back(line);
+    }
+  } else if (grammar.hasLexer()) {
+    cerr << "Grammars with a lexer need an --input file" << endl;
+    return 1;
+  } else {
+    try {
+      SentenceGenerator generator(grammar);
+      mt19937 random(seed);
+      vector<int> sentence;
+      for (int i = 0; i < 1000; i++) {
+        generator.generate(100, random, sentence);
+        string text;
+        for (int terminal : sentence) {
+          if (grammar.namedSymbols && !text.empty()) {
+            text += ' ';
           }
+          text += grammar.name(terminal);
         }
+        lines.push_back(text);
       }
-      production.push_back(line.substr(3, line.length()-1));
-
-      productions.push_back(production);
+    } catch (string e) {
+      cerr << "Cannot generate sentences: " << e << endl;
+      return 1;
+    }
   }
-  return 0;
-}
-
-void getQuestionProductions(vector<char> &nonTerminals, vector<char> &terminals, vector<vector<string> > &productions){
-  nonTerminals.push_back('D');
-  nonTerminals.push_back('E');
-  nonTerminals.push_back('T');
-  nonTerminals.push_back('F');
-
-  terminals.push_back('*');
-  terminals.push_back('+');
-  terminals.push_back('i');
-  terminals.push_back('(');
-  terminals.push_back(')');
-
-  vector<string> prodZero;
-  vector<string> prodOne;
-  vector<string> prodTwo;
-  vector<string> prodThree;
-  vector<string> prodFour;
-  vector<string> prodFive;
-  vector<string> prodSix;
-
-  prodZero.push_back("D");
-  prodZero.push_back("E");
-
-  prodOne.push_back("E");
-  prodOne.push_back("E+T");
-
-  prodTwo.push_back("E");
-  prodTwo.push_back("T");
-
-  prodThree.push_back("T");
-  prodThree.push_back("T*F");
 
-  prodFour.push_back("T");
-  prodFour.push_back("F");
+  ParseContext context;
+  size_t accepted = 0;
+  for (const string &line : lines) {
+    accepted += parseInput(line.data(), line.data() + line.size(), view,
+                           grammar, context);
+    if (!grammar.namedSymbols) {
+      parseString(line, tables);
+    }
+  }
 
-  prodFive.push_back("F");
-  prodFive.push_back("(E)");
+  size_t allocationsBefore = allocationCount.load();
+  size_t parses = 0;
+  size_t mismatches = 0;
+  for (int r = 0; r < repeat; r++) {
+    for (const string &line : lines) {
+      bool result = parseInput(line.data(), line.data() + line.size(), view,
+                               grammar, context);
+      parses++;
+      if (!grammar.namedSymbols) {
+        mismatches += parseString(line, tables) != result;
+        parses++;
+      }
+    }
+  }
+  size_t allocations = allocationCount.load() - allocationsBefore;
 
-  prodSix.push_back("F");
-  prodSix.push_back("i");
+  cout << "Records:               " << lines.size() << endl;
+  cout << "Accepted:              " << accepted << endl;
+  cout << "Counted parses:        " << parses << endl;
+  cout << "Stack capacity:        " << context.stateStack.capacity() << endl;
+  cout << "Heap allocations:      " << allocations << endl;
+  cout << "Mismatched results:    " << mismatches << endl;
 
-  productions.push_back(prodZero);
-  productions.push_back(prodOne);
-  productions.push_back(prodTwo);
-  productions.push_back(prodThree);
-  productions.push_back(prodFour);
-  productions.push_back(prodFive);
-  productions.push_back(prodSix);
+  return allocations == 0 && mismatches == 0 ? 0 : 1;
 }
+#endif
+
+int main(int argc, char *argv[]) {
+  if (argc > 1 && string(argv[1]) == "--batch") {
+    return runBatch(argc, argv);
+  }
+  if (argc > 1 && string(argv[1]) == "--tree") {
+    return runTree(argc, argv);
+  }
+  if (argc > 1 && string(argv[1]) == "--incremental") {
+    return runIncremental(argc, argv);
+  }
+  if (argc > 1 && string(argv[1]) == "--grammar-session") {
+    return runGrammarSession(argc, argv);
+  }
+  if (argc > 1 && string(argv[1]) == "--stream") {
+    return runStream(argc, argv);
+  }
+  if (argc > 1 && string(argv[1]) == "--generate") {
+    return runGenerate(argc, argv);
+  }
+  if (argc > 1 && string(argv[1]) == "--bench") {
+    return runBench(argc, argv);
+  }
+  if (argc > 1 && string(argv[1]) == "--table-stats") {
+    return runTableStats(argc, argv);
+  }
+  if (argc > 1 && string(argv[1]) == "--lexer-stats") {
+    return runLexerStats(argc, argv);
+  }
+  if (argc > 1 && string(argv[1]) == "--conflicts") {
+    return runConflicts(argc, argv);
+  }
+  if (argc > 1 && string(argv[1]) == "--alloc-check") {
+#ifdef SLR_PARSER_ALLOC_CHECK
+    return runAllocCheck(argc, argv);
+#else
+    cerr << "--alloc-check is not available: build with "
+         << "-DSLR_PARSER_ALLOC_CHECK to count heap allocations" << endl;
+    return 1;
+#endif
+  }
+  if (argc > 1 && string(argv[1]) == "--daemon") {
+    return runDaemon(argc, argv);
+  }
+  if (argc > 1 && string(argv[1]) == "--client") {
+    return runClient(argc, argv);
+  }
+  if (argc > 1 && string(argv[1]) == "--parallel-parse") {
+    return runParallelParse(argc, argv);
+  }
 
-int main() {
   // Define the grammar
   vector<char> nonTerminals;
   vector<char> terminals;
   vector<vector<string> > productions;
-  map<pair<int, char>, string> parsingTable;
-  map<pair<int, char>, int> gotoTable;
-  vector<set<LR0Item> > canonicalCollection;
+  Grammar grammar;
+  ParseTables tables;
+  vector<ItemSet> canonicalCollection;
   string input;
   string choice;
   bool result;
@@ -686,21 +9971,22 @@ int main() {
     cout << "\033[2J\033[1;1H";
 
     getQuestionProductions(nonTerminals, terminals, productions);
+    compileGrammar(grammar, nonTerminals, terminals, productions);
     // Compute the canonical collection
-    canonicalCollection = computeCanonicalCollection(
-        nonTerminals, terminals, productions, parsingTable, gotoTable);
+    canonicalCollection = computeCanonicalCollection(grammar, tables);
 
     cout << "\nCanonical Collection of LR(0) items:" << endl << endl;
-    displayCanonicalCollection(canonicalCollection);
+    displayCanonicalCollection(canonicalCollection, grammar);
     //
-    printParsingTable(parsingTable, gotoTable, productions, terminals,
-                      nonTerminals, canonicalCollection);
+    printParsingTable(tables);
 
     // Parse the input string
     cout << "\nEnter the string to parse: ";
     cin >> input;
+    // The '$' shown marks where the input ends, which is not a character
+    // the parser reads
+    result = parseString(input, tables);
     input.append("$");
-    result = parseString(input, parsingTable, productions, gotoTable);
     cout << "\nParsing result for string "
         << "(" << input << ")"
         << " : " << (result ? "ACCEPT" : "ERROR") << endl;
@@ -716,20 +10002,35 @@ int main() {
     getProductions(nonTerminals, terminals, productions);
 
     try{
-      canonicalCollection = computeCanonicalCollection(
-          nonTerminals, terminals, productions, parsingTable, gotoTable);
+      compileGrammar(grammar, nonTerminals, terminals, productions);
+      canonicalCollection = computeCanonicalCollection(grammar, tables);
 
       cout << "\nCanonical Collection of LR(0) items:" << endl << endl;
-      displayCanonicalCollection(canonicalCollection);
+      displayCanonicalCollection(canonicalCollection, grammar);
+
+      // Conflicts of the SLR(1) table may be resolved by LALR(1)
+      // lookaheads, else the grammar gets no parser
+      if (!tables.conflicts.empty()) {
+        cout << "\nConflicts of the SLR(1) table:" << endl << endl;
+        writeConflictReport(cout, grammar,
+                            collectConflicts(grammar, canonicalCollection,
+                                             tables),
+                            false);
+        computeCanonicalCollection(grammar, tables, false, NULL, TABLE_LALR);
+        if (!tables.conflicts.empty()) {
+          throw string("the grammar is not LALR(1)");
+        }
+        cout << "\nThe LALR(1) lookaheads resolve them, using the LALR(1) "
+             << "table instead" << endl;
+      }
       //
-      printParsingTable(parsingTable, gotoTable, productions, terminals,
-                        nonTerminals, canonicalCollection);
+      printParsingTable(tables);
 
       // Parse the input string
       cout << "\nEnter the string to parse: ";
       cin >> input;
+      result = parseString(input, tables);
       input.append("$");
-      result = parseString(input, parsingTable, productions, gotoTable);
       cout << "\nParsing result for string "
           << "(" << input << ")"
           << " : " << (result ? "ACCEPT" : "ERROR") << endl;
@@ -746,3 +10047,4 @@ int main() {
 
   
 }
+#endif
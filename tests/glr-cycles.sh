@@ -0,0 +1,58 @@
+#!/bin/sh
+# Regression test for cyclic grammars in the GLR parser, which used to
+# reduce forever on a single stack. Run it with the path to a built
+# SLRParser: tests/glr-cycles.sh ./SLRParser
+parser=${1:-./SLRParser}
+dir=$(mktemp -d)
+trap 'rm -rf "$dir"' EXIT
+failed=0
+
+# Function to parse the lines of $3 with the grammar $2 and compare the
+# answers with $4, giving each run 10 seconds and 1 GB
+check() {
+  printf '%s' "$2" > "$dir/grammar.txt"
+  printf '%s' "$3" > "$dir/input.txt"
+  actual=$( (ulimit -v 1000000; timeout 10 "$parser" --batch \
+      --grammar "$dir/grammar.txt" --input "$dir/input.txt") 2>&1)
+  if [ "$actual" != "$4" ]; then
+    echo "FAIL: $1"
+    echo "expected:"
+    echo "$4"
+    echo "got:"
+    echo "$actual"
+    failed=1
+  else
+    echo "ok: $1"
+  fi
+}
+
+# A unit cycle S -> S
+check "unit cycle" 'S->S
+S->a
+S->aaa
+A->AaS
+A->aSS
+' 'a
+aa
+aaa
+aaaa
+' 'ACCEPT
+ERROR
+ACCEPT
+ERROR'
+
+# A cycle through empty productions, S -> A A S with A -> ~ and A -> S
+check "empty cycle" 'S->AAS
+S->AAa
+S->aA
+A->~
+A->S
+A->a
+' '
+a
+aaaa
+' 'ERROR
+ACCEPT
+ACCEPT'
+
+exit $failed